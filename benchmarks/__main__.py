@@ -0,0 +1,218 @@
+"""Encoder benchmark suite.
+
+    python3 -m benchmarks [--quick] [--filter SUBSTRING]
+
+Each case runs in a fresh subprocess so peak RSS is per case, after its
+output is checked against json.dumps. Reported:
+
+    MB/s     output bytes / best wall time
+    peak KB  most memory held at once during one encode, the output
+             included (tracemalloc); short-lived allocations only show
+             here if they add to that high-water mark
+    peak RSS process high-water mark, including the input
+
+Build the extension in place first (python3 setup.py build_ext --inplace).
+"""
+
+import argparse
+import gc
+import json
+import os
+import resource
+import subprocess
+import sys
+import time
+import tracemalloc
+
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+from benchmarks import corpora
+
+def json_cases():
+    for name in corpora.CORPORA:
+        yield name, ('corpus', name)
+    for name in corpora.SYNTHETIC:
+        yield name, ('synthetic', name)
+
+XML_CASES = ['xml_generator', 'xml_writer', 'xml_template']
+
+def load_json_input(kind, name):
+    if kind == 'corpus':
+        path = corpora.fetch(name)
+        if path is None:
+            return None
+        with open(path, encoding='utf-8') as f:
+            return json.load(f)
+    return corpora.SYNTHETIC[name]()
+
+def make_json_runners(o):
+    import encoder.json
+
+    encoder_ = encoder.json.Encoder()
+    stdlib = json.JSONEncoder(ensure_ascii=False, check_circular=False, separators=(',', ':'))
+
+    return {
+        'Encoder.encode': lambda: encoder_.encode(o),
+        'Encoder.encode_bytes': lambda: encoder_.encode_bytes(o),
+        'json.dumps': lambda: stdlib.encode(o),
+        'json.dumps+encode': lambda: stdlib.encode(o).encode('utf-8'),
+        }
+
+def make_xml_runners(case):
+    import encoder.xml
+    import xml.etree.ElementTree as ET
+
+    records = corpora.xml_records()
+    encoder_ = encoder.xml.Encoder()
+    runners = {}
+
+    if case == 'xml_generator':
+        feed = corpora.Feed(records)
+        runners['Encoder.encode_bytes(__xml__)'] = lambda: encoder_.encode_bytes(feed)
+    elif case == 'xml_writer':
+        tag = encoder_.tag
+
+        def run():
+            w = encoder_.writer()
+            w.start(tag.feed)
+            for r in records:
+                w.start(tag.record)
+                w.element(tag.id, r.id)
+                w.element(tag.name, r.name)
+                w.element(tag.score, r.score)
+                w.end()
+            w.end()
+            return w.getvalue()
+
+        runners['XmlWriter'] = run
+    elif case == 'xml_template':
+        template = encoder_.template(('record', [('id', 0), ('name', 1), ('score', 2)]))
+        rows = [(r.id, r.name, r.score) for r in records]
+        runners['Template.encode_bytes'] = lambda: b'<feed>' + template.encode_bytes(rows) + b'</feed>'
+
+    def etree():
+        feed = ET.Element('feed')
+        for r in records:
+            record = ET.SubElement(feed, 'record')
+            ET.SubElement(record, 'id').text = str(r.id)
+            ET.SubElement(record, 'name').text = r.name
+            ET.SubElement(record, 'score').text = str(r.score)
+        return ET.tostring(feed)
+
+    runners['ElementTree.tostring'] = etree
+
+    return runners
+
+def check_json(run, o):
+    """Raise unless run() decodes to the same as json.dumps(o) does."""
+    output = run()
+    if isinstance(output, bytes):
+        output = output.decode('utf-8')
+    if json.loads(output) != json.loads(json.dumps(o)):
+        raise ValueError('output differs from json.dumps')
+
+def measure(run, repeat):
+    output = run()
+    size = len(output.encode('utf-8')) if isinstance(output, str) else len(output)
+    del output
+
+    best = float('inf')
+    for _ in range(repeat):
+        gc.collect()
+        t0 = time.perf_counter()
+        run()
+        best = min(best, time.perf_counter() - t0)
+
+    # Only what is allocated from here on is traced
+    tracemalloc.start()
+    output = run()
+    peak = tracemalloc.get_traced_memory()[1]
+    tracemalloc.stop()
+    del output
+
+    return {
+        'bytes': size,
+        'seconds': best,
+        'mb_per_s': size / best / 1e6,
+        'peak_kb': peak // 1024,
+        }
+
+def run_case(case, runner_name, repeat):
+    """In the child: run one (case, runner) and print a JSON result line."""
+    o = None
+
+    if case in XML_CASES:
+        runners = make_xml_runners(case)
+    else:
+        kind, name = dict(json_cases())[case]
+        o = load_json_input(kind, name)
+        if o is None:
+            print(json.dumps({'skipped': 'corpus unavailable: ' + name}))
+            return
+        runners = make_json_runners(o)
+
+    try:
+        # Throughput of wrong output is no comparison
+        if o is not None:
+            check_json(runners[runner_name], o)
+        result = measure(runners[runner_name], repeat)
+    except Exception as e:
+        result = {'error': '{}: {}'.format(type(e).__name__, e)}
+
+    result['peak_rss_kb'] = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    print(json.dumps(result))
+
+def runner_names(case):
+    if case in XML_CASES:
+        return list(make_xml_runners(case))
+    return ['Encoder.encode', 'Encoder.encode_bytes', 'json.dumps', 'json.dumps+encode']
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--quick', action='store_true', help='fewer repetitions')
+    parser.add_argument('--filter', default='', help='only cases containing this')
+    parser.add_argument('--json', action='store_true', help='machine readable output')
+    parser.add_argument('--child', nargs=2, metavar=('CASE', 'RUNNER'), help=argparse.SUPPRESS)
+    args = parser.parse_args()
+
+    repeat = 3 if args.quick else 10
+
+    if args.child:
+        run_case(args.child[0], args.child[1], repeat)
+        return
+
+    cases = [name for name, _ in json_cases()] + XML_CASES
+    results = []
+
+    if not args.json:
+        print('{:<18} {:<30} {:>10} {:>10} {:>10} {:>12}'.format('case', 'runner', 'MB/s', 'ms', 'peak KB', 'peak RSS KB'))
+
+    for case in cases:
+        if args.filter not in case:
+            continue
+
+        for runner in runner_names(case):
+            out = subprocess.run(
+                [sys.executable, '-m', 'benchmarks', '--child', case, runner] + (['--quick'] if args.quick else []),
+                cwd=os.path.dirname(os.path.dirname(os.path.abspath(__file__))),
+                stdout=subprocess.PIPE, check=True, universal_newlines=True)
+
+            result = json.loads(out.stdout.strip().splitlines()[-1])
+            result.update(case=case, runner=runner)
+            results.append(result)
+
+            if args.json:
+                continue
+
+            if 'skipped' in result or 'error' in result:
+                print('{:<18} {:<30} {}'.format(case, runner, result.get('skipped') or result.get('error')))
+            else:
+                print('{:<18} {:<30} {:>10.1f} {:>10.2f} {:>10} {:>12}'.format(
+                    case, runner, result['mb_per_s'], result['seconds'] * 1e3, result['peak_kb'], result['peak_rss_kb']))
+
+    if args.json:
+        json.dump(results, sys.stdout, indent=2)
+        print()
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,343 @@
+/*
+ * Tight-loop microbenchmarks of the Buffer primitives and string appenders,
+ * free of interpreter overhead.
+ *
+ * encoder.c is included rather than linked so its static helpers
+ * (_append_str_1byte_kind, ...) can be driven directly.
+ */
+
+#include <Python.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "../src/encoder.c"
+
+/* module.c */
+PyMODINIT_FUNC PyInit__encoder(void);
+
+#define ITERATIONS 10000000
+#define ROUNDS 5
+
+typedef struct {
+    const char *name;
+    double ns_per_op;
+    double cycles_per_op;
+    double bytes_per_cycle;
+} Result;
+
+static uint64_t
+cycles(void)
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Keeps the optimizer from discarding the work. */
+static volatile int sink;
+
+/*
+ * Two-digits-at-a-time table formatter, for comparison against the
+ * sprintf in append_longlong.
+ */
+static const char DIGIT_PAIRS[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static int
+append_longlong_table(Buffer *self, long long l)
+{
+    char scratch[_SPRINTF_MAX_LONG_LONG_LENGTH];
+    char *end = scratch + sizeof(scratch);
+    char *p = end;
+    unsigned long long u = l < 0 ? 0ULL - (unsigned long long)l : (unsigned long long)l;
+
+    if (ensure_room(self, _SPRINTF_MAX_LONG_LONG_LENGTH) == -1)
+        return -1;
+
+    while (u >= 100) {
+        unsigned i = (u % 100) * 2;
+        u /= 100;
+        *--p = DIGIT_PAIRS[i + 1];
+        *--p = DIGIT_PAIRS[i];
+    }
+    if (u >= 10) {
+        *--p = DIGIT_PAIRS[u * 2 + 1];
+        *--p = DIGIT_PAIRS[u * 2];
+    }
+    else {
+        *--p = (char)('0' + u);
+    }
+    if (l < 0)
+        *--p = '-';
+
+    append_string_unsafe(self, p, end - p);
+    return 0;
+}
+
+/*
+ * Each kernel runs `iterations` operations against `b`, rewinding the
+ * buffer before it would need to grow, and returns bytes appended.
+ */
+typedef long long (*Kernel)(Buffer *b, void *arg, int iterations);
+
+#define REWIND(b) if ((b)->_index > (b)->_size - 128) (b)->_index = 0
+
+static long long values[1024];
+static double doubles[1024];
+
+static long long
+kernel_ensure_room(Buffer *b, void *arg, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        if (ensure_room(b, 16) == -1)
+            return -1;
+        b->_index += 16;
+        REWIND(b);
+    }
+    return (long long)n * 16;
+}
+
+static long long
+kernel_append_longlong(Buffer *b, void *arg, int n)
+{
+    long long bytes = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        int before = b->_index;
+        if (append_longlong(b, values[i & 1023]) == -1)
+            return -1;
+        bytes += b->_index - before;
+        REWIND(b);
+    }
+    return bytes;
+}
+
+static long long
+kernel_append_longlong_table(Buffer *b, void *arg, int n)
+{
+    long long bytes = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        int before = b->_index;
+        if (append_longlong_table(b, values[i & 1023]) == -1)
+            return -1;
+        bytes += b->_index - before;
+        REWIND(b);
+    }
+    return bytes;
+}
+
+static long long
+kernel_append_double(Buffer *b, void *arg, int n)
+{
+    long long bytes = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        int before = b->_index;
+        if (append_double(b, doubles[i & 1023]) == -1)
+            return -1;
+        bytes += b->_index - before;
+        REWIND(b);
+    }
+    return bytes;
+}
+
+static long long
+kernel_append_string(Buffer *b, void *arg, int n)
+{
+    char *s = arg;
+    int length = strlen(s);
+    int i;
+    for (i = 0; i < n; i++) {
+        if (append_string(b, s, length) == -1)
+            return -1;
+        REWIND(b);
+    }
+    return (long long)n * length;
+}
+
+static long long
+kernel_append_str_1byte_kind(Buffer *b, void *arg, int n)
+{
+    Encoder *encoder = (Encoder *)((PyObject **)arg)[0];
+    PyObject *s = ((PyObject **)arg)[1];
+    int length = PyUnicode_GET_LENGTH(s);
+    long long bytes = 0;
+    int i;
+
+    encoder->buffer = b;
+
+    for (i = 0; i < n; i++) {
+        int before = b->_index;
+        if (_append_str_1byte_kind(encoder, s, length) == -1)
+            return -1;
+        bytes += b->_index - before;
+        REWIND(b);
+    }
+    return bytes;
+}
+
+static int
+run(const char *name, Kernel kernel, void *arg, int iterations)
+{
+    Buffer *b = new_buffer();
+    if (b == NULL)
+        return -1;
+
+    /* Warm up; also grows nothing, as kernels rewind. */
+    if (kernel(b, arg, iterations / 10) == -1) {
+        delete_buffer(b);
+        return -1;
+    }
+
+    Result best = {name, 1e300, 0, 0};
+    int round;
+
+    for (round = 0; round < ROUNDS; round++) {
+        b->_index = 0;
+
+        double t0 = now_ns();
+        uint64_t c0 = cycles();
+
+        long long bytes = kernel(b, arg, iterations);
+
+        uint64_t c1 = cycles();
+        double t1 = now_ns();
+
+        if (bytes == -1) {
+            delete_buffer(b);
+            return -1;
+        }
+
+        double ns_per_op = (t1 - t0) / iterations;
+        if (ns_per_op < best.ns_per_op) {
+            best.ns_per_op = ns_per_op;
+            best.cycles_per_op = (double)(c1 - c0) / iterations;
+            best.bytes_per_cycle = c1 != c0 ? bytes / (double)(c1 - c0) : 0;
+        }
+    }
+
+    sink = b->_data[0];
+    delete_buffer(b);
+
+    printf("%-32s %10.2f %12.1f %14.3f\n", best.name, best.ns_per_op, best.cycles_per_op, best.bytes_per_cycle);
+    return 0;
+}
+
+static Encoder *
+make_encoder(PyObject *module)
+{
+    /* A minimal concrete subclass: STRING_ESCAPES as in encoder.json. */
+    PyObject *escapes = Py_BuildValue("{s:s,s:s,s:s}", "\\", "\\\\", "\"", "\\\"", "\n", "\\n");
+    PyObject *dict = Py_BuildValue("{s:O,s:s}", "STRING_ESCAPES", escapes, "STRING_QUOTE", "\"");
+    Py_XDECREF(escapes);
+    if (dict == NULL)
+        return NULL;
+
+    PyObject *base = PyObject_GetAttrString(module, "Encoder");
+    if (base == NULL) {
+        Py_DECREF(dict);
+        return NULL;
+    }
+
+    PyObject *type = PyObject_CallFunction((PyObject *)&PyType_Type, "s(O)O", "BenchEncoder", base, dict);
+    Py_DECREF(base);
+    Py_DECREF(dict);
+    if (type == NULL)
+        return NULL;
+
+    PyObject *encoder = PyObject_CallNoArgs(type);
+    Py_DECREF(type);
+
+    return (Encoder *)encoder;
+}
+
+int
+main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : ITERATIONS;
+    int i;
+
+    /* This build of _encoder (module.c), rather than any installed one */
+    PyImport_AppendInittab("_encoder", PyInit__encoder);
+    Py_Initialize();
+
+    PyObject *module = PyImport_ImportModule("_encoder");
+    if (module == NULL)
+        goto error;
+
+    srand(1);
+    for (i = 0; i < 1024; i++) {
+        values[i] = ((long long)rand() << 20) ^ rand();
+        if (i & 1)
+            values[i] = -values[i] / (i + 1);
+        doubles[i] = (rand() - RAND_MAX / 2) / 1000.0;
+    }
+
+    Encoder *encoder = make_encoder(module);
+    if (encoder == NULL)
+        goto error;
+    Buffer *encoder_buffer = encoder->buffer;
+
+    /* Normally read on the way in by _append_str. */
+    if (_get_str_quote(encoder) == -1)
+        goto error;
+
+    PyObject *plain = PyUnicode_FromString("the quick brown fox jumps over the lazy dog");
+    PyObject *escaped = PyUnicode_FromString("say \"hello\"\nand \\goodbye\\ to the \"lazy\" dog");
+    if (plain == NULL || escaped == NULL)
+        goto error;
+
+    PyObject *plain_arg[2] = {(PyObject *)encoder, plain};
+    PyObject *escaped_arg[2] = {(PyObject *)encoder, escaped};
+
+    printf("%-32s %10s %12s %14s\n", "kernel", "ns/op", "cycles/op", "bytes/cycle");
+
+    if (run("ensure_room(16)", kernel_ensure_room, NULL, iterations) == -1 ||
+        run("append_longlong (sprintf)", kernel_append_longlong, NULL, iterations) == -1 ||
+        run("append_longlong (table)", kernel_append_longlong_table, NULL, iterations) == -1 ||
+        run("append_double", kernel_append_double, NULL, iterations) == -1 ||
+        run("append_string (43 bytes)", kernel_append_string, "the quick brown fox jumps over the lazy dog", iterations) == -1 ||
+        run("_append_str_1byte_kind plain", kernel_append_str_1byte_kind, plain_arg, iterations) == -1 ||
+        run("_append_str_1byte_kind escaped", kernel_append_str_1byte_kind, escaped_arg, iterations) == -1)
+        goto error;
+
+    /* Give the encoder its own buffer back before it is deallocated. */
+    encoder->buffer = encoder_buffer;
+
+    Py_DECREF(plain);
+    Py_DECREF(escaped);
+    Py_DECREF(encoder);
+
+    Py_Finalize();
+    return 0;
+
+  error:
+    PyErr_Print();
+    return 1;
+}
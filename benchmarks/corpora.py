@@ -0,0 +1,102 @@
+"""Benchmark inputs.
+
+The standard corpora are the ones used by nativejson-benchmark (and orjson);
+they are downloaded once into benchmarks/data/. Synthetic sets are generated
+from a fixed seed so every run sees the same input.
+"""
+
+import os
+import random
+import urllib.request
+
+DATA_DIR = os.path.join(os.path.dirname(__file__), 'data')
+
+CORPUS_URL = 'https://raw.githubusercontent.com/miloyip/nativejson-benchmark/master/data/{}'
+
+CORPORA = [
+    'twitter.json',
+    'canada.json',
+    'citm_catalog.json',
+    ]
+
+SEED = 20130101
+
+def corpus_path(name):
+    return os.path.join(DATA_DIR, name)
+
+def fetch(name):
+    """Path to corpus `name`, downloading it if needed. None if unavailable."""
+    path = corpus_path(name)
+
+    if not os.path.exists(path):
+        os.makedirs(DATA_DIR, exist_ok=True)
+        try:
+            urllib.request.urlretrieve(CORPUS_URL.format(name), path + '.part')
+        except OSError:
+            return None
+        os.rename(path + '.part', path)
+
+    return path
+
+def int_heavy():
+    r = random.Random(SEED)
+    return [[r.randint(-2 ** 62, 2 ** 62) for _ in range(64)] for _ in range(2000)]
+
+def float_heavy():
+    r = random.Random(SEED)
+    return [[r.uniform(-1e6, 1e6) for _ in range(64)] for _ in range(2000)]
+
+def non_ascii_heavy():
+    r = random.Random(SEED)
+    alphabets = ['éèàüößñ', 'αβγδεζηθ', '日本語漢字かな', '😀🚀🌍']
+    # 'name' stays within Latin-1, so takes the 1-byte string path
+    return [
+        {'id': i, 'name': ''.join(r.choice('abcdeéèàüößñ') for _ in range(20)),
+         'text': ''.join(r.choice(r.choice(alphabets)) for _ in range(40))}
+        for i in range(5000)
+        ]
+
+def deep_nesting():
+    o = 'leaf'
+    for i in range(400):
+        o = {'level': i, 'child': [o]}
+    return [o] * 20
+
+SYNTHETIC = {
+    'int_heavy': int_heavy,
+    'float_heavy': float_heavy,
+    'non_ascii_heavy': non_ascii_heavy,
+    'deep_nesting': deep_nesting,
+    }
+
+class Record:
+    """One element of an XML feed."""
+
+    __slots__ = ('id', 'name', 'score')
+
+    def __init__(self, id, name, score):
+        self.id = id
+        self.name = name
+        self.score = score
+
+    def __xml__(self, tag):
+        with tag.record():
+            with tag.id():
+                yield self.id
+            with tag.name():
+                yield self.name
+            with tag.score():
+                yield self.score
+
+class Feed:
+    def __init__(self, records):
+        self.records = records
+
+    def __xml__(self, tag):
+        with tag.feed():
+            for record in self.records:
+                yield record
+
+def xml_records():
+    r = random.Random(SEED)
+    return [Record(i, 'name <{}> & co'.format(r.randint(0, 1000)), r.randint(0, 100)) for i in range(20000)]
@@ -1,5 +1,8 @@
 import _encoder
 
+Raw = _encoder.Raw
+EncodeLimitError = _encoder.EncodeLimitError
+
 class CannotEncode(Exception):
     pass
 
@@ -36,5 +39,25 @@ class Encoder(_encoder.Encoder):
     def STRING_ESCAPES(self) -> (dict, str, str):
         raise NotImplementedError
 
+    @property
+    def STRING_QUOTE(self) -> str:
+        raise NotImplementedError
+
+    # Of datetime.datetime, datetime.date, datetime.time, uuid.UUID,
+    # decimal.Decimal and enum.Enum: those to encode natively rather than
+    # through make_iterencode.
+    NATIVE_TYPES = ()
+
+    # Bytes of memoize()d output kept, at most.
+    MEMO_BUDGET = 16 * 1024 * 1024
+
+    # Or a method taking the bytes of each Raw before it is written, and
+    # raising if they are unfit.
+    validate_raw = None
+
     def make_iterencode(self, type:type):
         raise CannotEncode(type)
+
+    def encode_records(self, columns) -> bytes:
+        # Rows as JSON objects, so encoder.json.Encoder's alone
+        raise TypeError('{}: encode_records() is JSON only'.format(type(self).__module__))
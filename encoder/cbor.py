@@ -0,0 +1,12 @@
+import _encoder
+
+from . import abc
+
+class Encoder(abc.Encoder, _encoder.CborEncoder):
+    """CBOR: RFC 8949
+
+    Iterators and make_iterencode iterables are written as
+    indefinite-length arrays of what they yield.
+    """
+
+    DICT_PRESERVE_ORDER = True
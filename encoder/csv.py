@@ -0,0 +1,22 @@
+import _encoder
+
+from . import abc
+
+class Encoder(abc.Encoder, _encoder.CsvEncoder):
+    """RFC 4180 style CSV, from iterables of row sequences.
+
+    Fields are quoted only when they contain DELIMITER, QUOTE or a line break.
+    """
+
+    DELIMITER = ','
+    QUOTE = '"'
+    LINE_TERMINATOR = '\r\n'
+
+    # As the csv module writes them
+    NONE = ''
+    TRUE = 'True'
+    FALSE = 'False'
+
+class TsvEncoder(Encoder):
+    DELIMITER = '\t'
+    LINE_TERMINATOR = '\n'
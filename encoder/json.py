@@ -1,3 +1,5 @@
+import _encoder
+
 from . import abc
 
 class Encoder(abc.Encoder):
@@ -10,6 +12,10 @@ class Encoder(abc.Encoder):
 
     DICT_PRESERVE_ORDER = True
 
+    STRING_QUOTE = '"'
+
+    encode_records = _encoder.Encoder.encode_records
+
     @property
     def STRING_ESCAPES(self):
         # See: json.encoder
@@ -27,3 +33,140 @@ class Encoder(abc.Encoder):
             escapes.setdefault(chr(i), '\\u{0:04x}'.format(i))
 
         return escapes
+
+    # encode_to_stream(): containers estimated to encode to more than this
+    # many bytes are descended into rather than encoded in one call, and
+    # their items encoded in batches of about this size, so no single call
+    # blocks for long. Past STREAM_DESCEND_DEPTH levels, whatever is left
+    # is encoded whole.
+    STREAM_CHUNK_SIZE = 16 * 1024
+    STREAM_DESCEND_DEPTH = 64
+
+    async def encode_to_stream(self, o, writer, slice_bytes:int=64 * 1024, slice_seconds:float=None):
+        '''
+        Encode `o` to `writer` (e.g. an asyncio.StreamWriter) a slice at a
+        time: after `slice_bytes` of output, or `slice_seconds` of encoding,
+        write what there is, drain, and let the event loop run before
+        carrying on.
+        '''
+        import asyncio
+        import time
+
+        pending = []
+        pending_size = 0
+        slice_start = time.monotonic()
+
+        for chunk in self._iterencode_chunks(o):
+            pending.append(chunk)
+            pending_size += len(chunk)
+
+            if pending_size < slice_bytes and (
+                    slice_seconds is None or time.monotonic() - slice_start < slice_seconds):
+                continue
+
+            writer.write(b''.join(pending))
+            pending.clear()
+            pending_size = 0
+
+            await writer.drain()
+            # drain() returns at once below the high-water mark
+            await asyncio.sleep(0)
+
+            slice_start = time.monotonic()
+
+        if pending:
+            writer.write(b''.join(pending))
+            await writer.drain()
+
+    def _iterencode_chunks(self, o, depth=0):
+        '''
+        Byte strings joining to encode_bytes(o), each from a bounded amount
+        of work.
+        '''
+        limit = self.STREAM_CHUNK_SIZE
+
+        if (depth == self.STREAM_DESCEND_DEPTH or not isinstance(o, (list, tuple, dict))
+                or _estimate_size(o, limit) <= limit):
+            yield self.encode_bytes(o)
+            return
+
+        is_dict = isinstance(o, dict)
+        if is_dict:
+            run = {}
+            items = o.items()
+        else:
+            run = []
+            items = ((None, item) for item in o)
+
+        yield b'{' if is_dict else b'['
+        separator = b''
+        run_size = 0
+
+        for key, value in items:
+            container = isinstance(value, (list, tuple, dict))
+            if container:
+                size = _estimate_size(value, limit)
+            elif isinstance(value, (str, bytes)):
+                size = len(value) + 2
+            else:
+                size = 8
+
+            if container and size > limit:
+                if run:
+                    yield separator + self.encode_bytes(run)[1:-1]
+                    separator = b','
+                    run.clear()
+                    run_size = 0
+                if is_dict:
+                    yield separator + self.encode_bytes(key) + b':'
+                else:
+                    yield separator
+                yield from self._iterencode_chunks(value, depth + 1)
+                separator = b','
+                continue
+
+            if is_dict:
+                run[key] = value
+            else:
+                run.append(value)
+            run_size += size
+
+            if run_size >= limit:
+                yield separator + self.encode_bytes(run)[1:-1]
+                separator = b','
+                run.clear()
+                run_size = 0
+
+        if run:
+            yield separator + self.encode_bytes(run)[1:-1]
+        yield b'}' if is_dict else b']'
+
+def _estimate_size(o, limit):
+    '''
+    Roughly len(encode_bytes(o)), counted only until it passes `limit`, so
+    at a cost bounded by `limit` however large `o` is.
+    '''
+    size = 0
+    stack = [o]
+
+    while stack:
+        o = stack.pop()
+
+        if isinstance(o, (str, bytes)):
+            size += len(o) + 2
+        elif isinstance(o, dict):
+            size += 2 + 2 * len(o)
+            if size <= limit:
+                stack.extend(o.keys())
+                stack.extend(o.values())
+        elif isinstance(o, (list, tuple)):
+            size += 2 + len(o)
+            if size <= limit:
+                stack.extend(o)
+        else:
+            size += 8
+
+        if size > limit:
+            break
+
+    return size
@@ -0,0 +1,11 @@
+import _encoder
+
+from . import abc
+
+class Encoder(abc.Encoder, _encoder.MsgpackEncoder):
+    """MessagePack: https://github.com/msgpack/msgpack/blob/master/spec.md
+
+    make_iterencode hooks should yield a single object per value.
+    """
+
+    DICT_PRESERVE_ORDER = True
@@ -17,15 +17,24 @@ class Encoder(abc.Encoder):
     TRUE = '1'
     FALSE = '0'
 
+    STRING_QUOTE = ''
+
     STRING_ESCAPES = {
         '<': '&lt;',
         '>': '&gt;',
         '&': '&amp;',
+        '"': '&quot;',
         }
 
     def __init__(self):
         self.tag = _TagFactory(self)
 
+    def writer(self):
+        return _encoder.XmlWriter(self)
+
+    def template(self, spec):
+        return _encoder.Template(self, spec)
+
     def make_iterencode(self, type):
         if hasattr(type, '__xml__'):
             return type.__xml__, self.tag
@@ -1,15 +1,89 @@
 #ifndef _ENCODER_BUFFER_H
 #define _ENCODER_BUFFER_H
 
-typedef struct {
+typedef struct _Buffer Buffer;
+
+struct _Buffer {
     char *_data;
     int _index;
     int _size;
-} Buffer;
+
+    /* When set, called by _Buffer_resize instead of growing _data */
+    int (*_spill)(Buffer *self, int length);
+    void *_spill_state;
+
+    /* Open frames, all pushed by _owner: see Buffer_push_frame */
+    int _frames;
+    unsigned long _owner;
+#ifdef ENCODER_STATS
+    int _resizes;
+    int _peak_size;
+#endif
+};
+
+/*
+ * Segmented mode: once _data is full it is sealed onto the chain as is and
+ * a fresh segment takes its place, so appended bytes never move.
+ */
+typedef struct {
+    char *data;
+    int length;
+    int size;
+} Segment;
+
+/* Free segment-sized blocks kept for reuse across encodes; see module.h */
+#define SEGMENT_POOL_MAX 16
+
+typedef struct {
+    char *blocks[SEGMENT_POOL_MAX];
+    int length;
+} SegmentPool;
+
+typedef struct {
+    Segment *segments;
+    Py_ssize_t count;
+    Py_ssize_t size;
+    Py_ssize_t total;
+    SegmentPool *pool;
+
+    /* The buffer's own storage, restored by Buffer_end_segments */
+    char *_data;
+    int _size;
+} SegmentChain;
+
+/*
+ * One encode call's share of the Buffer, so encodes can nest (e.g. a
+ * make_iterencode hook calling encode()): output goes after whatever an
+ * enclosing call has so far, and is dropped again on pop. Spilling is
+ * suspended within, so the enclosing call's output stays in place.
+ *
+ * Frames only nest last-in-first-out, so they all belong to one thread:
+ * pushing from another while any is open fails with RuntimeError.
+ */
+typedef struct {
+    int start;
+    int (*spill)(Buffer *self, int length);
+    void *spill_state;
+} BufferFrame;
 
 /* Prototypes */
 Buffer* new_buffer(void);
 void delete_buffer(Buffer *buffer);
+void Buffer_shrink(Buffer *self, int size);
+
+/* repr(d) into `out`, at most _SPRINTF_MAX_DOUBLE_LENGTH chars: its length, or -1. See dtoa.c */
+int format_double(char *out, double d);
+
+int        Buffer_begin_segments (Buffer *self, SegmentChain *chain, SegmentPool *pool);
+int        Buffer_seal_segment   (Buffer *self);
+void       Buffer_end_segments   (Buffer *self);
+Py_ssize_t SegmentChain_writev   (SegmentChain *chain, int fd);
+void       SegmentPool_release   (SegmentPool *pool, char *data, int size);
+void       SegmentPool_clear     (SegmentPool *pool);
+
+Py_LOCAL_INLINE(int)       Buffer_push_frame     (Buffer *self, BufferFrame *frame);
+Py_LOCAL_INLINE(void)      Buffer_pop_frame      (Buffer *self, BufferFrame *frame);
+Py_LOCAL_INLINE(PyObject*) Buffer_frame_as_bytes (Buffer *self, BufferFrame *frame);
 
 Py_LOCAL_INLINE(int) ensure_room     (Buffer *self, int length);
 
@@ -30,15 +104,15 @@ Py_LOCAL_INLINE(PyObject*) Buffer_as_bytes (Buffer *self);
 
 /* TODO: calc these instead of fudging. */
 #define _SPRINTF_MAX_LONG_LONG_LENGTH 31
-#define _SPRINTF_MAX_DOUBLE_LENGTH 51
+#define _SPRINTF_MAX_DOUBLE_LENGTH 31
 
-int _Buffer_resize(Buffer *self);
+int _Buffer_resize(Buffer *self, int length);
 
 Py_LOCAL_INLINE(int)
 ensure_room(Buffer *self, int length)
 {
     if (self->_index + length >= self->_size) {
-        if (_Buffer_resize(self) == -1) {
+        if (_Buffer_resize(self, length) == -1) {
             return -1;
         }
     }
@@ -63,7 +137,7 @@ Py_LOCAL_INLINE(int)
 append_char(Buffer *self, const char c)
 {
     if (self->_index == self->_size)
-        if (_Buffer_resize(self) == -1)
+        if (_Buffer_resize(self, 1) == -1)
             return -1;
 
     append_char_unsafe(self, c);
@@ -77,6 +151,10 @@ append_char_unsafe(Buffer *self, const char c)
     self->_data[self->_index++] = c;
 }
 
+/*
+ * As repr(d): the shortest digits that round trip, e.g. 3.0, 1e-07, 1e+300.
+ * Non-finite values come out as inf/nan, so formats without those check first.
+ */
 Py_LOCAL_INLINE(int)
 append_double(Buffer *self, double d)
 {
@@ -84,7 +162,7 @@ append_double(Buffer *self, double d)
         return -1;
     }
 
-    int num_chars = sprintf(&self->_data[self->_index], "%f", d);
+    int num_chars = format_double(&self->_data[self->_index], d);
     if (num_chars < 0) {
         PyErr_SetString(PyExc_RuntimeError, "failure from sprintf on float");
         return -1;
@@ -92,11 +170,6 @@ append_double(Buffer *self, double d)
 
     self->_index += num_chars;
 
-    /* Trim trailing 0's - does not seem to be way to tell sprintf to do so. */
-    while (self->_data[self->_index - 1] == '0') {
-        self->_index--;
-    }
-
     return 0;
 }
 
@@ -138,10 +211,46 @@ append_string(Buffer *self, char *string, int length)
 Py_LOCAL_INLINE(void)
 append_string_unsafe(Buffer *self, char *string, int length)
 {
-    strncpy(&(self->_data)[self->_index], string, length);
+    memcpy(&(self->_data)[self->_index], string, length);
     self->_index += length;
 }
 
+Py_LOCAL_INLINE(int)
+Buffer_push_frame(Buffer *self, BufferFrame *frame)
+{
+    unsigned long thread = PyThread_get_thread_ident();
+
+    if (self->_frames != 0 && self->_owner != thread) {
+        PyErr_SetString(PyExc_RuntimeError, "encode already in progress in another thread");
+        return -1;
+    }
+    self->_owner = thread;
+    self->_frames++;
+
+    frame->start = self->_index;
+    frame->spill = self->_spill;
+    frame->spill_state = self->_spill_state;
+
+    self->_spill = NULL;
+    self->_spill_state = NULL;
+    return 0;
+}
+
+Py_LOCAL_INLINE(void)
+Buffer_pop_frame(Buffer *self, BufferFrame *frame)
+{
+    self->_index = frame->start;
+    self->_spill = frame->spill;
+    self->_spill_state = frame->spill_state;
+    self->_frames--;
+}
+
+Py_LOCAL_INLINE(PyObject*)
+Buffer_frame_as_bytes(Buffer *self, BufferFrame *frame)
+{
+    return PyBytes_FromStringAndSize(&self->_data[frame->start], self->_index - frame->start);
+}
+
 Py_LOCAL_INLINE(PyObject*)
 Buffer_as_bytes(Buffer *self) {
     return PyBytes_FromStringAndSize(self->_data, self->_index);
@@ -3,12 +3,97 @@
 
 #include "buffer.h"
 
-extern PyTypeObject Encoder_Type;
+/*
+ * Build with ENCODER_STATS defined (ENCODER_STATS=1 python3 setup.py build_ext)
+ * for per-Encoder counters via Encoder.stats(). Otherwise they compile away.
+ */
+#ifdef ENCODER_STATS
+typedef struct {
+    unsigned long long bytes_out;
+
+    /* Objects per _append branch */
+    unsigned long long none;
+    unsigned long long bool_true;
+    unsigned long long bool_false;
+    unsigned long long int_;
+    unsigned long long float_;
+    unsigned long long str;
+    unsigned long long bytes;
+    unsigned long long sequence;
+    unsigned long long dict;
+    unsigned long long mapping;
+
+    unsigned long long str_1byte;
+    unsigned long long str_naive;
+    unsigned long long escapes;     /* Substitutions on the 1-byte path */
+
+    unsigned long long memo_hits;
+    unsigned long long memo_misses;
+
+    PyObject *iterencode;           /* dict: type -> make_iterencode fallbacks */
+} EncoderStats;
+
+#define STATS_INC(self, field)        ((self)->stats.field++)
+#define STATS_ADD(self, field, n)     ((self)->stats.field += (n))
+#else
+#define STATS_INC(self, field)
+#define STATS_ADD(self, field, n)
+#endif
+
+typedef struct _Memo Memo;
+typedef struct _ModuleState ModuleState;
+
+/*
+ * One encode call's max_depth/max_items/max_bytes (limits.c); PY_SSIZE_T_MAX
+ * when not given. max_bytes is kept by clamping the Buffer's _size, so
+ * ensure_room's fast path needs no check of its own.
+ */
+typedef struct {
+    Py_ssize_t max_depth;
+    Py_ssize_t max_items;
+    Py_ssize_t max_bytes;
+    Py_ssize_t depth;
+    Py_ssize_t items;
+
+    int end;        /* Buffer index output may not pass */
+    int clamp;      /* _size as last clamped */
+    int capacity;   /* The Buffer's real _size, while clamped */
+    PyObject *error;
+} EncodeLimits;
+
+/*
+ * In-order (key, value) pairs of a dict subclass or other mapping, without
+ * building an items() list; see Encoder_mapping_next.
+ */
+typedef struct {
+    PyObject *mapping;
+    int kind;
+    Py_ssize_t pos;         /* PyDict_Next position */
+    PyObject *iterator;     /* Of keys (OrderedDict) or items() */
+    PyObject *key;          /* Owned, as of the last pair, unless from PyDict_Next */
+    PyObject *item;
+} MappingIter;
+
+/*
+ * STRING_ESCAPES compiled for the 1-byte string path: a bitmap of bytes
+ * needing escape, and each replacement in a fixed slot, all in one block.
+ * Latin-1 0x80-0xff is in it too, replaced by its UTF-8.
+ */
+#define ESCAPE_SLOT_SIZE 15
+
+typedef struct {
+    unsigned char needs_escape[256 / 8];
+    unsigned char lengths[256];
+    char replacements[256][ESCAPE_SLOT_SIZE];
+} EscapeTable;
+
+#define ESCAPE_TABLE_NEEDS_ESCAPE(table, c) (((table)->needs_escape[(c) >> 3] >> ((c) & 7)) & 1)
 
 typedef struct {
     PyObject_HEAD
 
     Buffer *buffer;
+    ModuleState *state; /* Of the _encoder module defining the type; module.h */
 
     PyObject *none;
     PyObject *bool_true;
@@ -18,10 +103,124 @@ typedef struct {
     PyObject *float_nan;
 
     int dict_preserve_order;
+    int str_quote; /* -1: not yet read, 0: none */
+    int native_types; /* NATIVE_TYPES as bits (native.c); -1: not yet read */
+    int validate_raw; /* Has a validate_raw hook (raw.c); -1: not yet read */
 
     PyObject *_str_translation_table;
-    Py_UCS1 **_str_ucs1_mapping;
+    const EscapeTable *_escape_table;
+    PyObject *_escape_table_owner; /* Capsule keeping _escape_table alive */
+
+    Memo *memo; /* memo.c; NULL until memoize() */
+    EncodeLimits *limits; /* limits.c; NULL unless the current call has max_depth/max_items */
+
+#ifdef ENCODER_STATS
+    EncoderStats stats;
+#endif
 
 } Encoder;
 
+/* For the other encoding modes (xml.c, msgpack.c, ...) */
+int Encoder_append(Encoder *self, PyObject *o);
+int Encoder_append_double(Encoder *self, double d);
+int Encoder_append_iterencode(Encoder *self, PyObject *o, int (*append)(Encoder *, PyObject *));
+int Encoder_get_dict_preserve_order(Encoder *self);
+int Encoder_get_str_quote(Encoder *self);
+
+int  Encoder_mapping_begin (Encoder *self, MappingIter *iter, PyObject *mapping);
+int  Encoder_mapping_next  (MappingIter *iter, PyObject **key, PyObject **value);
+void Encoder_mapping_end   (MappingIter *iter);
+
+PyObject *Encoder_encode_bytes(Encoder *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames,
+                               int (*append)(Encoder *, PyObject *));
+PyObject *Encoder_encode_segments(Encoder *self, PyObject *o, int (*append)(Encoder *, PyObject *));
+PyObject *Encoder_encode_writev(Encoder *self, PyObject *args, int (*append)(Encoder *, PyObject *));
+
+/* Docstrings of the methods above, for every format's method table */
+extern const char Encoder_encode_segments__doc__[];
+extern const char Encoder_encode_writev__doc__[];
+
+/* segment.c */
+PyObject *Encoder_segment_view(Encoder *self, Segment *segment);
+
+/* compress.c */
+PyObject *Encoder_encode_compressed(Encoder *self, PyObject *args, PyObject *kwargs,
+                                    int (*append)(Encoder *, PyObject *));
+
+/* native.c */
+int Encoder_append_native(Encoder *self, PyObject *o);
+
+/* records.c */
+PyObject *Encoder_encode_records(Encoder *self, PyObject *columns);
+
+/* raw.c */
+int Encoder_append_raw(Encoder *self, PyObject *o);
+
+/* memo.c */
+int Encoder_append_memo(Encoder *self, PyObject *o, int (*append)(Encoder *, PyObject *));
+void Encoder_memo_free(Memo *memo);
+PyObject *Encoder_memoize(Encoder *self, PyObject *args, PyObject *kwargs);
+PyObject *Encoder_forget(Encoder *self, PyObject *o);
+PyObject *Encoder_invalidate(Encoder *self, PyObject *token);
+
+/* limits.c */
+PyObject *Encoder_encode_limited(Encoder *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames,
+                                 int (*append)(Encoder *, PyObject *));
+int Encoder_limit_error(Encoder *self, int depth);
+int Encoder_limit_spill(Buffer *b, int length);
+
+Py_LOCAL_INLINE(int)  Encoder_enter    (Encoder *self, Py_ssize_t items);
+Py_LOCAL_INLINE(int)  Encoder_add_item (Encoder *self);
+Py_LOCAL_INLINE(void) Encoder_leave    (Encoder *self);
+
+/* capi.c */
+int Encoder_append_registered(Encoder *self, PyObject *o);
+PyObject *Encoder_CAPI_New(void);
+
+/*
+ * Around each container (and make_iterencode expansion), `items` its
+ * length where known: one more level, and that many more items.
+ * Just the NULL check without limits.
+ */
+Py_LOCAL_INLINE(int)
+Encoder_enter(Encoder *self, Py_ssize_t items)
+{
+    EncodeLimits *limits = self->limits;
+
+    if (limits != NULL) {
+        if (limits->depth == limits->max_depth) {
+            return Encoder_limit_error(self, 1);
+        }
+        if (items > limits->max_items - limits->items) {
+            return Encoder_limit_error(self, 0);
+        }
+        limits->depth++;
+        limits->items += items;
+    }
+    return 0;
+}
+
+/* Each item of an iterator or make_iterencode expansion, its length unknown at Encoder_enter */
+Py_LOCAL_INLINE(int)
+Encoder_add_item(Encoder *self)
+{
+    EncodeLimits *limits = self->limits;
+
+    if (limits != NULL) {
+        if (limits->items == limits->max_items) {
+            return Encoder_limit_error(self, 0);
+        }
+        limits->items++;
+    }
+    return 0;
+}
+
+Py_LOCAL_INLINE(void)
+Encoder_leave(Encoder *self)
+{
+    if (self->limits != NULL) {
+        self->limits->depth--;
+    }
+}
+
 #endif
@@ -0,0 +1,84 @@
+#ifndef _ENCODER_CAPI_H
+#define _ENCODER_CAPI_H
+
+/*
+ * C API for other extensions, exported as a capsule (_encoder._C_API), in
+ * the manner of datetime.h:
+ *
+ *   #include "encoder_capi.h"
+ *
+ *   static int
+ *   append_vector(Encoder *encoder, PyObject *o)
+ *   {
+ *       Buffer *b = encoder->buffer;
+ *       if (EncoderAPI_ensure_room(b, 2) == -1)
+ *           return -1;
+ *       append_char_unsafe(b, '[');
+ *       ...
+ *   }
+ *
+ *   Encoder_IMPORT;
+ *   if (EncoderAPI == NULL)
+ *       return NULL;
+ *   EncoderAPI->register_type(&Vector_Type, append_vector);
+ *
+ * Registered appenders are consulted by the text encoders (JSON, XML)
+ * ahead of the sequence/dict checks and make_iterencode, for instances of
+ * the type and its subtypes; `encoder` says which format is wanted.
+ *
+ * Of buffer.h, only the *_unsafe appenders are usable from outside, as
+ * the others call into this module; use EncoderAPI_ensure_room for room.
+ */
+
+#include "buffer.h"
+#include "encoder.h"
+
+#define ENCODER_CAPSULE_NAME "_encoder._C_API"
+#define ENCODER_CAPI_VERSION 2
+
+/* 0 on success, -1 with an exception set */
+typedef int (*EncoderAppendFunc)(Encoder *encoder, PyObject *o);
+
+typedef struct {
+    int version;
+
+    /* The slow path of ensure_room(): make room for `length` more bytes */
+    int (*Buffer_resize)(Buffer *buffer, int length);
+
+    /* Any object, as the encoder would (e.g. a registered type's parts) */
+    int (*append)(Encoder *encoder, PyObject *o);
+
+    /* STRING_QUOTE as a char, 0 for none, -1 on error */
+    int (*get_str_quote)(Encoder *encoder);
+
+    /*
+     * Use `append` for `type` (NULL to unregister). 0, or -1 on error.
+     * Only for encoders of the _encoder module in sys.modules; one loaded
+     * otherwise (e.g. importlib.util.module_from_spec) has a registry of
+     * its own, which takes register_type_in.
+     */
+    int (*register_type)(PyTypeObject *type, EncoderAppendFunc append);
+
+    /* As register_type, into `module`'s registry (version 2) */
+    int (*register_type_in)(PyObject *module, PyTypeObject *type, EncoderAppendFunc append);
+} EncoderCAPI;
+
+#ifndef ENCODER_MODULE
+
+static EncoderCAPI *EncoderAPI = NULL;
+
+#define Encoder_IMPORT \
+    EncoderAPI = (EncoderCAPI *)PyCapsule_Import(ENCODER_CAPSULE_NAME, 0)
+
+Py_LOCAL_INLINE(int)
+EncoderAPI_ensure_room(Buffer *b, int length)
+{
+    if (b->_index + length >= b->_size) {
+        return EncoderAPI->Buffer_resize(b, length);
+    }
+    return 0;
+}
+
+#endif /* ENCODER_MODULE */
+
+#endif
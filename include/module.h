@@ -0,0 +1,94 @@
+#ifndef _ENCODER_MODULE_H
+#define _ENCODER_MODULE_H
+
+/*
+ * Per-module state (multi-phase init, PEP 489), so each (sub)interpreter
+ * importing _encoder gets its own types, pools and registry.
+ */
+
+#define ENCODER_MODULE
+#include "buffer.h"
+#include "encoder.h"
+#include "encoder_capi.h"
+
+/*
+ * Types registered through the capsule, scanned by _append; expected to be
+ * a handful, so a flat array rather than a dict.
+ */
+#define ENCODER_REGISTRY_MAX 32
+
+/*
+ * Elements are created and destroyed once per `with tag.x():` block,
+ * so keep a few around rather than going through the allocator each time.
+ */
+#define ELEMENT_FREE_LIST_MAX 64
+
+typedef struct {
+    PyTypeObject *type;
+    EncoderAppendFunc append;
+} Registration;
+
+struct _ModuleState {
+    PyTypeObject *Encoder_Type;
+    PyTypeObject *MsgpackEncoder_Type;
+    PyTypeObject *CborEncoder_Type;
+    PyTypeObject *CsvEncoder_Type;
+    PyTypeObject *Raw_Type;
+    PyTypeObject *Tag_Type;
+    PyTypeObject *Element_Type;
+    PyTypeObject *XmlWriter_Type;
+    PyTypeObject *Template_Type;
+    PyTypeObject *Segment_Type;
+
+    PyObject *EncodeLimitError; /* limits.c */
+
+    /* capi.c; registry_length is read by _append to skip the scan when empty */
+    Registration registry[ENCODER_REGISTRY_MAX];
+    int registry_length;
+
+    /* native.c; imported on first use */
+    PyTypeObject *datetime_type;
+    PyTypeObject *date_type;
+    PyTypeObject *time_type;
+    PyTypeObject *timedelta_type;
+    int datetime_c; /* The above are _datetime's, not the pure Python ones */
+    PyTypeObject *uuid_type;
+    PyTypeObject *decimal_type;
+    PyTypeObject *enum_type;
+
+    /* xml.c; dead Elements, not holding a reference to Element_Type */
+    PyObject *element_free_list[ELEMENT_FREE_LIST_MAX];
+    int element_free_list_length;
+
+    PyObject *items_name; /* "items", for _mapping_kind */
+
+    SegmentPool segment_pool;
+};
+
+extern PyModuleDef EncoderModuleDef;
+
+extern PyType_Spec Encoder_spec;
+extern PyType_Spec MsgpackEncoder_spec;
+extern PyType_Spec CborEncoder_spec;
+extern PyType_Spec CsvEncoder_spec;
+extern PyType_Spec Raw_spec;
+extern PyType_Spec Tag_spec;
+extern PyType_Spec Element_spec;
+extern PyType_Spec XmlWriter_spec;
+extern PyType_Spec Template_spec;
+extern PyType_Spec Segment_spec;
+
+#define Raw_CheckExact(state, o) (Py_TYPE(o) == (state)->Raw_Type)
+
+/* The state of the module defining `type` (or a base of it); NULL on error */
+Py_LOCAL_INLINE(ModuleState *)
+Module_get_state(PyTypeObject *type)
+{
+    PyObject *module = PyType_GetModuleByDef(type, &EncoderModuleDef);
+    if (module == NULL) {
+        return NULL;
+    }
+    return (ModuleState *)PyModule_GetState(module);
+}
+
+#endif
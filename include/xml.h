@@ -4,8 +4,15 @@
 typedef struct {
     PyObject_HEAD
     Encoder *encoder;
-    char *name;
+    char *name;         /* Points into _tags, not separately allocated */
     int name_length;
+
+    /* "<name></name>" in one block, so __enter__/__exit__ are one memcpy each. */
+    char *_tags;
+    char *open;
+    int open_length;
+    char *close;
+    int close_length;
 } Tag;
 
 typedef struct {
@@ -14,7 +21,32 @@ typedef struct {
     PyObject *attributes;
 } Element;
 
-/* For module.c */
-PyAPI_DATA(PyTypeObject) Tag_Type;
+typedef struct {
+    PyObject_HEAD
+    Encoder *encoder;
+    PyObject **stack;   /* Open tags - Tag or str */
+    int depth;
+    int stack_size;
+    int start;          /* Buffer index at creation; getvalue() returns from here */
+} XmlWriter;
+
+typedef struct {
+    PyObject *key;      /* Slot key; NULL for a literal */
+    int index;          /* Slot position, for tuple/list records */
+    char *literal;
+    int offset;         /* Of literal, while compiling */
+    int length;
+} TemplateOp;
+
+typedef struct {
+    PyObject_HEAD
+    Encoder *encoder;
+    TemplateOp *ops;
+    int ops_length;
+    int ops_size;
+    int slots;
+    char *literals;     /* All literal bytes, in one block */
+    int _literal_start; /* While compiling */
+} Template;
 
 #endif
@@ -1,7 +1,14 @@
 #!/usr/local/bin/python3
 
+import os
+
 from distutils.core import setup, Extension
 
+define_macros = []
+
+if os.environ.get('ENCODER_STATS'):
+    define_macros.append(('ENCODER_STATS', '1'))
+
 setup(
     name = 'Encoder',
     version = '1.0',
@@ -11,15 +18,34 @@ setup(
             name = '_encoder',
             sources = [
                 'src/buffer.c',
+                'src/capi.c',
+                'src/cbor.c',
+                'src/compress.c',
+                'src/csv.c',
+                'src/dtoa.c',
                 'src/encoder.c',
+                'src/limits.c',
+                'src/memo.c',
                 'src/module.c',
+                'src/msgpack.c',
+                'src/native.c',
+                'src/raw.c',
+                'src/records.c',
+                'src/segment.c',
+                'src/template.c',
                 'src/xml.c',
                 ],
             include_dirs = [
                 'include',
                 ],
+            define_macros = define_macros,
+            libraries = [
+                'z',
+                ],
             depends = [
                 'include/buffer.h', # As this is essentially a source file
+                'include/encoder_capi.h',
+                'include/module.h',
                 ],
             ),
         ],
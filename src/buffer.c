@@ -1,38 +1,341 @@
 #include <Python.h>
+#include <errno.h>
+#include <sys/uio.h>
+
 #include "buffer.h"
 
 #define BUFFER_SIZE_INITIAL 1024
-#define BUFFER_SIZE_INCREMENT 1024
-#define BUFFER_SIZE_MAX 10240
+
+#define SEGMENT_SIZE (64 * 1024)
+
+/* iovecs per writev(2) call; well under any IOV_MAX */
+#define SEGMENT_WRITEV_BATCH 64
+
+static char * _segment_acquire (SegmentPool *pool, int size);
+static int    _segment_push    (SegmentChain *chain, char *data, int length, int size);
+static int    _segments_spill  (Buffer *self, int length);
 
 Buffer* new_buffer()
 {
     Buffer *buffer = NULL;
     char *data = PyMem_Malloc(BUFFER_SIZE_INITIAL);
 
-    if (data != NULL) {
-        buffer = PyMem_Malloc(sizeof(Buffer));
-        if (buffer == NULL) {
-            /* XXX: free data? */
-        }
-        else {
-            buffer->_data = data;
-            buffer->_index = 0;
-            buffer->_size = BUFFER_SIZE_INITIAL;
-        }
+    if (data == NULL) {
+        PyErr_NoMemory();
+        return NULL;
     }
 
+    buffer = PyMem_Malloc(sizeof(Buffer));
+    if (buffer == NULL) {
+        PyMem_Free(data);
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    buffer->_data = data;
+    buffer->_index = 0;
+    buffer->_size = BUFFER_SIZE_INITIAL;
+    buffer->_spill = NULL;
+    buffer->_spill_state = NULL;
+    buffer->_frames = 0;
+    buffer->_owner = 0;
+#ifdef ENCODER_STATS
+    buffer->_resizes = 0;
+    buffer->_peak_size = BUFFER_SIZE_INITIAL;
+#endif
+
     return buffer;
 }
 
 void delete_buffer(Buffer *buffer)
 {
     PyMem_Free(buffer->_data);
+    PyMem_Free(buffer);
+}
+
+/* Give back storage beyond `size`, e.g. after an aborted encode; best effort */
+void
+Buffer_shrink(Buffer *self, int size)
+{
+    if (size >= self->_size || self->_index >= size) {
+        return;
+    }
+
+    char *data = PyMem_Realloc(self->_data, size);
+    if (data != NULL) {
+        self->_data = data;
+        self->_size = size;
+    }
 }
 
+/*
+ * Grow so at least `length` more bytes fit after _index.
+ * Doubles, so a long run of appends costs amortized O(1) copies.
+ */
 int
-_Buffer_resize(Buffer *self)
+_Buffer_resize(Buffer *self, int length)
+{
+    if (self->_spill != NULL) {
+        return self->_spill(self, length);
+    }
+
+    if (length > INT_MAX - self->_index - 1) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    int needed = self->_index + length + 1;
+    int size = self->_size;
+
+    while (size < needed) {
+        size = (size > INT_MAX / 2) ? INT_MAX : size * 2;
+    }
+
+    char *data = PyMem_Realloc(self->_data, size);
+    if (data == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    self->_data = data;
+    self->_size = size;
+
+#ifdef ENCODER_STATS
+    self->_resizes++;
+    if (size > self->_peak_size) {
+        self->_peak_size = size;
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * Switch to segmented mode, chaining segments onto `chain` (caller-owned,
+ * typically on the stack) until Buffer_end_segments. Within a BufferFrame,
+ * which Buffer_end_segments leaves to be popped.
+ */
+int
+Buffer_begin_segments(Buffer *self, SegmentChain *chain, SegmentPool *pool)
+{
+    char *data = _segment_acquire(pool, SEGMENT_SIZE);
+    if (data == NULL) {
+        return -1;
+    }
+
+    chain->segments = NULL;
+    chain->count = 0;
+    chain->size = 0;
+    chain->total = 0;
+    chain->pool = pool;
+
+    chain->_data = self->_data;
+    chain->_size = self->_size;
+
+    self->_data = data;
+    self->_index = 0;
+    self->_size = SEGMENT_SIZE;
+    self->_spill = _segments_spill;
+    self->_spill_state = chain;
+
+    return 0;
+}
+
+/* Seal the current segment onto the chain, leaving none current */
+int
+Buffer_seal_segment(Buffer *self)
+{
+    SegmentChain *chain = self->_spill_state;
+
+    if (self->_index == 0) {
+        SegmentPool_release(chain->pool, self->_data, self->_size);
+    }
+    else if (_segment_push(chain, self->_data, self->_index, self->_size) == -1) {
+        return -1;
+    }
+
+    self->_data = NULL;
+    self->_index = 0;
+    self->_size = 0;
+
+    return 0;
+}
+
+/* Release every segment and restore the buffer's own storage */
+void
+Buffer_end_segments(Buffer *self)
+{
+    SegmentChain *chain = self->_spill_state;
+    Py_ssize_t i;
+
+    if (self->_data != NULL) {
+        SegmentPool_release(chain->pool, self->_data, self->_size);
+    }
+
+    /* Less any taken by Encoder_segment_view */
+    for (i = 0; i < chain->count; i++) {
+        if (chain->segments[i].data != NULL) {
+            SegmentPool_release(chain->pool, chain->segments[i].data, chain->segments[i].size);
+        }
+    }
+    PyMem_Free(chain->segments);
+    chain->segments = NULL;
+    chain->count = 0;
+
+    self->_data = chain->_data;
+    self->_index = 0;
+    self->_size = chain->_size;
+    self->_spill = NULL;
+    self->_spill_state = NULL;
+}
+
+/* Everything on the chain to `fd`, retrying partial writes. Total or -1. */
+Py_ssize_t
+SegmentChain_writev(SegmentChain *chain, int fd)
+{
+    struct iovec iov[SEGMENT_WRITEV_BATCH];
+    Segment *segments = chain->segments;
+    Py_ssize_t i = 0;
+    int offset = 0; /* Already written from segments[i] */
+
+    while (i < chain->count) {
+        int n = 0;
+        Py_ssize_t j;
+
+        for (j = i; j < chain->count && n < SEGMENT_WRITEV_BATCH; j++, n++) {
+            int skip = (j == i) ? offset : 0;
+            iov[n].iov_base = segments[j].data + skip;
+            iov[n].iov_len = segments[j].length - skip;
+        }
+
+        ssize_t written;
+
+        Py_BEGIN_ALLOW_THREADS
+        written = writev(fd, iov, n);
+        Py_END_ALLOW_THREADS
+
+        if (written == -1) {
+            if (errno == EINTR) {
+                if (PyErr_CheckSignals() == -1) {
+                    return -1;
+                }
+                continue;
+            }
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+
+        while (written > 0) {
+            int remaining = segments[i].length - offset;
+
+            if (written >= remaining) {
+                written -= remaining;
+                offset = 0;
+                i++;
+            }
+            else {
+                offset += written;
+                written = 0;
+            }
+        }
+    }
+
+    return chain->total;
+}
+
+/* Free every pooled block, e.g. as the owning module goes */
+void
+SegmentPool_clear(SegmentPool *pool)
+{
+    while (pool->length > 0) {
+        PyMem_Free(pool->blocks[--pool->length]);
+    }
+}
+
+static int
+_segments_spill(Buffer *self, int length)
 {
-    PyErr_SetString(PyExc_NotImplementedError, "resizing internal buffer");
-    return -1;
+    if (length > INT_MAX - 1) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    int size = (length + 1 > SEGMENT_SIZE) ? length + 1 : SEGMENT_SIZE;
+
+    SegmentChain *chain = self->_spill_state;
+
+    char *data = _segment_acquire(chain->pool, size);
+    if (data == NULL) {
+        return -1;
+    }
+
+    if (self->_index == 0) {
+        SegmentPool_release(chain->pool, self->_data, self->_size);
+    }
+    else if (_segment_push(chain, self->_data, self->_index, self->_size) == -1) {
+        SegmentPool_release(chain->pool, data, size);
+        return -1;
+    }
+
+    self->_data = data;
+    self->_index = 0;
+    self->_size = size;
+
+#ifdef ENCODER_STATS
+    self->_resizes++;
+#endif
+
+    return 0;
+}
+
+static int
+_segment_push(SegmentChain *chain, char *data, int length, int size)
+{
+    if (chain->count == chain->size) {
+        Py_ssize_t new_size = chain->size ? chain->size * 2 : 16;
+
+        Segment *segments = PyMem_Realloc(chain->segments, new_size * sizeof(Segment));
+        if (segments == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        chain->segments = segments;
+        chain->size = new_size;
+    }
+
+    chain->segments[chain->count].data = data;
+    chain->segments[chain->count].length = length;
+    chain->segments[chain->count].size = size;
+    chain->count++;
+    chain->total += length;
+
+    return 0;
+}
+
+static char *
+_segment_acquire(SegmentPool *pool, int size)
+{
+    if (size == SEGMENT_SIZE && pool->length > 0) {
+        return pool->blocks[--pool->length];
+    }
+
+    char *data = PyMem_Malloc(size);
+    if (data == NULL) {
+        PyErr_NoMemory();
+    }
+
+    return data;
+}
+
+/* A segment's block back to the pool, or freed if full or odd-sized */
+void
+SegmentPool_release(SegmentPool *pool, char *data, int size)
+{
+    if (size == SEGMENT_SIZE && pool->length < SEGMENT_POOL_MAX) {
+        pool->blocks[pool->length++] = data;
+    }
+    else {
+        PyMem_Free(data);
+    }
 }
@@ -0,0 +1,116 @@
+#include <Python.h>
+
+#include "module.h"
+
+static int _register_type    (PyTypeObject *type, EncoderAppendFunc append);
+static int _register_type_in (PyObject *module, PyTypeObject *type, EncoderAppendFunc append);
+
+static EncoderCAPI capi = {
+    ENCODER_CAPI_VERSION,
+    _Buffer_resize,
+    Encoder_append,
+    Encoder_get_str_quote,
+    _register_type,
+    _register_type_in,
+};
+
+PyObject *
+Encoder_CAPI_New(void)
+{
+    return PyCapsule_New(&capi, ENCODER_CAPSULE_NAME, NULL);
+}
+
+/*
+ * 1 if `o` was appended by a registered appender, 0 if its type has none,
+ * -1 on error. Exact types first, then subtypes in registration order.
+ */
+int
+Encoder_append_registered(Encoder *self, PyObject *o)
+{
+    Registration *registry = self->state->registry;
+    int length = self->state->registry_length;
+    PyTypeObject *type = Py_TYPE(o);
+    int i;
+
+    for (i = 0; i < length; i++) {
+        if (registry[i].type == type) {
+            return registry[i].append(self, o) == -1 ? -1 : 1;
+        }
+    }
+
+    for (i = 0; i < length; i++) {
+        if (PyType_IsSubtype(type, registry[i].type)) {
+            return registry[i].append(self, o) == -1 ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Into the registry of the calling interpreter's _encoder, as in
+ * sys.modules; the capsule itself is shared, so has no state of its own
+ * to go by. Any other instance of the module takes _register_type_in.
+ */
+static int
+_register_type(PyTypeObject *type, EncoderAppendFunc append)
+{
+    PyObject *module = PyImport_ImportModule("_encoder");
+    if (module == NULL) {
+        return -1;
+    }
+
+    int retval = _register_type_in(module, type, append);
+    Py_DECREF(module);
+    return retval;
+}
+
+static int
+_register_type_in(PyObject *module, PyTypeObject *type, EncoderAppendFunc append)
+{
+    if (!PyModule_Check(module) || PyModule_GetDef(module) != &EncoderModuleDef) {
+        PyErr_Format(PyExc_TypeError, "register_type_in: expected an _encoder module, got: %R", module);
+        return -1;
+    }
+
+    ModuleState *state = PyModule_GetState(module);
+    if (state == NULL) {
+        return -1;
+    }
+
+    Registration *registry = state->registry;
+    int i;
+
+    for (i = 0; i < state->registry_length; i++) {
+        if (registry[i].type != type) {
+            continue;
+        }
+
+        if (append != NULL) {
+            registry[i].append = append;
+            return 0;
+        }
+
+        /* Unregister: close the gap, keeping order */
+        Py_DECREF(type);
+        state->registry_length--;
+        memmove(&registry[i], &registry[i + 1], (state->registry_length - i) * sizeof(Registration));
+        return 0;
+    }
+
+    if (append == NULL) {
+        return 0;
+    }
+
+    if (state->registry_length == ENCODER_REGISTRY_MAX) {
+        PyErr_Format(PyExc_RuntimeError, "register_type(%R): no more than %d types", type, ENCODER_REGISTRY_MAX);
+        return -1;
+    }
+
+    Py_INCREF(type);
+    registry[state->registry_length].type = type;
+    registry[state->registry_length].append = append;
+    state->registry_length++;
+
+    return 0;
+}
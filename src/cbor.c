@@ -0,0 +1,547 @@
+#include <Python.h>
+#include <float.h>
+
+#include "buffer.h"
+#include "encoder.h"
+#include "module.h"
+
+/*
+ * CBOR (RFC 8949) output, alongside msgpack.c.
+ *
+ * Containers whose size is known up front (list, tuple, dict) are
+ * definite-length. Iterators and make_iterencode iterables are written as
+ * indefinite-length arrays, so nothing is buffered to find a count.
+ */
+
+#define CBOR_UINT       (0 << 5)
+#define CBOR_NEGINT     (1 << 5)
+#define CBOR_BYTES      (2 << 5)
+#define CBOR_TEXT       (3 << 5)
+#define CBOR_ARRAY      (4 << 5)
+#define CBOR_MAP        (5 << 5)
+#define CBOR_TAG        (6 << 5)
+#define CBOR_SIMPLE     (7 << 5)
+
+#define CBOR_FALSE      (CBOR_SIMPLE | 20)
+#define CBOR_TRUE       (CBOR_SIMPLE | 21)
+#define CBOR_NULL       (CBOR_SIMPLE | 22)
+#define CBOR_HALF       (CBOR_SIMPLE | 25)
+#define CBOR_SINGLE     (CBOR_SIMPLE | 26)
+#define CBOR_DOUBLE     (CBOR_SIMPLE | 27)
+#define CBOR_BREAK      (CBOR_SIMPLE | 31)
+
+#define CBOR_INDEFINITE 31
+
+#define CBOR_TAG_POSITIVE_BIGNUM 2
+#define CBOR_TAG_NEGATIVE_BIGNUM 3
+
+/* Forward declarations */
+static PyObject* cbor_encode_bytes       (Encoder *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames);
+static PyObject* cbor_encode_segments    (Encoder *self, PyObject *o);
+static PyObject* cbor_encode_writev      (Encoder *self, PyObject *args);
+static PyObject* cbor_encode_compressed  (Encoder *self, PyObject *args, PyObject *kwargs);
+
+static int           _cbor_append        (Encoder *self, PyObject *o);
+Py_LOCAL_INLINE(int) _cbor_append_head   (Encoder *self, unsigned char major, unsigned long long argument);
+Py_LOCAL_INLINE(int) _cbor_append_int    (Encoder *self, PyObject *py_int);
+static int           _cbor_append_bignum (Encoder *self, PyObject *py_int);
+Py_LOCAL_INLINE(int) _cbor_append_float  (Encoder *self, PyObject *py_float);
+Py_LOCAL_INLINE(int) _cbor_append_str    (Encoder *self, PyObject *str);
+Py_LOCAL_INLINE(int) _cbor_append_array  (Encoder *self, PyObject *list_or_tuple);
+Py_LOCAL_INLINE(int) _cbor_append_dict   (Encoder *self, PyObject *dict);
+static int           _cbor_append_iter   (Encoder *self, PyObject *iterator);
+static int           _cbor_append_iterencode (Encoder *self, PyObject *o);
+
+PyDoc_STRVAR(CborEncoder__doc__,
+"Encoder producing CBOR (RFC 8949) rather than text.");
+
+PyDoc_STRVAR(cbor_encode_bytes__doc__,
+"encode_bytes(o, max_bytes=None, max_depth=None, max_items=None) -> bytes\n"
+"\n"
+"`o` as CBOR, within the limits given as for Encoder.encode_bytes().\n"
+"encode() is the same, as there is no text form.");
+
+PyDoc_STRVAR(cbor_encode_compressed__doc__,
+"encode_compressed(o, level=-1, wbits=31, sink=None) -> bytes\n"
+"\n"
+"As encode_bytes(), deflated as it is encoded. `level` and `wbits` as for\n"
+"zlib.compressobj(); the default wbits gives gzip. With a `sink`, the\n"
+"compressed output is passed to sink.write() in chunks and None returned.");
+
+static PyObject*
+cbor_encode_bytes(Encoder *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return Encoder_encode_bytes(self, args, nargs, kwnames, _cbor_append);
+}
+
+static PyObject*
+cbor_encode_segments(Encoder *self, PyObject *o)
+{
+    return Encoder_encode_segments(self, o, _cbor_append);
+}
+
+static PyObject*
+cbor_encode_writev(Encoder *self, PyObject *args)
+{
+    return Encoder_encode_writev(self, args, _cbor_append);
+}
+
+static PyObject*
+cbor_encode_compressed(Encoder *self, PyObject *args, PyObject *kwargs)
+{
+    return Encoder_encode_compressed(self, args, kwargs, _cbor_append);
+}
+
+static int
+_cbor_append(Encoder *self, PyObject *o)
+{
+    if (o == Py_None) {
+        STATS_INC(self, none);
+        return append_char(self->buffer, (char)CBOR_NULL);
+    }
+    if (o == Py_True) {
+        STATS_INC(self, bool_true);
+        return append_char(self->buffer, (char)CBOR_TRUE);
+    }
+    if (o == Py_False) {
+        STATS_INC(self, bool_false);
+        return append_char(self->buffer, (char)CBOR_FALSE);
+    }
+    if (PyLong_Check(o)) {
+        STATS_INC(self, int_);
+        return _cbor_append_int(self, o);
+    }
+    if (PyFloat_Check(o)) {
+        STATS_INC(self, float_);
+        return _cbor_append_float(self, o);
+    }
+    if (PyUnicode_Check(o)) {
+        STATS_INC(self, str);
+        return _cbor_append_str(self, o);
+    }
+    if (PyBytes_Check(o)) {
+        STATS_INC(self, bytes);
+        if (_cbor_append_head(self, CBOR_BYTES, PyBytes_GET_SIZE(o)) == -1) {
+            return -1;
+        }
+        return append_bytes(self->buffer, o);
+    }
+    if (PyByteArray_Check(o)) {
+        STATS_INC(self, bytes);
+        if (_cbor_append_head(self, CBOR_BYTES, PyByteArray_GET_SIZE(o)) == -1) {
+            return -1;
+        }
+        return append_string(self->buffer, PyByteArray_AS_STRING(o), PyByteArray_GET_SIZE(o));
+    }
+    if (Raw_CheckExact(self->state, o)) {
+        return Encoder_append_raw(self, o);
+    }
+    if (self->memo != NULL) {
+        int memoized = Encoder_append_memo(self, o, _cbor_append);
+        if (memoized != 0) {
+            return memoized == -1 ? -1 : 0;
+        }
+    }
+    if (PyList_Check(o) || PyTuple_Check(o)) {
+        STATS_INC(self, sequence);
+        return _cbor_append_array(self, o);
+    }
+    if (PyDict_Check(o)) {
+        if (Encoder_enter(self, PyDict_GET_SIZE(o)) == -1) {
+            return -1;
+        }
+        int retval = _cbor_append_dict(self, o);
+        Encoder_leave(self);
+        return retval;
+    }
+    if (PySequence_Check(o)) {
+        PyObject *checked = PySequence_Fast(o, "Expected list/tuple");
+        if (checked == NULL) {
+            return -1;
+        }
+        STATS_INC(self, sequence);
+        int retval = _cbor_append_array(self, checked);
+        Py_DECREF(checked);
+        return retval;
+    }
+    if (PyIter_Check(o)) {
+        STATS_INC(self, sequence);
+        if (Encoder_enter(self, 0) == -1) {
+            return -1;
+        }
+        int retval = _cbor_append_iter(self, o);
+        Encoder_leave(self);
+        return retval;
+    }
+
+    return _cbor_append_iterencode(self, o);
+}
+
+/* Initial byte plus argument, in the shortest form. */
+Py_LOCAL_INLINE(int)
+_cbor_append_head(Encoder *self, unsigned char major, unsigned long long argument)
+{
+    Buffer *b = self->buffer;
+    int i;
+    int width;
+
+    if (ensure_room(b, 9) == -1) {
+        return -1;
+    }
+
+    if (argument < 24) {
+        append_char_unsafe(b, (char)(major | argument));
+        return 0;
+    }
+
+    if (argument <= 0xff) {
+        append_char_unsafe(b, (char)(major | 24));
+        width = 1;
+    }
+    else if (argument <= 0xffff) {
+        append_char_unsafe(b, (char)(major | 25));
+        width = 2;
+    }
+    else if (argument <= 0xffffffffULL) {
+        append_char_unsafe(b, (char)(major | 26));
+        width = 4;
+    }
+    else {
+        append_char_unsafe(b, (char)(major | 27));
+        width = 8;
+    }
+
+    for (i = width - 1; i >= 0; i--) {
+        append_char_unsafe(b, (char)(argument >> (8 * i)));
+    }
+
+    return 0;
+}
+
+Py_LOCAL_INLINE(int)
+_cbor_append_int(Encoder *self, PyObject *integer)
+{
+    int overflow;
+    long long l = PyLong_AsLongLongAndOverflow(integer, &overflow);
+
+    if (overflow != 0) {
+        /* Fits in CBOR's 64 bit argument? */
+        if (overflow == 1) {
+            unsigned long long u = PyLong_AsUnsignedLongLong(integer);
+            if (!(u == (unsigned long long)-1 && PyErr_Occurred())) {
+                return _cbor_append_head(self, CBOR_UINT, u);
+            }
+        }
+        else {
+            /* -1 - n, for n up to 2**64 - 1 */
+            PyObject *n = PyNumber_Invert(integer);
+            if (n == NULL) {
+                return -1;
+            }
+            unsigned long long u = PyLong_AsUnsignedLongLong(n);
+            Py_DECREF(n);
+            if (!(u == (unsigned long long)-1 && PyErr_Occurred())) {
+                return _cbor_append_head(self, CBOR_NEGINT, u);
+            }
+        }
+
+        if (!PyErr_ExceptionMatches(PyExc_OverflowError)) {
+            return -1;
+        }
+        PyErr_Clear();
+
+        return _cbor_append_bignum(self, integer);
+    }
+
+    if (l == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+
+    if (l >= 0) {
+        return _cbor_append_head(self, CBOR_UINT, (unsigned long long)l);
+    }
+
+    return _cbor_append_head(self, CBOR_NEGINT, (unsigned long long)(-1 - l));
+}
+
+/* Tags 2/3: byte string of the magnitude (of -1 - n for negatives). Rare. */
+static int
+_cbor_append_bignum(Encoder *self, PyObject *integer)
+{
+    int negative = _PyLong_Sign(integer) < 0;
+    PyObject *magnitude = negative ? PyNumber_Invert(integer) : (Py_INCREF(integer), integer);
+    PyObject *bytes = NULL;
+    int retval = -1;
+
+    if (magnitude == NULL) {
+        return -1;
+    }
+
+    size_t nbits = _PyLong_NumBits(magnitude);
+    if (nbits == (size_t)-1 && PyErr_Occurred()) {
+        goto bail;
+    }
+
+    bytes = PyObject_CallMethod(magnitude, "to_bytes", "ns", (Py_ssize_t)((nbits + 7) / 8), "big");
+    if (bytes == NULL) {
+        goto bail;
+    }
+
+    if (_cbor_append_head(self, CBOR_TAG, negative ? CBOR_TAG_NEGATIVE_BIGNUM : CBOR_TAG_POSITIVE_BIGNUM) == -1) {
+        goto bail;
+    }
+    if (_cbor_append_head(self, CBOR_BYTES, PyBytes_GET_SIZE(bytes)) == -1) {
+        goto bail;
+    }
+    if (append_bytes(self->buffer, bytes) == -1) {
+        goto bail;
+    }
+
+    retval = 0;
+  bail:
+    Py_DECREF(magnitude);
+    Py_XDECREF(bytes);
+    return retval;
+}
+
+/* The narrowest of half, single and double that holds the value exactly. */
+Py_LOCAL_INLINE(int)
+_cbor_append_float(Encoder *self, PyObject *f)
+{
+    Buffer *b = self->buffer;
+    double d = PyFloat_AS_DOUBLE(f);
+
+    if (ensure_room(b, 9) == -1) {
+        return -1;
+    }
+
+    if (d != d) {
+        /* Canonical NaN */
+        append_char_unsafe(b, (char)CBOR_HALF);
+        append_char_unsafe(b, (char)0x7e);
+        append_char_unsafe(b, 0);
+        return 0;
+    }
+
+    char *head = &b->_data[b->_index];
+
+    if (PyFloat_Pack2(d, head + 1, 0) == 0) {
+        if (PyFloat_Unpack2(head + 1, 0) == d) {
+            head[0] = (char)CBOR_HALF;
+            b->_index += 3;
+            return 0;
+        }
+    }
+    else {
+        PyErr_Clear(); /* Out of range for half */
+    }
+
+    /* Finite values past FLT_MAX can't be converted to float at all */
+    if (fabs(d) <= FLT_MAX ? (double)(float)d == d : !Py_IS_FINITE(d)) {
+        if (PyFloat_Pack4(d, head + 1, 0) == -1) {
+            return -1;
+        }
+        head[0] = (char)CBOR_SINGLE;
+        b->_index += 5;
+        return 0;
+    }
+
+    if (PyFloat_Pack8(d, head + 1, 0) == -1) {
+        return -1;
+    }
+    head[0] = (char)CBOR_DOUBLE;
+    b->_index += 9;
+
+    return 0;
+}
+
+Py_LOCAL_INLINE(int)
+_cbor_append_str(Encoder *self, PyObject *s)
+{
+    Py_ssize_t length;
+    const char *data = PyUnicode_AsUTF8AndSize(s, &length);
+    if (data == NULL) {
+        return -1;
+    }
+
+    if (_cbor_append_head(self, CBOR_TEXT, length) == -1) {
+        return -1;
+    }
+
+    return append_string(self->buffer, (char *)data, length);
+}
+
+Py_LOCAL_INLINE(int)
+_cbor_append_array(Encoder *self, PyObject *sequence)
+{
+    Py_ssize_t length = PySequence_Fast_GET_SIZE(sequence);
+    PyObject **items = PySequence_Fast_ITEMS(sequence);
+    Py_ssize_t i;
+    int retval = -1;
+
+    if (Encoder_enter(self, length) == -1) {
+        return -1;
+    }
+
+    if (_cbor_append_head(self, CBOR_ARRAY, length) == -1) {
+        goto bail;
+    }
+
+    for (i = 0; i < length; i++) {
+        if (_cbor_append(self, items[i]) == -1) {
+            goto bail;
+        }
+    }
+
+    retval = 0;
+  bail:
+    Encoder_leave(self);
+    return retval;
+}
+
+Py_LOCAL_INLINE(int)
+_cbor_append_dict(Encoder *self, PyObject *dict)
+{
+    if (!PyDict_CheckExact(dict)) {
+        int dict_preserve_order = Encoder_get_dict_preserve_order(self);
+        if (dict_preserve_order == -1) {
+            return -1;
+        }
+
+        if (dict_preserve_order == 1) {
+            STATS_INC(self, mapping);
+
+            Py_ssize_t length = PyObject_Length(dict);
+            if (length == -1) {
+                return -1;
+            }
+
+            /* Borrowed references */
+            PyObject *key;
+            PyObject *value;
+
+            MappingIter iter;
+            int retval = -1;
+            int status;
+            Py_ssize_t count = 0;
+
+            if (Encoder_mapping_begin(self, &iter, dict) == -1) {
+                goto bail;
+            }
+
+            if (_cbor_append_head(self, CBOR_MAP, length) == -1) {
+                goto bail;
+            }
+
+            while ((status = Encoder_mapping_next(&iter, &key, &value)) == 1) {
+                if (_cbor_append(self, key) == -1) {
+                    goto bail;
+                }
+                if (_cbor_append(self, value) == -1) {
+                    goto bail;
+                }
+                count++;
+            }
+
+            if (status == -1) {
+                goto bail;
+            }
+
+            if (count != length) {
+                /* The header is already out */
+                PyErr_SetString(PyExc_RuntimeError, "mapping changed size during iteration");
+                goto bail;
+            }
+
+            retval = 0;
+          bail:
+            Encoder_mapping_end(&iter);
+            return retval;
+        }
+    }
+
+    STATS_INC(self, dict);
+
+    /* Borrowed references */
+    PyObject *key;
+    PyObject *value;
+
+    Py_ssize_t pos = 0;
+
+    if (_cbor_append_head(self, CBOR_MAP, PyDict_GET_SIZE(dict)) == -1) {
+        return -1;
+    }
+
+    while (PyDict_Next(dict, &pos, &key, &value)) {
+        if (_cbor_append(self, key) == -1) {
+            return -1;
+        }
+        if (_cbor_append(self, value) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+_cbor_append_iter(Encoder *self, PyObject *iterator)
+{
+    PyObject *item;
+
+    if (append_char(self->buffer, (char)(CBOR_ARRAY | CBOR_INDEFINITE)) == -1) {
+        return -1;
+    }
+
+    while ((item = PyIter_Next(iterator))) {
+        int status = Encoder_add_item(self) == -1 ? -1 : _cbor_append(self, item);
+        Py_DECREF(item);
+        if (status == -1) {
+            return -1;
+        }
+    }
+
+    if (PyErr_Occurred()) {
+        return -1;
+    }
+
+    return append_char(self->buffer, (char)CBOR_BREAK);
+}
+
+static int
+_cbor_append_iterencode(Encoder *self, PyObject *o)
+{
+    if (append_char(self->buffer, (char)(CBOR_ARRAY | CBOR_INDEFINITE)) == -1) {
+        return -1;
+    }
+
+    if (Encoder_append_iterencode(self, o, _cbor_append) == -1) {
+        return -1;
+    }
+
+    return append_char(self->buffer, (char)CBOR_BREAK);
+}
+
+static PyMethodDef methods[] = {
+    {"encode",       (PyCFunction)cbor_encode_bytes, METH_FASTCALL | METH_KEYWORDS, cbor_encode_bytes__doc__},
+    {"encode_bytes", (PyCFunction)cbor_encode_bytes, METH_FASTCALL | METH_KEYWORDS, cbor_encode_bytes__doc__},
+    {"encode_segments", (PyCFunction)cbor_encode_segments, METH_O, Encoder_encode_segments__doc__},
+    {"encode_writev", (PyCFunction)cbor_encode_writev, METH_VARARGS, Encoder_encode_writev__doc__},
+    {"encode_compressed", (PyCFunction)cbor_encode_compressed, METH_VARARGS | METH_KEYWORDS, cbor_encode_compressed__doc__},
+    {NULL} /* Sentinel */
+};
+
+static PyType_Slot slots[] = {
+    {Py_tp_doc,     (void *)CborEncoder__doc__},
+    {Py_tp_methods, methods},
+    {0, NULL},
+};
+
+/* Based on Encoder, by module.c */
+PyType_Spec CborEncoder_spec = {
+    "_encoder.CborEncoder",
+    sizeof(Encoder),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_IMMUTABLETYPE,
+    slots,
+};
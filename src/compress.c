@@ -0,0 +1,236 @@
+#include <Python.h>
+#include <zlib.h>
+
+#include "buffer.h"
+#include "encoder.h"
+
+/*
+ * Compression stage on the Buffer's spill hook: whenever the Buffer fills,
+ * its contents are deflated and it starts over, so only one chunk of
+ * uncompressed output exists at a time, and is compressed while still
+ * in cache.
+ */
+
+/* Uncompressed bytes gathered per deflate() */
+#define COMPRESS_CHUNK_SIZE (64 * 1024)
+
+/* Compressed bytes gathered per sink.write() */
+#define COMPRESS_WRITE_SIZE (64 * 1024)
+
+typedef struct {
+    z_stream stream;
+    int start;          /* Of this call's output in the Buffer (see BufferFrame) */
+    Buffer *out;        /* Compressed output not yet written */
+    PyObject *write;    /* sink.write, or NULL to collect everything in `out` */
+    unsigned long long total_in;
+} Compressor;
+
+/* Forward declarations */
+static int _compress_spill (Buffer *self, int length);
+static int _compress_chunk (Compressor *compressor, Buffer *in, int flush);
+static int _compress_write (Compressor *compressor);
+static int _compress_error (Compressor *compressor, int status);
+
+/*
+ * encode_compressed(o, level=-1, wbits=31, sink=None) for any format,
+ * given its append. wbits as zlib.compressobj(): 31 is gzip, 15 zlib.
+ */
+PyObject *
+Encoder_encode_compressed(Encoder *self, PyObject *args, PyObject *kwargs, int (*append)(Encoder *, PyObject *))
+{
+    static char *kwlist[] = {"o", "level", "wbits", "sink", NULL};
+
+    Buffer *b = self->buffer;
+    BufferFrame frame;
+    PyObject *o;
+    PyObject *sink = Py_None;
+    int level = Z_DEFAULT_COMPRESSION;
+    int wbits = MAX_WBITS + 16;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iiO:encode_compressed", kwlist,
+                                     &o, &level, &wbits, &sink)) {
+        return NULL;
+    }
+
+    Compressor compressor;
+    PyObject *retval = NULL;
+
+    memset(&compressor.stream, 0, sizeof(z_stream));
+    compressor.write = NULL;
+    compressor.total_in = 0;
+
+    compressor.out = new_buffer();
+    if (compressor.out == NULL) {
+        return NULL;
+    }
+
+    if (sink != Py_None) {
+        compressor.write = PyObject_GetAttrString(sink, "write");
+        if (compressor.write == NULL) {
+            delete_buffer(compressor.out);
+            return NULL;
+        }
+    }
+
+    int status = deflateInit2(&compressor.stream, level, Z_DEFLATED, wbits, 8, Z_DEFAULT_STRATEGY);
+    if (status != Z_OK) {
+        _compress_error(&compressor, status);
+        Py_XDECREF(compressor.write);
+        delete_buffer(compressor.out);
+        return NULL;
+    }
+
+    if (Buffer_push_frame(b, &frame) == -1) {
+        deflateEnd(&compressor.stream);
+        Py_XDECREF(compressor.write);
+        delete_buffer(compressor.out);
+        return NULL;
+    }
+    compressor.start = frame.start;
+
+    /* Fewer, larger deflate() calls than at the Buffer's initial size */
+    if (b->_size - b->_index <= COMPRESS_CHUNK_SIZE && _Buffer_resize(b, COMPRESS_CHUNK_SIZE) == -1) {
+        goto bail;
+    }
+
+    b->_spill = _compress_spill;
+    b->_spill_state = &compressor;
+
+    status = append(self, o);
+
+    b->_spill = NULL;
+    b->_spill_state = NULL;
+
+    if (status == -1 || _compress_chunk(&compressor, b, Z_FINISH) == -1) {
+        goto bail;
+    }
+
+    if (compressor.write == NULL) {
+        retval = Buffer_as_bytes(compressor.out);
+    }
+    else if (_compress_write(&compressor) != -1) {
+        retval = Py_None;
+        Py_INCREF(retval);
+    }
+
+    STATS_ADD(self, bytes_out, compressor.total_in);
+
+  bail:
+    Buffer_pop_frame(b, &frame);
+    deflateEnd(&compressor.stream);
+    Py_XDECREF(compressor.write);
+    delete_buffer(compressor.out);
+    return retval;
+}
+
+static int
+_compress_spill(Buffer *self, int length)
+{
+    Compressor *compressor = self->_spill_state;
+
+    if (_compress_chunk(compressor, self, Z_NO_FLUSH) == -1) {
+        return -1;
+    }
+
+    if (self->_index + length >= self->_size) {
+        /* Larger than a chunk: grow, as the Buffer normally would */
+        self->_spill = NULL;
+        int status = _Buffer_resize(self, length);
+        self->_spill = _compress_spill;
+        return status;
+    }
+
+    return 0;
+}
+
+/* Deflate `in`'s contents, emptying it */
+static int
+_compress_chunk(Compressor *compressor, Buffer *in, int flush)
+{
+    z_stream *stream = &compressor->stream;
+    Buffer *out = compressor->out;
+    int status;
+
+    stream->next_in = (Bytef *)&in->_data[compressor->start];
+    stream->avail_in = in->_index - compressor->start;
+    compressor->total_in += stream->avail_in;
+
+    do {
+        if (ensure_room(out, COMPRESS_CHUNK_SIZE / 4) == -1) {
+            return -1;
+        }
+
+        int room = out->_size - out->_index - 1;
+
+        stream->next_out = (Bytef *)&out->_data[out->_index];
+        stream->avail_out = room;
+
+        /*
+         * `in` is safe without the GIL: the frame pushed by Encoder_encode_compressed
+         * keeps other threads' encodes off this Buffer.
+         */
+        Py_BEGIN_ALLOW_THREADS
+        status = deflate(stream, flush);
+        Py_END_ALLOW_THREADS
+
+        if (status == Z_STREAM_ERROR) {
+            return _compress_error(compressor, status);
+        }
+
+        out->_index += room - stream->avail_out;
+    } while (stream->avail_out == 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+
+    in->_index = compressor->start;
+
+    /*
+     * Only now, with `in` consumed: sink.write() may encode on this same
+     * encoder, moving in->_data from under next_in.
+     */
+    if (compressor->write != NULL && out->_index >= COMPRESS_WRITE_SIZE) {
+        return _compress_write(compressor);
+    }
+
+    return 0;
+}
+
+/* Pass what's in `out` to sink.write() */
+static int
+_compress_write(Compressor *compressor)
+{
+    Buffer *out = compressor->out;
+
+    if (out->_index == 0) {
+        return 0;
+    }
+
+    PyObject *bytes = Buffer_as_bytes(out);
+    if (bytes == NULL) {
+        return -1;
+    }
+
+    PyObject *result = PyObject_CallFunctionObjArgs(compressor->write, bytes, NULL);
+    Py_DECREF(bytes);
+    if (result == NULL) {
+        return -1;
+    }
+    Py_DECREF(result);
+
+    out->_index = 0;
+
+    return 0;
+}
+
+static int
+_compress_error(Compressor *compressor, int status)
+{
+    const char *message = compressor->stream.msg;
+
+    if (status == Z_MEM_ERROR) {
+        PyErr_NoMemory();
+    }
+    else {
+        PyErr_Format(PyExc_ValueError, "zlib error %d: %s", status, message ? message : "bad arguments");
+    }
+
+    return -1;
+}
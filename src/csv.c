@@ -0,0 +1,477 @@
+#include <Python.h>
+#include <stdint.h>
+
+#include "buffer.h"
+#include "encoder.h"
+
+/*
+ * CSV/TSV rows straight into the Buffer.
+ *
+ * A field is quoted only if it contains the delimiter, quote or a line
+ * break; the common clean field is found with a word-at-a-time scan and
+ * copied as is. Quotes within quoted fields are doubled.
+ */
+
+#define CSV_FLUSH_SIZE (64 * 1024)
+#define CSV_LINE_TERMINATOR_MAX 8
+
+typedef struct {
+    Encoder encoder;
+
+    int configured; /* 0: DELIMITER etc. not yet read */
+    char delimiter;
+    char quote;
+    char line_terminator[CSV_LINE_TERMINATOR_MAX];
+    int line_terminator_length;
+
+    /* Per-byte "must quote" table, as EscapeTable is for escapes */
+    unsigned char needs_quote[256];
+} CsvEncoder;
+
+/* Forward declarations */
+static PyObject* encode_rows              (CsvEncoder *self, PyObject *rows);
+static PyObject* write_rows               (CsvEncoder *self, PyObject *args);
+static PyObject* encode_segments          (CsvEncoder *self, PyObject *rows);
+static PyObject* encode_writev            (CsvEncoder *self, PyObject *args);
+static PyObject* encode_compressed        (CsvEncoder *self, PyObject *args, PyObject *kwargs);
+
+static int           _csv_configure       (CsvEncoder *self);
+static int           _csv_append          (Encoder *self, PyObject *rows);
+static int           _csv_append_rows     (CsvEncoder *self, PyObject *rows, PyObject *sink, int start);
+Py_LOCAL_INLINE(int) _csv_append_row      (CsvEncoder *self, PyObject *row);
+Py_LOCAL_INLINE(int) _csv_append_field    (CsvEncoder *self, PyObject *field);
+Py_LOCAL_INLINE(int) _csv_append_text     (CsvEncoder *self, const char *data, Py_ssize_t length);
+Py_LOCAL_INLINE(Py_ssize_t) _csv_scan     (CsvEncoder *self, const char *data, Py_ssize_t length);
+static int           _csv_flush           (CsvEncoder *self, PyObject *sink, int start);
+
+PyDoc_STRVAR(CsvEncoder__doc__,
+"Encoder producing delimited rows (CSV, TSV) from iterables of sequences.");
+
+PyDoc_STRVAR(encode_rows__doc__,
+"encode_rows(rows) -> bytes\n"
+"\n"
+"Each sequence in `rows` as one line. encode() and encode_bytes() are the same.");
+
+PyDoc_STRVAR(encode_compressed__doc__,
+"encode_compressed(rows, level=-1, wbits=31, sink=None) -> bytes\n"
+"\n"
+"As encode_rows(rows), deflated as it is encoded. `level` and `wbits` as for\n"
+"zlib.compressobj(); the default wbits gives gzip. With a `sink`, the\n"
+"compressed output is passed to sink.write() in chunks and None returned.");
+
+PyDoc_STRVAR(write_rows__doc__,
+"write_rows(rows, sink)\n"
+"\n"
+"As encode_rows, but passes bytes to sink.write() every so often\n"
+"rather than building the whole output.");
+
+static PyObject *
+encode_rows(CsvEncoder *self, PyObject *rows)
+{
+    Buffer *b = self->encoder.buffer;
+    BufferFrame frame;
+    PyObject *retval = NULL;
+
+    if (Buffer_push_frame(b, &frame) == -1) {
+        return NULL;
+    }
+
+    if (_csv_append_rows(self, rows, NULL, frame.start) != -1) {
+        retval = Buffer_frame_as_bytes(b, &frame);
+        STATS_ADD(&self->encoder, bytes_out, b->_index - frame.start);
+    }
+
+    Buffer_pop_frame(b, &frame);
+
+    return retval;
+}
+
+static PyObject *
+write_rows(CsvEncoder *self, PyObject *args)
+{
+    PyObject *rows;
+    PyObject *sink;
+
+    if (!PyArg_ParseTuple(args, "OO:write_rows", &rows, &sink)) {
+        return NULL;
+    }
+
+    Buffer *b = self->encoder.buffer;
+    BufferFrame frame;
+
+    PyObject *write = PyObject_GetAttrString(sink, "write");
+    if (write == NULL) {
+        return NULL;
+    }
+
+    if (Buffer_push_frame(b, &frame) == -1) {
+        Py_DECREF(write);
+        return NULL;
+    }
+
+    int status = _csv_append_rows(self, rows, write, frame.start);
+    if (status != -1) {
+        status = _csv_flush(self, write, frame.start);
+    }
+
+    Buffer_pop_frame(b, &frame);
+    Py_DECREF(write);
+
+    if (status == -1) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+encode_segments(CsvEncoder *self, PyObject *rows)
+{
+    return Encoder_encode_segments(&self->encoder, rows, _csv_append);
+}
+
+static PyObject *
+encode_writev(CsvEncoder *self, PyObject *args)
+{
+    return Encoder_encode_writev(&self->encoder, args, _csv_append);
+}
+
+static PyObject *
+encode_compressed(CsvEncoder *self, PyObject *args, PyObject *kwargs)
+{
+    return Encoder_encode_compressed(&self->encoder, args, kwargs, _csv_append);
+}
+
+static int
+_csv_append(Encoder *self, PyObject *rows)
+{
+    return _csv_append_rows((CsvEncoder *)self, rows, NULL, 0);
+}
+
+/* With `write`, what's past `start` is flushed to it every so often */
+static int
+_csv_append_rows(CsvEncoder *self, PyObject *rows, PyObject *write, int start)
+{
+    if (!self->configured && _csv_configure(self) == -1) {
+        return -1;
+    }
+
+    PyObject *iterator = PyObject_GetIter(rows);
+    PyObject *row;
+
+    if (iterator == NULL) {
+        return -1;
+    }
+
+    while ((row = PyIter_Next(iterator))) {
+        int status = _csv_append_row(self, row);
+        Py_DECREF(row);
+
+        if (status == -1) {
+            break;
+        }
+
+        if (write != NULL && self->encoder.buffer->_index - start >= CSV_FLUSH_SIZE) {
+            if (_csv_flush(self, write, start) == -1) {
+                break;
+            }
+        }
+    }
+
+    Py_DECREF(iterator);
+
+    if (PyErr_Occurred()) {
+        return -1;
+    }
+
+    return 0;
+}
+
+Py_LOCAL_INLINE(int)
+_csv_append_row(CsvEncoder *self, PyObject *row)
+{
+    Buffer *b = self->encoder.buffer;
+
+    PyObject *sequence = PySequence_Fast(row, "CsvEncoder: expected rows to be sequences");
+    if (sequence == NULL) {
+        return -1;
+    }
+
+    int retval = -1;
+    int start = b->_index;
+    Py_ssize_t length = PySequence_Fast_GET_SIZE(sequence);
+    PyObject **items = PySequence_Fast_ITEMS(sequence);
+    Py_ssize_t i;
+
+    for (i = 0; i < length; i++) {
+        if (i != 0)
+            if (append_char(b, self->delimiter) == -1)
+                goto bail;
+
+        if (_csv_append_field(self, items[i]) == -1)
+            goto bail;
+    }
+
+    /* A lone empty field, quoted so the line doesn't read back as no fields */
+    if (length == 1 && b->_index == start) {
+        if (ensure_room(b, 2) == -1)
+            goto bail;
+        append_char_unsafe(b, self->quote);
+        append_char_unsafe(b, self->quote);
+    }
+
+    if (append_string(b, self->line_terminator, self->line_terminator_length) == -1)
+        goto bail;
+
+    retval = 0;
+  bail:
+    Py_DECREF(sequence);
+    return retval;
+}
+
+Py_LOCAL_INLINE(int)
+_csv_append_field(CsvEncoder *self, PyObject *o)
+{
+    if (PyUnicode_Check(o)) {
+        Py_ssize_t length;
+        const char *data = PyUnicode_AsUTF8AndSize(o, &length);
+        if (data == NULL) {
+            return -1;
+        }
+        STATS_INC(&self->encoder, str);
+        return _csv_append_text(self, data, length);
+    }
+    if (PyLong_CheckExact(o)) {
+        int overflow;
+        long long l = PyLong_AsLongLongAndOverflow(o, &overflow);
+        if (l == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+        STATS_INC(&self->encoder, int_);
+        /* Past long long, str() below */
+        if (!overflow) {
+            return append_longlong(self->encoder.buffer, l);
+        }
+    }
+    else if (PyFloat_CheckExact(o)) {
+        STATS_INC(&self->encoder, float_);
+        /* repr(), as the csv module writes */
+        return append_double(self->encoder.buffer, PyFloat_AS_DOUBLE(o));
+    }
+    if (o == Py_None || o == Py_True || o == Py_False) {
+        /* NONE/TRUE/FALSE, as for any Encoder */
+        return Encoder_append(&self->encoder, o);
+    }
+
+    /* Anything else as its str(), like the csv module. */
+    PyObject *s = PyObject_Str(o);
+    if (s == NULL) {
+        return -1;
+    }
+
+    Py_ssize_t length;
+    const char *data = PyUnicode_AsUTF8AndSize(s, &length);
+    int retval = data == NULL ? -1 : _csv_append_text(self, data, length);
+
+    Py_DECREF(s);
+    return retval;
+}
+
+Py_LOCAL_INLINE(int)
+_csv_append_text(CsvEncoder *self, const char *data, Py_ssize_t length)
+{
+    Buffer *b = self->encoder.buffer;
+    Py_ssize_t special = _csv_scan(self, data, length);
+
+    if (special == length) {
+        return append_string(b, (char *)data, length);
+    }
+
+    STATS_INC(&self->encoder, escapes);
+
+    if (append_char(b, self->quote) == -1) {
+        return -1;
+    }
+
+    /* Only quotes need doubling once inside quotes. */
+    const char *end = data + length;
+    const char *quote;
+
+    while ((quote = memchr(data, self->quote, end - data)) != NULL) {
+        if (ensure_room(b, quote - data + 2) == -1) {
+            return -1;
+        }
+        append_string_unsafe(b, (char *)data, quote - data + 1);
+        append_char_unsafe(b, self->quote);
+        data = quote + 1;
+    }
+
+    if (ensure_room(b, end - data + 1) == -1) {
+        return -1;
+    }
+    append_string_unsafe(b, (char *)data, end - data);
+    append_char_unsafe(b, self->quote);
+
+    return 0;
+}
+
+#define _ONES  0x0101010101010101ULL
+#define _HIGHS 0x8080808080808080ULL
+#define _HAS_ZERO_BYTE(v) (((v) - _ONES) & ~(v) & _HIGHS)
+
+/*
+ * Index of the first byte requiring quotes, or length if none.
+ * Eight bytes at a time against the four special bytes, then per byte.
+ */
+Py_LOCAL_INLINE(Py_ssize_t)
+_csv_scan(CsvEncoder *self, const char *data, Py_ssize_t length)
+{
+    const uint64_t delimiter = _ONES * (unsigned char)self->delimiter;
+    const uint64_t quote = _ONES * (unsigned char)self->quote;
+    const uint64_t cr = _ONES * '\r';
+    const uint64_t lf = _ONES * '\n';
+
+    Py_ssize_t i = 0;
+
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+
+        if (_HAS_ZERO_BYTE(word ^ delimiter) | _HAS_ZERO_BYTE(word ^ quote) |
+            _HAS_ZERO_BYTE(word ^ cr) | _HAS_ZERO_BYTE(word ^ lf)) {
+            break;
+        }
+    }
+
+    for (; i < length; i++) {
+        if (self->needs_quote[(unsigned char)data[i]]) {
+            return i;
+        }
+    }
+
+    return length;
+}
+
+/* Passes the output past `start` to write(), and drops it */
+static int
+_csv_flush(CsvEncoder *self, PyObject *write, int start)
+{
+    Buffer *b = self->encoder.buffer;
+
+    if (b->_index == start) {
+        return 0;
+    }
+
+    PyObject *bytes = PyBytes_FromStringAndSize(&b->_data[start], b->_index - start);
+    if (bytes == NULL) {
+        return -1;
+    }
+
+    STATS_ADD(&self->encoder, bytes_out, b->_index - start);
+    b->_index = start;
+
+    PyObject *result = PyObject_CallOneArg(write, bytes);
+    Py_DECREF(bytes);
+    if (result == NULL) {
+        return -1;
+    }
+    Py_DECREF(result);
+
+    return 0;
+}
+
+/* A single ASCII character from attribute `name`, or -1. */
+static int
+_get_ascii_char(CsvEncoder *self, const char *name)
+{
+    PyObject *value = PyObject_GetAttrString((PyObject *)self, name);
+    if (value == NULL) {
+        return -1;
+    }
+
+    int c = -1;
+
+    if (PyUnicode_Check(value) && PyUnicode_GET_LENGTH(value) == 1 && PyUnicode_READ_CHAR(value, 0) < 128) {
+        c = PyUnicode_READ_CHAR(value, 0);
+    }
+    else {
+        PyErr_Format(PyExc_TypeError, "%s: expected one ASCII character, got: %R", name, value);
+    }
+
+    Py_DECREF(value);
+    return c;
+}
+
+static int
+_csv_configure(CsvEncoder *self)
+{
+    int delimiter = _get_ascii_char(self, "DELIMITER");
+    if (delimiter == -1) {
+        return -1;
+    }
+
+    int quote = _get_ascii_char(self, "QUOTE");
+    if (quote == -1) {
+        return -1;
+    }
+
+    PyObject *line_terminator = PyObject_GetAttrString((PyObject *)self, "LINE_TERMINATOR");
+    if (line_terminator == NULL) {
+        return -1;
+    }
+
+    Py_ssize_t length;
+    const char *data = PyUnicode_Check(line_terminator) ? PyUnicode_AsUTF8AndSize(line_terminator, &length) : NULL;
+
+    if (data == NULL || length > CSV_LINE_TERMINATOR_MAX) {
+        if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_TypeError, "LINE_TERMINATOR: expected str of at most %d bytes, got: %R",
+                         CSV_LINE_TERMINATOR_MAX, line_terminator);
+        }
+        Py_DECREF(line_terminator);
+        return -1;
+    }
+
+    memcpy(self->line_terminator, data, length);
+    self->line_terminator_length = length;
+    Py_DECREF(line_terminator);
+
+    self->delimiter = delimiter;
+    self->quote = quote;
+
+    memset(self->needs_quote, 0, sizeof(self->needs_quote));
+    self->needs_quote[delimiter] = 1;
+    self->needs_quote[quote] = 1;
+    self->needs_quote['\r'] = 1;
+    self->needs_quote['\n'] = 1;
+
+    self->configured = 1;
+
+    return 0;
+}
+
+static PyMethodDef methods[] = {
+    {"encode",       (PyCFunction)encode_rows, METH_O,       encode_rows__doc__},
+    {"encode_bytes", (PyCFunction)encode_rows, METH_O,       encode_rows__doc__},
+    {"encode_rows",  (PyCFunction)encode_rows, METH_O,       encode_rows__doc__},
+    {"write_rows",   (PyCFunction)write_rows,  METH_VARARGS, write_rows__doc__},
+    {"encode_segments", (PyCFunction)encode_segments, METH_O,  Encoder_encode_segments__doc__},
+    {"encode_writev",   (PyCFunction)encode_writev,   METH_VARARGS, Encoder_encode_writev__doc__},
+    {"encode_compressed", (PyCFunction)encode_compressed, METH_VARARGS | METH_KEYWORDS, encode_compressed__doc__},
+    {NULL} /* Sentinel */
+};
+
+static PyType_Slot slots[] = {
+    {Py_tp_doc,     (void *)CsvEncoder__doc__},
+    {Py_tp_methods, methods},
+    {0, NULL},
+};
+
+/* Based on Encoder, by module.c */
+PyType_Spec CsvEncoder_spec = {
+    "_encoder.CsvEncoder",
+    sizeof(CsvEncoder),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_IMMUTABLETYPE,
+    slots,
+};
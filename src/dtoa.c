@@ -0,0 +1,414 @@
+#include <Python.h>
+#include <float.h>
+#include <stdint.h>
+
+#include "buffer.h"
+
+/*
+ * repr() of a double, without allocating.
+ *
+ * Grisu3 (Loitsch, "Printing Floating-Point Numbers Quickly and Accurately
+ * with Integers", PLDI 2010) finds the shortest digits that read back as d
+ * with 64-bit integer arithmetic only, or gives up when it can't be sure of
+ * them, for about 0.5% of doubles. Those go through snprintf() at increasing
+ * precision until the digits read back. Either way they are then laid out
+ * as float.__repr__ does.
+ */
+
+/* f * 2^e */
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+/* 10^k as f * 2^e */
+typedef struct {
+    uint64_t f;
+    int16_t e;
+    int16_t k;
+} CachedPower;
+
+#define DIY_SIGNIFICAND_SIZE 64
+#define DOUBLE_HIDDEN_BIT    0x0010000000000000ULL
+#define DOUBLE_FRACTION_MASK 0x000FFFFFFFFFFFFFULL
+
+/* Scaled by a cached power, w's binary exponent is within [-60, -32] */
+#define MIN_TARGET_EXPONENT -60
+
+/* 10^k for k = -348, -340, ..., 340, normalized and rounded */
+#define CACHED_POWERS_OFFSET 348
+#define CACHED_POWERS_STEP   8
+
+static const CachedPower cached_powers[] = {
+    {0xfa8fd5a0081c0288ULL, -1220, -348},
+    {0xbaaee17fa23ebf76ULL, -1193, -340},
+    {0x8b16fb203055ac76ULL, -1166, -332},
+    {0xcf42894a5dce35eaULL, -1140, -324},
+    {0x9a6bb0aa55653b2dULL, -1113, -316},
+    {0xe61acf033d1a45dfULL, -1087, -308},
+    {0xab70fe17c79ac6caULL, -1060, -300},
+    {0xff77b1fcbebcdc4fULL, -1034, -292},
+    {0xbe5691ef416bd60cULL, -1007, -284},
+    {0x8dd01fad907ffc3cULL,  -980, -276},
+    {0xd3515c2831559a83ULL,  -954, -268},
+    {0x9d71ac8fada6c9b5ULL,  -927, -260},
+    {0xea9c227723ee8bcbULL,  -901, -252},
+    {0xaecc49914078536dULL,  -874, -244},
+    {0x823c12795db6ce57ULL,  -847, -236},
+    {0xc21094364dfb5637ULL,  -821, -228},
+    {0x9096ea6f3848984fULL,  -794, -220},
+    {0xd77485cb25823ac7ULL,  -768, -212},
+    {0xa086cfcd97bf97f4ULL,  -741, -204},
+    {0xef340a98172aace5ULL,  -715, -196},
+    {0xb23867fb2a35b28eULL,  -688, -188},
+    {0x84c8d4dfd2c63f3bULL,  -661, -180},
+    {0xc5dd44271ad3cdbaULL,  -635, -172},
+    {0x936b9fcebb25c996ULL,  -608, -164},
+    {0xdbac6c247d62a584ULL,  -582, -156},
+    {0xa3ab66580d5fdaf6ULL,  -555, -148},
+    {0xf3e2f893dec3f126ULL,  -529, -140},
+    {0xb5b5ada8aaff80b8ULL,  -502, -132},
+    {0x87625f056c7c4a8bULL,  -475, -124},
+    {0xc9bcff6034c13053ULL,  -449, -116},
+    {0x964e858c91ba2655ULL,  -422, -108},
+    {0xdff9772470297ebdULL,  -396, -100},
+    {0xa6dfbd9fb8e5b88fULL,  -369,  -92},
+    {0xf8a95fcf88747d94ULL,  -343,  -84},
+    {0xb94470938fa89bcfULL,  -316,  -76},
+    {0x8a08f0f8bf0f156bULL,  -289,  -68},
+    {0xcdb02555653131b6ULL,  -263,  -60},
+    {0x993fe2c6d07b7facULL,  -236,  -52},
+    {0xe45c10c42a2b3b06ULL,  -210,  -44},
+    {0xaa242499697392d3ULL,  -183,  -36},
+    {0xfd87b5f28300ca0eULL,  -157,  -28},
+    {0xbce5086492111aebULL,  -130,  -20},
+    {0x8cbccc096f5088ccULL,  -103,  -12},
+    {0xd1b71758e219652cULL,   -77,   -4},
+    {0x9c40000000000000ULL,   -50,    4},
+    {0xe8d4a51000000000ULL,   -24,   12},
+    {0xad78ebc5ac620000ULL,     3,   20},
+    {0x813f3978f8940984ULL,    30,   28},
+    {0xc097ce7bc90715b3ULL,    56,   36},
+    {0x8f7e32ce7bea5c70ULL,    83,   44},
+    {0xd5d238a4abe98068ULL,   109,   52},
+    {0x9f4f2726179a2245ULL,   136,   60},
+    {0xed63a231d4c4fb27ULL,   162,   68},
+    {0xb0de65388cc8ada8ULL,   189,   76},
+    {0x83c7088e1aab65dbULL,   216,   84},
+    {0xc45d1df942711d9aULL,   242,   92},
+    {0x924d692ca61be758ULL,   269,  100},
+    {0xda01ee641a708deaULL,   295,  108},
+    {0xa26da3999aef774aULL,   322,  116},
+    {0xf209787bb47d6b85ULL,   348,  124},
+    {0xb454e4a179dd1877ULL,   375,  132},
+    {0x865b86925b9bc5c2ULL,   402,  140},
+    {0xc83553c5c8965d3dULL,   428,  148},
+    {0x952ab45cfa97a0b3ULL,   455,  156},
+    {0xde469fbd99a05fe3ULL,   481,  164},
+    {0xa59bc234db398c25ULL,   508,  172},
+    {0xf6c69a72a3989f5cULL,   534,  180},
+    {0xb7dcbf5354e9beceULL,   561,  188},
+    {0x88fcf317f22241e2ULL,   588,  196},
+    {0xcc20ce9bd35c78a5ULL,   614,  204},
+    {0x98165af37b2153dfULL,   641,  212},
+    {0xe2a0b5dc971f303aULL,   667,  220},
+    {0xa8d9d1535ce3b396ULL,   694,  228},
+    {0xfb9b7cd9a4a7443cULL,   720,  236},
+    {0xbb764c4ca7a44410ULL,   747,  244},
+    {0x8bab8eefb6409c1aULL,   774,  252},
+    {0xd01fef10a657842cULL,   800,  260},
+    {0x9b10a4e5e9913129ULL,   827,  268},
+    {0xe7109bfba19c0c9dULL,   853,  276},
+    {0xac2820d9623bf429ULL,   880,  284},
+    {0x80444b5e7aa7cf85ULL,   907,  292},
+    {0xbf21e44003acdd2dULL,   933,  300},
+    {0x8e679c2f5e44ff8fULL,   960,  308},
+    {0xd433179d9c8cb841ULL,   986,  316},
+    {0x9e19db92b4e31ba9ULL,  1013,  324},
+    {0xeb96bf6ebadf77d9ULL,  1039,  332},
+    {0xaf87023b9bf0ee6bULL,  1066,  340},
+};
+
+static DiyFp
+_diy_normalize(DiyFp x)
+{
+    while (!(x.f & 0xFFC0000000000000ULL)) {
+        x.f <<= 10;
+        x.e -= 10;
+    }
+    while (!(x.f & 0x8000000000000000ULL)) {
+        x.f <<= 1;
+        x.e -= 1;
+    }
+    return x;
+}
+
+/* The upper 64 bits of the 128-bit product, rounded */
+static DiyFp
+_diy_multiply(DiyFp x, DiyFp y)
+{
+    const uint64_t M32 = 0xFFFFFFFFULL;
+    uint64_t a = x.f >> 32, b = x.f & M32;
+    uint64_t c = y.f >> 32, d = y.f & M32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32) + (1ULL << 31);
+    DiyFp r;
+
+    r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+/* The largest 10^k <= n, where n < 2^bits, and k + 1 */
+static void
+_biggest_power_ten(uint32_t n, int bits, uint32_t *power, int *exponent_plus_one)
+{
+    static const uint32_t powers[] = {
+        0, 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+    };
+    int guess = ((bits + 1) * 1233 >> 12) + 1;
+
+    if (n < powers[guess]) {
+        guess--;
+    }
+    *power = powers[guess];
+    *exponent_plus_one = guess;
+}
+
+/*
+ * Moves the last digit towards w while that stays within the interval,
+ * then says whether the result is certainly the closest to w.
+ */
+static int
+_round_weed(char *digits, int length, uint64_t distance_too_high_w, uint64_t unsafe_interval,
+            uint64_t rest, uint64_t ten_kappa, uint64_t unit)
+{
+    uint64_t small_distance = distance_too_high_w - unit;
+    uint64_t big_distance = distance_too_high_w + unit;
+
+    while (rest < small_distance && unsafe_interval - rest >= ten_kappa &&
+           (rest + ten_kappa < small_distance || small_distance - rest >= rest + ten_kappa - small_distance)) {
+        digits[length - 1]--;
+        rest += ten_kappa;
+    }
+
+    if (rest < big_distance && unsafe_interval - rest >= ten_kappa &&
+        (rest + ten_kappa < big_distance || big_distance - rest > rest + ten_kappa - big_distance)) {
+        return 0;
+    }
+
+    return 2 * unit <= rest && rest <= unsafe_interval - 4 * unit;
+}
+
+/* As few digits of w as keep within (low, high); 0 if unsure of them */
+static int
+_digit_gen(DiyFp low, DiyFp w, DiyFp high, char *digits, int *length, int *kappa)
+{
+    uint64_t unit = 1;
+    uint64_t too_low = low.f - unit;
+    uint64_t too_high = high.f + unit;
+    uint64_t unsafe_interval = too_high - too_low;
+    int shift = -w.e;
+    uint64_t one = 1ULL << shift;
+    uint32_t integrals = (uint32_t)(too_high >> shift);
+    uint64_t fractionals = too_high & (one - 1);
+    uint32_t divisor;
+
+    _biggest_power_ten(integrals, DIY_SIGNIFICAND_SIZE - shift, &divisor, kappa);
+    *length = 0;
+
+    while (*kappa > 0) {
+        digits[(*length)++] = '0' + integrals / divisor;
+        integrals %= divisor;
+        (*kappa)--;
+
+        uint64_t rest = ((uint64_t)integrals << shift) + fractionals;
+        if (rest < unsafe_interval) {
+            return _round_weed(digits, *length, too_high - w.f, unsafe_interval, rest,
+                               (uint64_t)divisor << shift, unit);
+        }
+        divisor /= 10;
+    }
+
+    for (;;) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafe_interval *= 10;
+
+        digits[(*length)++] = '0' + (int)(fractionals >> shift);
+        fractionals &= one - 1;
+        (*kappa)--;
+
+        if (fractionals < unsafe_interval) {
+            return _round_weed(digits, *length, (too_high - w.f) * unit, unsafe_interval, fractionals,
+                               one, unit);
+        }
+    }
+}
+
+/* The shortest digits of finite, positive d, times 10^exponent; 0 if unsure of them */
+static int
+_grisu3(double d, char *digits, int *length, int *exponent)
+{
+    uint64_t bits;
+    DiyFp v, w, plus, minus;
+
+    memcpy(&bits, &d, sizeof(bits));
+
+    int biased = (int)(bits >> 52) & 0x7FF;
+    v.f = bits & DOUBLE_FRACTION_MASK;
+    if (biased != 0) {
+        v.f += DOUBLE_HIDDEN_BIT;
+        v.e = biased - 1075;
+    }
+    else {
+        v.e = -1074;
+    }
+
+    w = _diy_normalize(v);
+
+    /* Halfway to the neighbouring doubles; the one below is closer at a power of two */
+    plus.f = (v.f << 1) + 1;
+    plus.e = v.e - 1;
+    plus = _diy_normalize(plus);
+
+    if (v.f == DOUBLE_HIDDEN_BIT && biased > 1) {
+        minus.f = (v.f << 2) - 1;
+        minus.e = v.e - 2;
+    }
+    else {
+        minus.f = (v.f << 1) - 1;
+        minus.e = v.e - 1;
+    }
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    /* 10^-k bringing w's exponent within the target range */
+    int min_exponent = MIN_TARGET_EXPONENT - (w.e + DIY_SIGNIFICAND_SIZE);
+    int k = (int)ceil((min_exponent + DIY_SIGNIFICAND_SIZE - 1) * 0.30102999566398114);
+    const CachedPower *power = &cached_powers[(CACHED_POWERS_OFFSET + k - 1) / CACHED_POWERS_STEP + 1];
+    DiyFp ten_mk = {power->f, power->e};
+
+    int kappa;
+    int found = _digit_gen(_diy_multiply(minus, ten_mk), _diy_multiply(w, ten_mk), _diy_multiply(plus, ten_mk),
+                           digits, length, &kappa);
+
+    *exponent = kappa - power->k;
+    return found;
+}
+
+/* As _grisu3, through snprintf(): the shortest of 15, 16 and 17 digits that read back */
+static int
+_fallback(double d, char *digits, int *length, int *exponent)
+{
+    char formatted[40];
+    char check[40];
+    int precision;
+    char *c;
+
+    /* Any 15 digits read back, so fewer come out as trailing zeros; not so below DBL_MIN */
+    for (precision = d < DBL_MIN ? 1 : 15; precision <= 17; precision++) {
+        /* d.ddde[+-]xx, the decimal point per locale: only digits and exponent are kept */
+        if (PyOS_snprintf(formatted, sizeof(formatted), "%.*e", precision - 1, d) < 0) {
+            return -1;
+        }
+
+        *length = 0;
+        for (c = formatted; *c != 'e'; c++) {
+            if (*c >= '0' && *c <= '9') {
+                digits[(*length)++] = *c;
+            }
+        }
+        while (*length > 1 && digits[*length - 1] == '0') {
+            (*length)--;
+        }
+        *exponent = atoi(c + 1) - (*length - 1);
+
+        if (precision == 17) {
+            break;
+        }
+
+        /* As integer digits and exponent, which no locale changes */
+        PyOS_snprintf(check, sizeof(check), "%.*se%d", *length, digits, *exponent);
+        if (PyOS_string_to_double(check, NULL, NULL) == d) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int
+format_double(char *out, double d)
+{
+    char digits[24];
+    int length;
+    int exponent;
+    char *p = out;
+
+    if (Py_IS_NAN(d)) {
+        memcpy(out, "nan", 3);
+        return 3;
+    }
+
+    if (copysign(1.0, d) < 0) {
+        *p++ = '-';
+        d = -d;
+    }
+
+    if (Py_IS_INFINITY(d)) {
+        memcpy(p, "inf", 3);
+        return p + 3 - out;
+    }
+
+    if (d == 0.0) {
+        memcpy(p, "0.0", 3);
+        return p + 3 - out;
+    }
+
+    if (!_grisu3(d, digits, &length, &exponent) && _fallback(d, digits, &length, &exponent) == -1) {
+        return -1;
+    }
+
+    /* d is 0.ddd * 10^point */
+    int point = length + exponent;
+
+    if (point < -3 || point > 16) {
+        /* d.ddde[+-]xx */
+        *p++ = digits[0];
+        if (length > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, length - 1);
+            p += length - 1;
+        }
+        p += sprintf(p, "e%+03d", point - 1);
+    }
+    else if (point <= 0) {
+        /* 0.000ddd */
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', -point);
+        p += -point;
+        memcpy(p, digits, length);
+        p += length;
+    }
+    else if (length <= point) {
+        /* ddd000.0 */
+        memcpy(p, digits, length);
+        p += length;
+        memset(p, '0', point - length);
+        p += point - length;
+        *p++ = '.';
+        *p++ = '0';
+    }
+    else {
+        /* ddd.ddd */
+        memcpy(p, digits, point);
+        p += point;
+        *p++ = '.';
+        memcpy(p, digits + point, length - point);
+        p += length - point;
+    }
+
+    return p - out;
+}
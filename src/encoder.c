@@ -2,10 +2,14 @@
 
 #include "buffer.h"
 #include "encoder.h"
+#include "module.h"
 
 /* Forward declarations */
-static PyObject* encode                     (Encoder *self, PyObject *o);
-static PyObject* encode_bytes               (Encoder *self, PyObject *o);
+static PyObject* encode                     (Encoder *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames);
+static PyObject* encode_bytes               (Encoder *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames);
+static PyObject* encode_segments            (Encoder *self, PyObject *o);
+static PyObject* encode_writev              (Encoder *self, PyObject *args);
+static PyObject* encode_compressed          (Encoder *self, PyObject *args, PyObject *kwargs);
 
 static int           _append                (Encoder *self, PyObject *o);
 Py_LOCAL_INLINE(int) _append_bytes          (Encoder *self, PyObject *bytes);
@@ -20,6 +24,7 @@ Py_LOCAL_INLINE(int) _append_str_1byte_kind (Encoder *self, PyObject *str, int l
 Py_LOCAL_INLINE(int) _append_str_2byte_kind (Encoder *self, PyObject *str, int length);
 Py_LOCAL_INLINE(int) _append_str_4byte_kind (Encoder *self, PyObject *str, int length);
 Py_LOCAL_INLINE(int) _append_str_naive      (Encoder *self, PyObject *str, int length);
+Py_LOCAL_INLINE(int) _append_str_quote      (Encoder *self);
 
 Py_LOCAL_INLINE(int) _append_bytes_constant (Encoder *self, PyObject **member, const char *attribute_name);
 
@@ -28,29 +33,111 @@ Py_LOCAL_INLINE(int) _append_bytes_constant (Encoder *self, PyObject **member, c
  * Should be the only means of getting their respective attributes.
  */
 Py_LOCAL_INLINE(PyObject*)  _get_str_translation_table (Encoder *self);
-Py_LOCAL_INLINE(Py_UCS1 **) _get_str_ucs1_mapping      (Encoder *self);
+Py_LOCAL_INLINE(const EscapeTable *) _get_escape_table (Encoder *self);
+Py_LOCAL_INLINE(int)        _get_str_quote             (Encoder *self);
 
-static void _xfree_str_ucs1_mapping(Encoder *self);
+static EscapeTable * _compile_escape_table(Encoder *self);
+
+#ifdef ENCODER_STATS
+static PyObject* stats       (Encoder *self, PyObject *unused);
+static PyObject* reset_stats (Encoder *self, PyObject *unused);
+
+static int _stats_count_iterencode(Encoder *self, PyObject *type);
+
+PyDoc_STRVAR(stats___doc__,
+"stats() -> dict\n"
+"\n"
+"Counters accumulated since creation or the last reset_stats().\n"
+"Only present when built with ENCODER_STATS.");
+
+PyDoc_STRVAR(reset_stats___doc__,
+"reset_stats()\n"
+"\n"
+"Zero the counters returned by stats().");
+#endif
 
 PyDoc_STRVAR(__doc__,
 "TODO Encoder __doc__");
 
 PyDoc_STRVAR(encode___doc__,
-"TODO encode __doc__");
+"encode(o, max_bytes=None, max_depth=None, max_items=None) -> str\n"
+"\n"
+"As encode_bytes(), decoded.");
 
 PyDoc_STRVAR(encode_bytes___doc__,
-"TODO encode_bytes __doc__");
+"encode_bytes(o, max_bytes=None, max_depth=None, max_items=None) -> bytes\n"
+"\n"
+"`o` encoded. Past max_bytes of output, containers nested max_depth deep,\n"
+"or max_items container items in all, the encode is abandoned with\n"
+"EncodeLimitError.");
+
+PyDoc_STRVAR(encode_records___doc__,
+"encode_records(columns) -> bytes\n"
+"\n"
+"A mapping of equal-length columns as a list of row objects, e.g.\n"
+"{'a': [1, 2], 'b': [3, 4]} as [{\"a\":1,\"b\":3},{\"a\":2,\"b\":4}],\n"
+"without building the rows. Columns may be sequences, or 1-d buffers of\n"
+"ints, floats or bools (e.g. array.array), which are read directly.\n"
+"JSON only: other formats' encoders raise TypeError.");
+
+PyDoc_STRVAR(memoize___doc__,
+"memoize(o, token=None)\n"
+"\n"
+"Keep the output for `o`, by identity, once first encoded, and reuse it\n"
+"wherever `o` is encoded again. For immutable objects only. Up to\n"
+"MEMO_BUDGET bytes are kept, least recently used dropped first.\n"
+"`o` is held weakly where it can be.");
+
+PyDoc_STRVAR(forget___doc__,
+"forget(o)\n"
+"\n"
+"Stop memoizing `o`.");
+
+PyDoc_STRVAR(invalidate___doc__,
+"invalidate(token)\n"
+"\n"
+"Stop memoizing everything memoized with `token`.");
+
+/* Shared by every format; see encoder.h */
+const char Encoder_encode_segments__doc__[] = PyDoc_STR(
+"encode_segments(o) -> [memoryview]\n"
+"\n"
+"As encode_bytes(), as a list of read-only views joining to the same,\n"
+"built in fixed-size segments rather than one growing buffer. The views\n"
+"are of the segments themselves, not copies; each segment is freed when\n"
+"its view is.");
+
+const char Encoder_encode_writev__doc__[] = PyDoc_STR(
+"encode_writev(o, fd) -> int\n"
+"\n"
+"Encode `o` into segments and write them all to file descriptor `fd`\n"
+"with writev(2), without joining. Returns the number of bytes written.");
+
+PyDoc_STRVAR(encode_compressed___doc__,
+"encode_compressed(o, level=-1, wbits=31, sink=None) -> bytes\n"
+"\n"
+"encode_bytes(o), deflated as it is encoded. `level` and `wbits` as for\n"
+"zlib.compressobj(); the default wbits gives gzip. With a `sink`, the\n"
+"compressed output is passed to sink.write() in chunks and None returned.");
+
 
 static PyObject *
 __new__(PyTypeObject *type, PyObject *args, PyObject **kwargs)
 {
+    ModuleState *state = Module_get_state(type);
+    if (state == NULL) {
+        return NULL;
+    }
+
     Encoder *self = (Encoder *)type->tp_alloc(type, 0);
     if (self == NULL) {
         return NULL;
     }
 
+    self->state = state;
     self->buffer = new_buffer();
     if (self->buffer == NULL) {
+        Py_DECREF(self);
         return NULL;
     }
 
@@ -62,9 +149,24 @@ __new__(PyTypeObject *type, PyObject *args, PyObject **kwargs)
     self->float_nan = NULL;
 
     self->dict_preserve_order = -1;
+    self->str_quote = -1;
+    self->native_types = -1;
+    self->validate_raw = -1;
 
     self->_str_translation_table = NULL;
-    self->_str_ucs1_mapping = NULL;
+    self->_escape_table = NULL;
+    self->_escape_table_owner = NULL;
+    self->memo = NULL;
+    self->limits = NULL;
+
+#ifdef ENCODER_STATS
+    memset(&self->stats, 0, sizeof(EncoderStats));
+    self->stats.iterencode = PyDict_New();
+    if (self->stats.iterencode == NULL) {
+        Py_DECREF(self);
+        return NULL;
+    }
+#endif
 
     return (PyObject *)self;
 }
@@ -72,7 +174,11 @@ __new__(PyTypeObject *type, PyObject *args, PyObject **kwargs)
 static void
 __del__(Encoder* self)
 {
-    delete_buffer(self->buffer);
+    PyTypeObject *type = Py_TYPE(self);
+
+    if (self->buffer != NULL) {
+        delete_buffer(self->buffer);
+    }
 
     Py_XDECREF(self->none);
     Py_XDECREF(self->bool_true);
@@ -83,83 +189,270 @@ __del__(Encoder* self)
 
     Py_XDECREF(self->_str_translation_table);
 
-    _xfree_str_ucs1_mapping(self);
+    Py_XDECREF(self->_escape_table_owner);
+
+    Encoder_memo_free(self->memo);
+
+#ifdef ENCODER_STATS
+    Py_XDECREF(self->stats.iterencode);
+#endif
 
-    Py_TYPE(self)->tp_free((PyObject*)self);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
 }
 
 static PyObject*
-encode(Encoder* self, PyObject *o)
+encode(Encoder* self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
-    PyObject *bytes = encode_bytes(self, o);
+    PyObject *bytes = encode_bytes(self, args, nargs, kwnames);
     if (bytes == NULL) {
         return NULL;
     }
 
-    return PyUnicode_FromEncodedObject(bytes, NULL, NULL);
+    PyObject *str = PyUnicode_FromEncodedObject(bytes, NULL, NULL);
+    Py_DECREF(bytes);
+    return str;
+}
+
+static PyObject*
+encode_bytes(Encoder *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return Encoder_encode_bytes(self, args, nargs, kwnames, _append);
+}
+
+static PyObject*
+encode_segments(Encoder *self, PyObject *o)
+{
+    return Encoder_encode_segments(self, o, _append);
 }
 
 static PyObject*
-encode_bytes(Encoder *self, PyObject *o)
+encode_writev(Encoder *self, PyObject *args)
+{
+    return Encoder_encode_writev(self, args, _append);
+}
+
+static PyObject*
+encode_compressed(Encoder *self, PyObject *args, PyObject *kwargs)
+{
+    return Encoder_encode_compressed(self, args, kwargs, _append);
+}
+
+/*
+ * encode_bytes()/encode_segments()/encode_writev() for any format, given
+ * its append (e.g. _append, or msgpack's).
+ */
+PyObject *
+Encoder_encode_bytes(Encoder *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames,
+                     int (*append)(Encoder *, PyObject *))
+{
+    if (nargs != 1 || kwnames != NULL) {
+        return Encoder_encode_limited(self, args, nargs, kwnames, append);
+    }
+
+    Buffer *b = self->buffer;
+    BufferFrame frame;
+    EncodeLimits *enclosing = self->limits;
+    PyObject *retval = NULL;
+
+    if (Buffer_push_frame(b, &frame) == -1) {
+        return NULL;
+    }
+
+    /* Nested in a limited encode(), but not limited itself */
+    self->limits = NULL;
+
+    if (append(self, args[0]) != -1) {
+        retval = Buffer_frame_as_bytes(b, &frame);
+        STATS_ADD(self, bytes_out, b->_index - frame.start);
+    }
+
+    Buffer_pop_frame(b, &frame);
+
+    self->limits = enclosing;
+
+    return retval;
+}
+
+PyObject *
+Encoder_encode_segments(Encoder *self, PyObject *o, int (*append)(Encoder *, PyObject *))
 {
-    /* FIXME: _index */
+    Buffer *b = self->buffer;
+    BufferFrame frame;
+    SegmentChain chain;
+    Py_ssize_t i;
 
-    if (self->buffer->_index != 0) {
-        PyErr_SetString(PyExc_RuntimeError, "encode while encode already in progress");
+    if (Buffer_push_frame(b, &frame) == -1) {
+        return NULL;
+    }
+
+    if (Buffer_begin_segments(b, &chain, &self->state->segment_pool) == -1) {
+        Buffer_pop_frame(b, &frame);
         return NULL;
     }
 
     PyObject *retval = NULL;
 
-    if (_append(self, o) != -1) {
-        retval = Buffer_as_bytes(self->buffer);
+    if (append(self, o) == -1 || Buffer_seal_segment(b) == -1) {
+        goto bail;
+    }
+
+    retval = PyList_New(chain.count);
+    if (retval == NULL) {
+        goto bail;
+    }
+
+    for (i = 0; i < chain.count; i++) {
+        PyObject *segment = Encoder_segment_view(self, &chain.segments[i]);
+        if (segment == NULL) {
+            Py_CLEAR(retval);
+            goto bail;
+        }
+        PyList_SET_ITEM(retval, i, segment);
     }
 
-    self->buffer->_index = 0;
+    STATS_ADD(self, bytes_out, chain.total);
 
+  bail:
+    Buffer_end_segments(b);
+    Buffer_pop_frame(b, &frame);
     return retval;
 }
 
+PyObject *
+Encoder_encode_writev(Encoder *self, PyObject *args, int (*append)(Encoder *, PyObject *))
+{
+    Buffer *b = self->buffer;
+    BufferFrame frame;
+    SegmentChain chain;
+    PyObject *o;
+    int fd;
+
+    if (!PyArg_ParseTuple(args, "Oi:encode_writev", &o, &fd)) {
+        return NULL;
+    }
+
+    if (Buffer_push_frame(b, &frame) == -1) {
+        return NULL;
+    }
+
+    if (Buffer_begin_segments(b, &chain, &self->state->segment_pool) == -1) {
+        Buffer_pop_frame(b, &frame);
+        return NULL;
+    }
+
+    PyObject *retval = NULL;
+
+    if (append(self, o) != -1 && Buffer_seal_segment(b) != -1) {
+        Py_ssize_t written = SegmentChain_writev(&chain, fd);
+        if (written != -1) {
+            retval = PyLong_FromSsize_t(written);
+            STATS_ADD(self, bytes_out, written);
+        }
+    }
+
+    Buffer_end_segments(b);
+    Buffer_pop_frame(b, &frame);
+    return retval;
+}
+
+int
+Encoder_append(Encoder *self, PyObject *o)
+{
+    return _append(self, o);
+}
+
 static int
 _append(Encoder *self, PyObject *o)
 {
     if (o == Py_None) {
+        STATS_INC(self, none);
         return _append_bytes_constant(self, &self->none, "NONE");
     }
     if (o == Py_True) {
+        STATS_INC(self, bool_true);
         return _append_bytes_constant(self, &self->bool_true, "TRUE");
     }
     if (o == Py_False) {
+        STATS_INC(self, bool_false);
         return _append_bytes_constant(self, &self->bool_false, "FALSE");
     }
     if (PyLong_Check(o)) {
+        STATS_INC(self, int_);
         return _append_int(self, o);
     }
     if (PyFloat_Check(o)) {
+        STATS_INC(self, float_);
         return _append_float(self, o);
     }
     if (PyUnicode_Check(o)) {
+        STATS_INC(self, str);
         return _append_str(self, o);
     }
     if (PyBytes_Check(o)) {
+        STATS_INC(self, bytes);
         return _append_bytes(self, o);
     }
+    if (Raw_CheckExact(self->state, o)) {
+        return Encoder_append_raw(self, o);
+    }
+    if (self->memo != NULL) {
+        int memoized = Encoder_append_memo(self, o, _append);
+        if (memoized != 0) {
+            return memoized == -1 ? -1 : 0;
+        }
+    }
+    if (self->state->registry_length != 0) {
+        /* Ahead of the sequence/dict checks, as third-party types may be either */
+        int registered = Encoder_append_registered(self, o);
+        if (registered != 0) {
+            return registered == -1 ? -1 : 0;
+        }
+    }
     if (PySequence_Check(o)) {
         /* Must occur after str/bytes (and byte array?), which are sequences. */
         PyObject *checked = PySequence_Fast(o, "Expected list/tuple");
         if (checked == NULL) {
             return -1;
         }
-        return _append_fast_sequence(self, checked);
+        STATS_INC(self, sequence);
+        int retval = _append_fast_sequence(self, checked);
+        Py_DECREF(checked);
+        return retval;
     }
     if (PyDict_Check(o)) {
         return _append_dict(self, o);
     }
+    if (self->native_types != 0) {
+        /* -1 (not yet read) also lands here */
+        int native = Encoder_append_native(self, o);
+        if (native != 0) {
+            return native == -1 ? -1 : 0;
+        }
+    }
 
+    return Encoder_append_iterencode(self, o, _append);
+}
+
+/*
+ * The make_iterencode protocol, shared by every encoding mode:
+ * each item the returned iterable yields is passed to `append`.
+ */
+int
+Encoder_append_iterencode(Encoder *self, PyObject *o, int (*append)(Encoder *, PyObject *))
+{
     PyObject *o_class = PyObject_Type(o);
-    PyObject *iterencode = PyObject_CallMethodObjArgs((PyObject*)self, PyUnicode_FromString("make_iterencode"), o_class, NULL);
+    PyObject *iterencode = PyObject_CallMethod((PyObject*)self, "make_iterencode", "O", o_class);
     PyObject *iterable = NULL;
 
+#ifdef ENCODER_STATS
+    if (_stats_count_iterencode(self, o_class) == -1) {
+        Py_DECREF(o_class);
+        Py_XDECREF(iterencode);
+        return -1;
+    }
+#endif
+
     Py_DECREF(o_class);
     if (iterencode == NULL) {
         return -1;
@@ -167,42 +460,64 @@ _append(Encoder *self, PyObject *o)
 
     if (PyCallable_Check(iterencode) == 1) {
         iterable = PyObject_CallFunctionObjArgs(iterencode, o, NULL);
-        if (iterable == NULL) {
-            return -1;
-        }
-
     }
-    else if (PyTuple_Check(iterencode)) {
-        PyObject *callable = PyTuple_GET_ITEM(iterencode, 0);
-
-        Py_INCREF(o); /* XXX: PyTuple_SetItem steals a reference */
-        PyTuple_SetItem(iterencode, 0, o);
+    else if (PyTuple_Check(iterencode) && PyTuple_GET_SIZE(iterencode) != 0) {
+        /* (callable, extra, args...) -> callable(o, extra, args...) */
+        Py_ssize_t n = PyTuple_GET_SIZE(iterencode);
+        PyObject *args = PyTuple_New(n);
+        if (args != NULL) {
+            Py_ssize_t i;
+
+            Py_INCREF(o);
+            PyTuple_SET_ITEM(args, 0, o);
+
+            for (i = 1; i < n; i++) {
+                PyObject *arg = PyTuple_GET_ITEM(iterencode, i);
+                Py_INCREF(arg);
+                PyTuple_SET_ITEM(args, i, arg);
+            }
 
-        iterable = PyObject_CallObject(callable, iterencode);
-        if (iterable == NULL) {
-            return -1;
+            iterable = PyObject_CallObject(PyTuple_GET_ITEM(iterencode, 0), args);
+            Py_DECREF(args);
         }
     }
     else {
         PyErr_Format(PyExc_TypeError, "make_iterencode(%R): must return a callable/tuple, got: %R", o->ob_type, iterencode);
+        Py_DECREF(iterencode);
+        return -1;
+    }
+
+    if (iterable == NULL) {
+        Py_DECREF(iterencode);
         return -1;
     }
 
     if (!PyIter_Check(iterable)) {
         PyErr_Format(PyExc_TypeError, "%R: must return an iterable", iterencode);
+        Py_DECREF(iterencode);
+        Py_DECREF(iterable);
         return -1;
     }
 
+    Py_DECREF(iterencode);
+
     PyObject *item;
 
+    /* A level deeper, its items counted as they come */
+    if (Encoder_enter(self, 0) == -1) {
+        Py_DECREF(iterable);
+        return -1;
+    }
+
     while ((item = PyIter_Next(iterable))) {
-        if (_append(self, item) == -1) {
+        if (Encoder_add_item(self) == -1 || append(self, item) == -1) {
             Py_DECREF(item);
             break;
         }
         Py_DECREF(item);
     }
 
+    Encoder_leave(self);
     Py_DECREF(iterable);
 
     if (PyErr_Occurred()) {
@@ -226,7 +541,23 @@ _append_int(Encoder *self, PyObject *integer)
 Py_LOCAL_INLINE(int)
 _append_float(Encoder *self, PyObject *f)
 {
-    return append_double(self->buffer, PyFloat_AS_DOUBLE(f));
+    return Encoder_append_double(self, PyFloat_AS_DOUBLE(f));
+}
+
+/* Non-finite values as INFINITY/NEGATIVE_INFINITY/NAN */
+int
+Encoder_append_double(Encoder *self, double d)
+{
+    if (Py_IS_FINITE(d)) {
+        return append_double(self->buffer, d);
+    }
+    if (Py_IS_NAN(d)) {
+        return _append_bytes_constant(self, &self->float_nan, "NAN");
+    }
+    if (d > 0) {
+        return _append_bytes_constant(self, &self->float_infinity, "INFINITY");
+    }
+    return _append_bytes_constant(self, &self->float_negative_infinity, "NEGATIVE_INFINITY");
 }
 
 Py_LOCAL_INLINE(int)
@@ -236,10 +567,17 @@ _append_str(Encoder *self, PyObject *s)
         return -1;
     }
 
+    if (_get_str_quote(self) == -1) {
+        return -1;
+    }
+
     Py_ssize_t length = PyUnicode_GET_LENGTH(s);
 
     if (length == 0) {
-        return append_string(self->buffer, "\"\"", 2);
+        if (_append_str_quote(self) == -1) {
+            return -1;
+        }
+        return _append_str_quote(self);
     }
 
     switch (PyUnicode_KIND(s)) {
@@ -260,67 +598,51 @@ _append_str(Encoder *self, PyObject *s)
 Py_LOCAL_INLINE(int)
 _append_str_1byte_kind(Encoder *self, PyObject *s, int slen)
 {
-    Py_UCS1 **mapping = _get_str_ucs1_mapping(self);
-    if (mapping == NULL) {
+    const EscapeTable *table = _get_escape_table(self);
+    if (table == NULL) {
         return -1;
     }
 
+    STATS_INC(self, str_1byte);
+
+    Buffer *b = self->buffer;
     Py_UCS1 *data = PyUnicode_1BYTE_DATA(s);
-    PyObject *sub; /* bytes substitution */
     int i;
-    int index_written = -1;
+    int written = 0; /* data[:written] is in the buffer */
 
-    for (i = 0; i < slen; i++) {
-        sub = mapping[data[i]];
-
-        if (sub != NULL) {
-            if (index_written == -1) {
-                if (append_char(self->buffer, '"') == -1) {
-                    return -1;
-                }
-
-                if (i != 0) {
-                    if (append_string(self->buffer, (char *)data, i) == -1) {
-                        return -1;
-                    }
-                }
-            }
-            else {
-                if (i != 0) {
-                    if (append_string(self->buffer, &data[index_written + 1], i - index_written) == -1) {
-                        return -1;
-                    }
-                }
-            }
+    /* Enough for the best case, where no escapes occur. */
+    if (ensure_room(b, slen + 2) == -1) {
+        return -1;
+    }
 
-            if (append_bytes(self->buffer, sub) == -1) {
-                return -1;
-            }
+    if (self->str_quote != 0) {
+        append_char_unsafe(b, self->str_quote);
+    }
 
-            index_written = i;
+    for (i = 0; i < slen; i++) {
+        Py_UCS1 c = data[i];
+
+        if (!ESCAPE_TABLE_NEEDS_ESCAPE(table, c)) {
+            continue;
         }
-    }
 
-    if (index_written == -1) {
-        /* The best case, where no subs occured. */
-        if (ensure_room(self->buffer, slen + 2) == -1) {
+        /* Room for the rest of the string after this escape, too. */
+        if (ensure_room(b, i - written + ESCAPE_SLOT_SIZE + slen - i + 1) == -1) {
             return -1;
         }
 
-        append_char_unsafe(self->buffer, '"');
-        append_string_unsafe(self->buffer, (char *)data, slen);
-        append_char_unsafe(self->buffer, '"');
+        append_string_unsafe(b, (char *)&data[written], i - written);
+        append_string_unsafe(b, (char *)table->replacements[c], table->lengths[c]);
+
+        written = i + 1;
+
+        STATS_INC(self, escapes);
     }
-    else {
-        if (index_written != slen - 1) {
-            if (append_string(self->buffer, &data[index_written + 1], slen - index_written - 1) == -1) {
-                return -1;
-            }
-        }
 
-        if (append_char(self->buffer, '"') == -1) {
-            return -1;
-        }
+    append_string_unsafe(b, (char *)&data[written], slen - written);
+
+    if (self->str_quote != 0) {
+        append_char_unsafe(b, self->str_quote);
     }
 
     return 0;
@@ -348,6 +670,8 @@ _append_str_naive(Encoder *self, PyObject *s, int length)
     PyObject *translated_bytes = NULL;
     int retval = -1;
 
+    STATS_INC(self, str_naive);
+
     PyObject *translation_table = _get_str_translation_table(self);
     if (translation_table == NULL) {
         goto bail;
@@ -363,7 +687,7 @@ _append_str_naive(Encoder *self, PyObject *s, int length)
         goto bail;
     }
 
-    if (append_char(self->buffer, '"') == -1) {
+    if (_append_str_quote(self) == -1) {
         goto bail;
     }
 
@@ -371,7 +695,7 @@ _append_str_naive(Encoder *self, PyObject *s, int length)
         goto bail;
     }
 
-    if (append_char(self->buffer, '"') == -1) {
+    if (_append_str_quote(self) == -1) {
         goto bail;
     }
 
@@ -384,6 +708,15 @@ _append_str_naive(Encoder *self, PyObject *s, int length)
     return retval;
 }
 
+Py_LOCAL_INLINE(int)
+_append_str_quote(Encoder *self)
+{
+    if (self->str_quote == 0) {
+        return 0;
+    }
+    return append_char(self->buffer, self->str_quote);
+}
+
 Py_LOCAL_INLINE(int)
 _append_bytes(Encoder *self, PyObject *bytes)
 {
@@ -401,22 +734,22 @@ _append_dict(Encoder *self, PyObject *dict)
     PyObject *key;
     PyObject *value;
 
-    if (self->dict_preserve_order == -1) {
-        PyObject *user_dict_preserve_order = PyObject_GetAttrString((PyObject*)self, "DICT_PRESERVE_ORDER");
-        if (user_dict_preserve_order == NULL)
-            goto bail;
-
-        self->dict_preserve_order = PyObject_IsTrue(user_dict_preserve_order);
+    if (Encoder_enter(self, PyDict_GET_SIZE(dict)) == -1)
+        return -1;
 
-        Py_DECREF(user_dict_preserve_order);
+    if (!PyDict_CheckExact(dict)) {
+        int dict_preserve_order = Encoder_get_dict_preserve_order(self);
+        if (dict_preserve_order == -1)
+            goto bail;
 
-        if (self->dict_preserve_order == -1)
+        if (dict_preserve_order == 1) {
+            STATS_INC(self, mapping);
+            retval = _append_mapping(self, dict);
             goto bail;
+        }
     }
 
-    if (!PyDict_CheckExact(dict) && self->dict_preserve_order == 1) {
-        return _append_mapping(self, dict);
-    }
+    STATS_INC(self, dict);
 
     Py_ssize_t pos = 0; /* NOT incremental */
     int index = 0;
@@ -448,6 +781,7 @@ _append_dict(Encoder *self, PyObject *dict)
 
     retval = 0;
   bail:
+    Encoder_leave(self);
     return retval;
 }
 
@@ -455,51 +789,48 @@ Py_LOCAL_INLINE(int)
 _append_mapping(Encoder *self, PyObject *mapping) {
     int retval = -1;
     Buffer *b = self->buffer;
-    PyObject *items = PyMapping_Items(mapping);
+    MappingIter iter;
 
-    if (items == NULL)
-        goto bail;
-
-    int length = PySequence_Fast_GET_SIZE(items);
+    /* Borrowed references */
+    PyObject *key;
+    PyObject *value;
 
-    if (length == 0) {
-        if (append_string(b, "{}", 2) == -1)
-            goto bail;
-    }
-    else {
-        /* Borrowed references */
-        PyObject *item;
+    int index = 0;
+    int status;
 
-        int i;
+    if (Encoder_mapping_begin(self, &iter, mapping) == -1)
+        goto bail;
 
-        if (append_char(b, '{') == -1)
+    while ((status = Encoder_mapping_next(&iter, &key, &value)) == 1) {
+        if (append_char(b, (index == 0 ? '{' : ',')) == -1)
             goto bail;
 
-        for (i = 0; i < length; i++) {
-            if (i != 0)
-                if (append_char(b, ',') == -1)
-                    goto bail;
-
-            item = PyList_GET_ITEM(items, i);
+        if (_append(self, key) == -1)
+            goto bail;
 
-            if (_append(self, PyTuple_GET_ITEM(item, 0)) == -1)
-                goto bail;
+        if (append_char(b, ':') == -1)
+            goto bail;
 
-            if (append_char(b, ':') == -1)
-                goto bail;
+        if (_append(self, value) == -1)
+            goto bail;
 
-            if (_append(self, PyTuple_GET_ITEM(item, 1)) == -1)
-                goto bail;
+        index++;
+    }
 
-        }
+    if (status == -1)
+        goto bail;
 
+    if (index == 0) {
+        if (append_string(b, "{}", 2) == -1)
+            goto bail;
+    } else {
         if (append_char(b, '}') == -1)
             goto bail;
     }
 
     retval = 0;
   bail:
-    Py_XDECREF(items);
+    Encoder_mapping_end(&iter);
     return retval;
 }
 
@@ -512,6 +843,9 @@ _append_fast_sequence(Encoder *self, PyObject *sequence)
     /* XXX: must be list/tuple, using the assumption macros */
     int length = PySequence_Fast_GET_SIZE(sequence);
 
+    if (Encoder_enter(self, length) == -1)
+        return -1;
+
     if (length == 0) {
         if (append_string(b, "[]", 2) == -1)
             goto bail;
@@ -538,26 +872,75 @@ _append_fast_sequence(Encoder *self, PyObject *sequence)
 
     retval = 0;
   bail:
+    Encoder_leave(self);
     return retval;
 }
 
 
-Py_LOCAL_INLINE(Py_UCS1**)
-_get_str_ucs1_mapping(Encoder *self)
+/*
+ * The escape table is compiled from STRING_ESCAPES once per class, and
+ * kept on the class (not inherited, as subclasses may differ) for every
+ * instance to share.
+ */
+#define ESCAPE_TABLE_ATTRIBUTE "_string_escape_table"
+
+static void
+_escape_table_capsule_destructor(PyObject *capsule)
 {
-    if (self->_str_ucs1_mapping != NULL) {
-        return self->_str_ucs1_mapping;
+    PyMem_Free(PyCapsule_GetPointer(capsule, ESCAPE_TABLE_ATTRIBUTE));
+}
+
+Py_LOCAL_INLINE(const EscapeTable *)
+_get_escape_table(Encoder *self)
+{
+    if (self->_escape_table != NULL) {
+        return self->_escape_table;
     }
 
+    PyTypeObject *type = Py_TYPE(self);
+    PyObject *capsule = PyDict_GetItemString(type->tp_dict, ESCAPE_TABLE_ATTRIBUTE);
+
+    if (capsule != NULL && PyCapsule_IsValid(capsule, ESCAPE_TABLE_ATTRIBUTE)) {
+        Py_INCREF(capsule);
+    }
+    else {
+        EscapeTable *table = _compile_escape_table(self);
+        if (table == NULL) {
+            return NULL;
+        }
+
+        capsule = PyCapsule_New(table, ESCAPE_TABLE_ATTRIBUTE, _escape_table_capsule_destructor);
+        if (capsule == NULL) {
+            PyMem_Free(table);
+            return NULL;
+        }
+
+        /* Immutable types (Encoder itself) can't take attributes; their instances keep their own. */
+        if (!(type->tp_flags & Py_TPFLAGS_IMMUTABLETYPE)) {
+            if (PyObject_SetAttrString((PyObject *)type, ESCAPE_TABLE_ATTRIBUTE, capsule) == -1) {
+                Py_DECREF(capsule);
+                return NULL;
+            }
+        }
+    }
+
+    self->_escape_table_owner = capsule;
+    self->_escape_table = PyCapsule_GetPointer(capsule, ESCAPE_TABLE_ATTRIBUTE);
+
+    return self->_escape_table;
+}
+
+static EscapeTable *
+_compile_escape_table(Encoder *self)
+{
+    EscapeTable *table = NULL;
+
     /* Temporary references */
     PyObject *user_string_escapes = NULL;
 
     /* Borrowed references */
     PyObject *key, *value;
 
-    /* Kept references - dec on __del__ */
-    PyObject *value_bytes;
-
     user_string_escapes = PyObject_GetAttrString((PyObject*)self, "STRING_ESCAPES");
     if (user_string_escapes == NULL) {
         goto error;
@@ -568,16 +951,12 @@ _get_str_ucs1_mapping(Encoder *self)
         goto error;
     }
 
-    self->_str_ucs1_mapping = PyMem_Malloc(sizeof(Py_UCS1*) * 256);
-    if (self->_str_ucs1_mapping == NULL) {
+    table = PyMem_Calloc(1, sizeof(EscapeTable));
+    if (table == NULL) {
+        PyErr_NoMemory();
         goto error;
     }
 
-    int i;
-    for (i = 0; i < 256; i++) {
-        self->_str_ucs1_mapping[i] = NULL;
-    }
-
     Py_ssize_t pos = 0;
 
     while (PyDict_Next(user_string_escapes, &pos, &key, &value)) {
@@ -602,22 +981,217 @@ _get_str_ucs1_mapping(Encoder *self)
             goto error;
         }
 
-        value_bytes = PyUnicode_AsEncodedString(value, NULL, NULL);
-        if (value_bytes == NULL) {
+        Py_ssize_t length;
+        const char *replacement = PyUnicode_AsUTF8AndSize(value, &length);
+        if (replacement == NULL) {
+            goto error;
+        }
+
+        if (length > ESCAPE_SLOT_SIZE) {
+            PyErr_Format(PyExc_ValueError, "STRING_ESCAPES: replacements must be at most %d bytes, got: %R",
+                         ESCAPE_SLOT_SIZE, value);
             goto error;
         }
 
         Py_UCS1 offset = PyUnicode_1BYTE_DATA(key)[0];
 
-        self->_str_ucs1_mapping[offset] = value_bytes;
+        table->needs_escape[offset >> 3] |= 1 << (offset & 7);
+        table->lengths[offset] = length;
+        memcpy(table->replacements[offset], replacement, length);
     }
 
-    goto cleanup;
+    /* Latin-1 past ASCII is two bytes of UTF-8, unless escaped otherwise */
+    int c;
+    for (c = 0x80; c <= 0xff; c++) {
+        if (ESCAPE_TABLE_NEEDS_ESCAPE(table, c)) {
+            continue;
+        }
+        table->needs_escape[c >> 3] |= 1 << (c & 7);
+        table->lengths[c] = 2;
+        table->replacements[c][0] = (char)(0xc0 | (c >> 6));
+        table->replacements[c][1] = (char)(0x80 | (c & 0x3f));
+    }
+
+    Py_DECREF(user_string_escapes);
+    return table;
+
   error:
-    _xfree_str_ucs1_mapping(self);
-  cleanup:
+    PyMem_Free(table);
     Py_XDECREF(user_string_escapes);
-    return self->_str_ucs1_mapping;
+    return NULL;
+}
+
+int
+Encoder_get_str_quote(Encoder *self)
+{
+    return _get_str_quote(self);
+}
+
+#define MAPPING_DICT    0   /* Storage order is iteration order */
+#define MAPPING_ODICT   1   /* Its own order: keys, looked up */
+#define MAPPING_ITEMS   2   /* items() overridden, or not a dict */
+
+/* Unless a dict subclass changes iteration, its storage order is the order */
+static int
+_mapping_kind(ModuleState *state, PyObject *mapping)
+{
+    if (PyODict_Check(mapping)) {
+        return MAPPING_ODICT;
+    }
+
+    if (!PyDict_Check(mapping)) {
+        return MAPPING_ITEMS;
+    }
+
+    PyObject *items_name = state->items_name;
+    PyTypeObject *type = Py_TYPE(mapping);
+
+    if (type->tp_iter != PyDict_Type.tp_iter ||
+        _PyType_Lookup(type, items_name) != _PyType_Lookup(&PyDict_Type, items_name)) {
+        return MAPPING_ITEMS;
+    }
+
+    return MAPPING_DICT;
+}
+
+int
+Encoder_mapping_begin(Encoder *self, MappingIter *iter, PyObject *mapping)
+{
+    iter->mapping = mapping;
+    iter->pos = 0;
+    iter->iterator = NULL;
+    iter->key = NULL;
+    iter->item = NULL;
+
+    iter->kind = _mapping_kind(self->state, mapping);
+
+    switch (iter->kind) {
+    case MAPPING_ODICT:
+        iter->iterator = PyObject_GetIter(mapping);
+        break;
+    case MAPPING_ITEMS: {
+        PyObject *items = PyObject_CallMethod(mapping, "items", NULL);
+        if (items == NULL) {
+            return -1;
+        }
+        iter->iterator = PyObject_GetIter(items);
+        Py_DECREF(items);
+        break;
+    }
+    case MAPPING_DICT:
+        return 0;
+    default:
+        return -1;
+    }
+
+    return iter->iterator == NULL ? -1 : 0;
+}
+
+/*
+ * 1 with the next pair (borrowed, valid until the next call), 0 when done,
+ * -1 on error.
+ */
+int
+Encoder_mapping_next(MappingIter *iter, PyObject **key, PyObject **value)
+{
+    Py_CLEAR(iter->key);
+    Py_CLEAR(iter->item);
+
+    switch (iter->kind) {
+    case MAPPING_DICT:
+        return PyDict_Next(iter->mapping, &iter->pos, key, value);
+
+    case MAPPING_ODICT:
+        iter->key = PyIter_Next(iter->iterator);
+        if (iter->key == NULL) {
+            return PyErr_Occurred() ? -1 : 0;
+        }
+
+        *value = PyDict_GetItemWithError(iter->mapping, iter->key);
+        if (*value == NULL) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetObject(PyExc_KeyError, iter->key);
+            }
+            return -1;
+        }
+        *key = iter->key;
+        return 1;
+
+    default:
+        iter->item = PyIter_Next(iter->iterator);
+        if (iter->item == NULL) {
+            return PyErr_Occurred() ? -1 : 0;
+        }
+
+        if (!PyTuple_Check(iter->item) || PyTuple_GET_SIZE(iter->item) != 2) {
+            PyErr_Format(PyExc_TypeError, "%R.items(): expected (key, value), got: %R",
+                         Py_TYPE(iter->mapping), iter->item);
+            return -1;
+        }
+        *key = PyTuple_GET_ITEM(iter->item, 0);
+        *value = PyTuple_GET_ITEM(iter->item, 1);
+        return 1;
+    }
+}
+
+void
+Encoder_mapping_end(MappingIter *iter)
+{
+    Py_CLEAR(iter->key);
+    Py_CLEAR(iter->item);
+    Py_CLEAR(iter->iterator);
+}
+
+int
+Encoder_get_dict_preserve_order(Encoder *self)
+{
+    if (self->dict_preserve_order == -1) {
+        PyObject *user_dict_preserve_order = PyObject_GetAttrString((PyObject*)self, "DICT_PRESERVE_ORDER");
+        if (user_dict_preserve_order == NULL)
+            return -1;
+
+        self->dict_preserve_order = PyObject_IsTrue(user_dict_preserve_order);
+
+        Py_DECREF(user_dict_preserve_order);
+    }
+
+    return self->dict_preserve_order;
+}
+
+Py_LOCAL_INLINE(int)
+_get_str_quote(Encoder *self)
+{
+    if (self->str_quote != -1) {
+        return self->str_quote;
+    }
+
+    PyObject *user_string_quote = PyObject_GetAttrString((PyObject*)self, "STRING_QUOTE");
+    if (user_string_quote == NULL) {
+        return -1;
+    }
+
+    if (!PyUnicode_Check(user_string_quote) ||
+        PyUnicode_READY(user_string_quote) == -1 ||
+        PyUnicode_GET_LENGTH(user_string_quote) > 1 ||
+        PyUnicode_KIND(user_string_quote) != PyUnicode_1BYTE_KIND ||
+        (PyUnicode_GET_LENGTH(user_string_quote) == 1 && PyUnicode_1BYTE_DATA(user_string_quote)[0] > 127)) {
+        if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_TypeError, "STRING_QUOTE: expected zero or one ASCII character, got: %R", user_string_quote);
+        }
+        Py_DECREF(user_string_quote);
+        return -1;
+    }
+
+    if (PyUnicode_GET_LENGTH(user_string_quote) == 0) {
+        self->str_quote = 0;
+    }
+    else {
+        self->str_quote = PyUnicode_1BYTE_DATA(user_string_quote)[0];
+    }
+
+    Py_DECREF(user_string_quote);
+
+    return self->str_quote;
 }
 
 Py_LOCAL_INLINE(PyObject*)
@@ -673,63 +1247,112 @@ _append_bytes_constant(Encoder *self, PyObject **member, const char *name)
     return append_bytes(self->buffer, bytes);
 }
 
-static void
-_xfree_str_ucs1_mapping(Encoder *self) {
-    if (self->_str_ucs1_mapping != NULL) {
-        int i;
+#ifdef ENCODER_STATS
+static PyObject *
+stats(Encoder *self, PyObject *unused)
+{
+    EncoderStats *s = &self->stats;
+
+    PyObject *iterencode = PyDict_Copy(s->iterencode);
+    if (iterencode == NULL) {
+        return NULL;
+    }
+
+    return Py_BuildValue(
+        "{s:K,s:K,s:i,s:{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K},s:K,s:K,s:K,s:{s:K,s:K},s:N}",
+        "bytes",         s->bytes_out,
+        "resizes",       (unsigned long long)self->buffer->_resizes,
+        "peak_size",     self->buffer->_peak_size,
+        "types",
+            "none",      s->none,
+            "true",      s->bool_true,
+            "false",     s->bool_false,
+            "int",       s->int_,
+            "float",     s->float_,
+            "str",       s->str,
+            "bytes",     s->bytes,
+            "sequence",  s->sequence,
+            "dict",      s->dict,
+            "mapping",   s->mapping,
+        "str_1byte",     s->str_1byte,
+        "str_naive",     s->str_naive,
+        "escapes",       s->escapes,
+        "memo",
+            "hits",      s->memo_hits,
+            "misses",    s->memo_misses,
+        "iterencode",    iterencode);
+}
 
-        for (i = 0; i < 256; i++) {
-            Py_XDECREF(self->_str_ucs1_mapping[i]);
+static PyObject *
+reset_stats(Encoder *self, PyObject *unused)
+{
+    PyObject *iterencode = self->stats.iterencode;
+
+    PyDict_Clear(iterencode);
+    memset(&self->stats, 0, sizeof(EncoderStats));
+    self->stats.iterencode = iterencode;
+
+    self->buffer->_resizes = 0;
+    self->buffer->_peak_size = self->buffer->_size;
+
+    Py_RETURN_NONE;
+}
+
+static int
+_stats_count_iterencode(Encoder *self, PyObject *type)
+{
+    PyObject *count = PyDict_GetItemWithError(self->stats.iterencode, type);
+    long n = 0;
+
+    if (count == NULL) {
+        if (PyErr_Occurred()) {
+            return -1;
         }
-        PyMem_Free(self->_str_ucs1_mapping);
+    }
+    else {
+        n = PyLong_AsLong(count);
+    }
 
-        self->_str_ucs1_mapping = NULL;
+    count = PyLong_FromLong(n + 1);
+    if (count == NULL) {
+        return -1;
     }
-};
+
+    int retval = PyDict_SetItem(self->stats.iterencode, type, count);
+    Py_DECREF(count);
+    return retval;
+}
+#endif
 
 static PyMethodDef methods[] = {
-    {"encode",         (PyCFunction)encode,         METH_O, encode___doc__},
-    {"encode_bytes",   (PyCFunction)encode_bytes,   METH_O, encode_bytes___doc__},
+    {"encode",         (PyCFunction)encode,         METH_FASTCALL | METH_KEYWORDS, encode___doc__},
+    {"encode_bytes",   (PyCFunction)encode_bytes,   METH_FASTCALL | METH_KEYWORDS, encode_bytes___doc__},
+    {"encode_segments", (PyCFunction)encode_segments, METH_O, Encoder_encode_segments__doc__},
+    {"encode_writev",  (PyCFunction)encode_writev,  METH_VARARGS, Encoder_encode_writev__doc__},
+    {"encode_compressed", (PyCFunction)encode_compressed, METH_VARARGS | METH_KEYWORDS, encode_compressed___doc__},
+    {"encode_records", (PyCFunction)Encoder_encode_records, METH_O, encode_records___doc__},
+    {"memoize",        (PyCFunction)Encoder_memoize, METH_VARARGS | METH_KEYWORDS, memoize___doc__},
+    {"forget",         (PyCFunction)Encoder_forget,  METH_O, forget___doc__},
+    {"invalidate",     (PyCFunction)Encoder_invalidate, METH_O, invalidate___doc__},
+#ifdef ENCODER_STATS
+    {"stats",          (PyCFunction)stats,          METH_NOARGS, stats___doc__},
+    {"reset_stats",    (PyCFunction)reset_stats,    METH_NOARGS, reset_stats___doc__},
+#endif
     {NULL} /* Sentinel */
 };
 
-PyTypeObject Encoder_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "encoder.Encoder",         /* tp_name */
-    sizeof(Encoder),           /* tp_basicsize */
-    0,                         /* tp_itemsize */
-    (destructor)__del__,       /* tp_dealloc */
-    0,                         /* tp_print */
-    0,                         /* tp_getattr */
-    0,                         /* tp_setattr */
-    0,                         /* tp_reserved */
-    0,                         /* tp_repr */
-    0,                         /* tp_as_number */
-    0,                         /* tp_as_sequence */
-    0,                         /* tp_as_mapping */
-    0,                         /* tp_hash  */
-    0,                         /* tp_call */
-    0,                         /* tp_str */
-    0,                         /* tp_getattro */
-    0,                         /* tp_setattro */
-    0,                         /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,    /* tp_flags */
-    __doc__,                   /* tp_doc */
-    0,                         /* tp_traverse */
-    0,                         /* tp_clear */
-    0,                         /* tp_richcompare */
-    0,                         /* tp_weaklistoffset */
-    0,                         /* tp_iter */
-    0,                         /* tp_iternext */
-    methods,                   /* tp_methods */
-    0,                         /* tp_members */
-    0,                         /* tp_getset */
-    0,                         /* tp_base */
-    0,                         /* tp_dict */
-    0,                         /* tp_descr_get */
-    0,                         /* tp_descr_set */
-    0,                         /* tp_dictoffset */
-    0,                         /* tp_init */
-    0,                         /* tp_alloc */
-    __new__,                   /* tp_new */
+static PyType_Slot slots[] = {
+    {Py_tp_dealloc, __del__},
+    {Py_tp_doc,     (void *)__doc__},
+    {Py_tp_methods, methods},
+    {Py_tp_new,     __new__},
+    {0, NULL},
+};
+
+PyType_Spec Encoder_spec = {
+    "encoder.Encoder",
+    sizeof(Encoder),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_IMMUTABLETYPE,
+    slots,
 };
@@ -0,0 +1,230 @@
+#include <Python.h>
+
+#include "buffer.h"
+#include "encoder.h"
+#include "module.h"
+
+/*
+ * encode(o, max_bytes=None, max_depth=None, max_items=None): a budget for
+ * one call, so a pathological object fails fast with EncodeLimitError
+ * rather than expanding into however much memory it takes.
+ *
+ * max_depth/max_items are counted by Encoder_enter/Encoder_leave around
+ * each container, and Encoder_add_item for items of unknown number. max_bytes clamps the Buffer's _size to the budget, so
+ * ensure_room's fast path is unchanged, and installs Encoder_limit_spill as
+ * the Buffer's spill hook, so its slow path checks before growing.
+ */
+
+/*
+ * Room asked for past the budget but still granted, as appenders ask for
+ * more than they use (e.g. _SPRINTF_MAX_LONG_LONG_LENGTH); what is actually
+ * written past it fails the next check, or the one at the end.
+ */
+#define LIMIT_SLACK 64
+
+static int  _parse_limits (EncodeLimits *limits, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames);
+static int  _parse_limit  (PyObject *value, const char *name, Py_ssize_t *limit);
+static void _clamp        (Buffer *b, EncodeLimits *limits, int needed);
+
+PyObject *
+Encoder_encode_limited(Encoder *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames,
+                       int (*append)(Encoder *, PyObject *))
+{
+    Buffer *b = self->buffer;
+    BufferFrame frame;
+    EncodeLimits limits;
+    EncodeLimits *enclosing = self->limits;
+    PyObject *retval = NULL;
+
+    if (_parse_limits(&limits, args, nargs, kwnames) == -1) {
+        return NULL;
+    }
+
+    limits.error = self->state->EncodeLimitError;
+
+    int size = b->_size;
+
+    if (Buffer_push_frame(b, &frame) == -1) {
+        return NULL;
+    }
+
+    /* Past INT_MAX the Buffer can't go anyway */
+    int bytes_limited = limits.max_bytes < INT_MAX - 1 - LIMIT_SLACK - frame.start;
+
+    if (bytes_limited) {
+        limits.end = frame.start + (int)limits.max_bytes;
+        limits.capacity = b->_size;
+        _clamp(b, &limits, 0);
+
+        b->_spill = Encoder_limit_spill;
+        b->_spill_state = &limits;
+    }
+
+    /* A nested encode() is limited only by its own arguments */
+    self->limits = (limits.max_depth != PY_SSIZE_T_MAX || limits.max_items != PY_SSIZE_T_MAX) ? &limits : NULL;
+
+    int status = append(self, args[0]);
+
+    self->limits = enclosing;
+
+    if (bytes_limited) {
+        if (b->_size == limits.clamp) {
+            b->_size = limits.capacity;
+        }
+
+        /* Output past the budget within the slack, or from a nested encode(), is only caught here */
+        if (status != -1 && b->_index > limits.end) {
+            PyErr_Format(limits.error, "max_bytes: output exceeds %zd bytes", limits.max_bytes);
+            status = -1;
+        }
+    }
+
+    if (status != -1) {
+        retval = Buffer_frame_as_bytes(b, &frame);
+        STATS_ADD(self, bytes_out, b->_index - frame.start);
+    }
+
+    Buffer_pop_frame(b, &frame);
+
+    /* Don't keep the memory an aborted encode grew into */
+    if (retval == NULL && frame.start == 0) {
+        Buffer_shrink(b, size);
+    }
+
+    return retval;
+}
+
+/* Raise EncodeLimitError for passing max_depth, or else max_items */
+int
+Encoder_limit_error(Encoder *self, int depth)
+{
+    EncodeLimits *limits = self->limits;
+
+    if (depth) {
+        PyErr_Format(limits->error, "max_depth: containers nested deeper than %zd", limits->max_depth);
+    }
+    else {
+        PyErr_Format(limits->error, "max_items: more than %zd items", limits->max_items);
+    }
+    return -1;
+}
+
+static int
+_parse_limits(EncodeLimits *limits, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    Py_ssize_t i;
+
+    limits->max_depth = PY_SSIZE_T_MAX;
+    limits->max_items = PY_SSIZE_T_MAX;
+    limits->max_bytes = PY_SSIZE_T_MAX;
+    limits->depth = 0;
+    limits->items = 0;
+
+    if (nargs != 1) {
+        PyErr_Format(PyExc_TypeError, "encode: expected 1 positional argument, got %zd", nargs);
+        return -1;
+    }
+
+    if (kwnames == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < PyTuple_GET_SIZE(kwnames); i++) {
+        PyObject *name = PyTuple_GET_ITEM(kwnames, i);
+        PyObject *value = args[nargs + i];
+        int status;
+
+        if (PyUnicode_CompareWithASCIIString(name, "max_bytes") == 0) {
+            status = _parse_limit(value, "max_bytes", &limits->max_bytes);
+        }
+        else if (PyUnicode_CompareWithASCIIString(name, "max_depth") == 0) {
+            status = _parse_limit(value, "max_depth", &limits->max_depth);
+        }
+        else if (PyUnicode_CompareWithASCIIString(name, "max_items") == 0) {
+            status = _parse_limit(value, "max_items", &limits->max_items);
+        }
+        else {
+            PyErr_Format(PyExc_TypeError, "encode: unexpected keyword argument %R", name);
+            return -1;
+        }
+
+        if (status == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* None, or an int >= 0 */
+static int
+_parse_limit(PyObject *value, const char *name, Py_ssize_t *limit)
+{
+    if (value == Py_None) {
+        return 0;
+    }
+
+    if (!PyLong_Check(value)) {
+        PyErr_Format(PyExc_TypeError, "%s: expected int or None, got: %R", name, value);
+        return -1;
+    }
+
+    int overflow;
+    long long n = PyLong_AsLongLongAndOverflow(value, &overflow);
+    if (n == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+
+    if (n < 0 || overflow < 0) {
+        PyErr_Format(PyExc_ValueError, "%s: expected >= 0, got: %R", name, value);
+        return -1;
+    }
+
+    /* Beyond any real budget, as good as none */
+    *limit = (overflow > 0 || n > PY_SSIZE_T_MAX) ? PY_SSIZE_T_MAX : (Py_ssize_t)n;
+    return 0;
+}
+
+/* The slow path of ensure_room while max_bytes applies; grows the Buffer in place */
+int
+Encoder_limit_spill(Buffer *b, int length)
+{
+    EncodeLimits *limits = b->_spill_state;
+
+    if (b->_index > limits->end || length > limits->end + LIMIT_SLACK - b->_index) {
+        PyErr_Format(limits->error, "max_bytes: output exceeds %zd bytes", limits->max_bytes);
+        return -1;
+    }
+
+    int status = 0;
+
+    if (b->_size == limits->clamp) {
+        b->_size = limits->capacity;
+    }
+
+    if (b->_index + length >= b->_size) {
+        b->_spill = NULL;
+        status = _Buffer_resize(b, length);
+        b->_spill = Encoder_limit_spill;
+    }
+
+    limits->capacity = b->_size;
+    _clamp(b, limits, b->_index + length + 1);
+
+    return status;
+}
+
+/*
+ * _size down to just past the budget, or to `needed` if more was granted;
+ * within the real capacity either way, so appenders stay in bounds.
+ */
+static void
+_clamp(Buffer *b, EncodeLimits *limits, int needed)
+{
+    int clamp = limits->end + 1 > needed ? limits->end + 1 : needed;
+
+    if (b->_size > clamp) {
+        b->_size = clamp;
+    }
+    limits->clamp = b->_size;
+}
@@ -0,0 +1,479 @@
+#include <Python.h>
+
+#include "buffer.h"
+#include "encoder.h"
+
+/*
+ * Memoized output of designated objects (memoize()), keyed by identity and
+ * spliced in with one copy on later encounters, within MEMO_BUDGET bytes,
+ * least recently used first out.
+ *
+ * Objects supporting weak references are held weakly and their entries
+ * dropped once found dead; others (e.g. tuples) are kept alive, so their
+ * identity can't be reused. Either can also be dropped with forget(), or
+ * invalidate() for all memoized under a token.
+ */
+
+/* Entries are allocated individually, so LRU links survive table moves */
+typedef struct _MemoEntry MemoEntry;
+
+struct _MemoEntry {
+    void *key;              /* The object's address */
+    PyObject *ref;          /* The object, or a weak reference to it */
+    int weak;
+    PyObject *token;        /* Or NULL */
+
+    char *data;             /* Encoded, or NULL until first encountered */
+    Py_ssize_t length;
+    int encoding;           /* Being encoded, further down the stack */
+
+    MemoEntry *prev;        /* LRU, most recent first; only while data != NULL */
+    MemoEntry *next;
+};
+
+struct _Memo {
+    MemoEntry **table;      /* Open addressing, linear probing */
+    Py_ssize_t mask;
+    Py_ssize_t used;
+
+    MemoEntry lru;          /* Sentinel */
+
+    Py_ssize_t bytes;
+    Py_ssize_t budget;
+};
+
+#define MEMO_TABLE_SIZE_INITIAL 16
+
+/* Forward declarations */
+static Memo *      _memo_new      (Py_ssize_t budget);
+static MemoEntry * _memo_find     (Memo *memo, void *key);
+static int         _memo_insert   (Memo *memo, MemoEntry *entry);
+static void        _memo_remove   (Memo *memo, MemoEntry *entry);
+static void        _memo_sweep    (Memo *memo);
+static int         _memo_store    (Memo *memo, MemoEntry *entry, const char *data, Py_ssize_t length);
+static PyObject *  _memo_referent (MemoEntry *entry);
+
+Py_LOCAL_INLINE(Py_ssize_t) _memo_slot (Memo *memo, void *key);
+
+Py_LOCAL_INLINE(void) _lru_unlink (MemoEntry *entry);
+Py_LOCAL_INLINE(void) _lru_push   (Memo *memo, MemoEntry *entry);
+
+/*
+ * 1 if `o` is memoized and was appended (from the memo, or encoded with
+ * `append` and stored), 0 if not memoized, -1 on error.
+ */
+int
+Encoder_append_memo(Encoder *self, PyObject *o, int (*append)(Encoder *, PyObject *))
+{
+    Memo *memo = self->memo;
+    Buffer *b = self->buffer;
+
+    MemoEntry *entry = _memo_find(memo, o);
+    if (entry == NULL || entry->encoding) {
+        return 0;
+    }
+
+    if (_memo_referent(entry) != o) {
+        /* Died, and something else now lives at the address */
+        _memo_remove(memo, entry);
+        return 0;
+    }
+
+    if (entry->data != NULL) {
+        STATS_INC(self, memo_hits);
+
+        if (ensure_room(b, entry->length) == -1) {
+            return -1;
+        }
+        append_string_unsafe(b, entry->data, entry->length);
+
+        _lru_unlink(entry);
+        _lru_push(memo, entry);
+
+        return 1;
+    }
+
+    STATS_INC(self, memo_misses);
+
+    /*
+     * Encode in place, so the output is contiguous: segment or compress
+     * spilling is suspended, but not max_bytes, which only grows the Buffer.
+     */
+    int (*spill)(Buffer *, int) = b->_spill;
+    void *spill_state = b->_spill_state;
+    int start = b->_index;
+
+    if (spill != Encoder_limit_spill) {
+        b->_spill = NULL;
+        b->_spill_state = NULL;
+    }
+    entry->encoding = 1;
+
+    int status = append(self, o);
+
+    b->_spill = spill;
+    b->_spill_state = spill_state;
+
+    /* The hook may have forgotten it meanwhile */
+    entry = _memo_find(memo, o);
+    if (entry != NULL) {
+        entry->encoding = 0;
+    }
+
+    if (status == -1) {
+        return -1;
+    }
+
+    if (entry != NULL && _memo_store(memo, entry, &b->_data[start], b->_index - start) == -1) {
+        return -1;
+    }
+
+    return 1;
+}
+
+void
+Encoder_memo_free(Memo *memo)
+{
+    Py_ssize_t i;
+
+    if (memo == NULL) {
+        return;
+    }
+
+    for (i = 0; i <= memo->mask; i++) {
+        MemoEntry *entry = memo->table[i];
+        if (entry != NULL) {
+            Py_DECREF(entry->ref);
+            Py_XDECREF(entry->token);
+            PyMem_Free(entry->data);
+            PyMem_Free(entry);
+        }
+    }
+
+    PyMem_Free(memo->table);
+    PyMem_Free(memo);
+}
+
+PyObject *
+Encoder_memoize(Encoder *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"o", "token", NULL};
+
+    PyObject *o;
+    PyObject *token = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O:memoize", kwlist, &o, &token)) {
+        return NULL;
+    }
+
+    if (self->memo == NULL) {
+        PyObject *user_budget = PyObject_GetAttrString((PyObject *)self, "MEMO_BUDGET");
+        if (user_budget == NULL) {
+            return NULL;
+        }
+
+        Py_ssize_t budget = PyLong_AsSsize_t(user_budget);
+        Py_DECREF(user_budget);
+        if (budget == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+
+        self->memo = _memo_new(budget);
+        if (self->memo == NULL) {
+            return NULL;
+        }
+    }
+
+    Memo *memo = self->memo;
+    MemoEntry *entry = _memo_find(memo, o);
+
+    if (entry != NULL) {
+        if (_memo_referent(entry) == o) {
+            /* Already memoized: just retoken */
+            Py_XDECREF(entry->token);
+            entry->token = token == Py_None ? NULL : token;
+            Py_XINCREF(entry->token);
+            Py_RETURN_NONE;
+        }
+        _memo_remove(memo, entry);
+    }
+
+    entry = PyMem_Malloc(sizeof(MemoEntry));
+    if (entry == NULL) {
+        return PyErr_NoMemory();
+    }
+
+    if (PyType_SUPPORTS_WEAKREFS(Py_TYPE(o))) {
+        entry->ref = PyWeakref_NewRef(o, NULL);
+        if (entry->ref == NULL) {
+            PyMem_Free(entry);
+            return NULL;
+        }
+        entry->weak = 1;
+    }
+    else {
+        entry->ref = o;
+        Py_INCREF(o);
+        entry->weak = 0;
+    }
+
+    entry->key = o;
+    entry->token = token == Py_None ? NULL : token;
+    Py_XINCREF(entry->token);
+    entry->data = NULL;
+    entry->length = 0;
+    entry->encoding = 0;
+    entry->prev = NULL;
+    entry->next = NULL;
+
+    if (_memo_insert(memo, entry) == -1) {
+        Py_DECREF(entry->ref);
+        Py_XDECREF(entry->token);
+        PyMem_Free(entry);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyObject *
+Encoder_forget(Encoder *self, PyObject *o)
+{
+    if (self->memo != NULL) {
+        MemoEntry *entry = _memo_find(self->memo, o);
+        if (entry != NULL) {
+            _memo_remove(self->memo, entry);
+        }
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyObject *
+Encoder_invalidate(Encoder *self, PyObject *token)
+{
+    Memo *memo = self->memo;
+    Py_ssize_t i = 0;
+
+    if (memo == NULL) {
+        Py_RETURN_NONE;
+    }
+
+    /* Removal shifts later entries back into slot i, so only advance past keepers */
+    while (i <= memo->mask) {
+        MemoEntry *entry = memo->table[i];
+
+        if (entry != NULL && entry->token != NULL) {
+            int equal = PyObject_RichCompareBool(entry->token, token, Py_EQ);
+            if (equal == -1) {
+                return NULL;
+            }
+            if (equal) {
+                _memo_remove(memo, entry);
+                continue;
+            }
+        }
+        i++;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static Memo *
+_memo_new(Py_ssize_t budget)
+{
+    Memo *memo = PyMem_Malloc(sizeof(Memo));
+    if (memo == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    memo->table = PyMem_Calloc(MEMO_TABLE_SIZE_INITIAL, sizeof(MemoEntry *));
+    if (memo->table == NULL) {
+        PyMem_Free(memo);
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    memo->mask = MEMO_TABLE_SIZE_INITIAL - 1;
+    memo->used = 0;
+    memo->lru.prev = memo->lru.next = &memo->lru;
+    memo->bytes = 0;
+    memo->budget = budget;
+
+    return memo;
+}
+
+/* Where `key` is, or the empty slot it would go in */
+Py_LOCAL_INLINE(Py_ssize_t)
+_memo_slot(Memo *memo, void *key)
+{
+    /* Objects are 16-byte aligned; mix the rest */
+    size_t h = (size_t)key >> 4;
+    Py_ssize_t i = (Py_ssize_t)((h ^ (h >> 16)) & memo->mask);
+
+    while (memo->table[i] != NULL && memo->table[i]->key != key) {
+        i = (i + 1) & memo->mask;
+    }
+
+    return i;
+}
+
+static MemoEntry *
+_memo_find(Memo *memo, void *key)
+{
+    return memo->table[_memo_slot(memo, key)];
+}
+
+static int
+_memo_insert(Memo *memo, MemoEntry *entry)
+{
+    Py_ssize_t i;
+
+    if ((memo->used + 1) * 3 >= (memo->mask + 1) * 2) {
+        /* Dead entries out first; only grow if still needed */
+        _memo_sweep(memo);
+    }
+
+    if ((memo->used + 1) * 3 >= (memo->mask + 1) * 2) {
+        MemoEntry **old_table = memo->table;
+        Py_ssize_t old_size = memo->mask + 1;
+
+        memo->table = PyMem_Calloc(old_size * 2, sizeof(MemoEntry *));
+        if (memo->table == NULL) {
+            memo->table = old_table;
+            PyErr_NoMemory();
+            return -1;
+        }
+        memo->mask = old_size * 2 - 1;
+
+        for (i = 0; i < old_size; i++) {
+            if (old_table[i] != NULL) {
+                memo->table[_memo_slot(memo, old_table[i]->key)] = old_table[i];
+            }
+        }
+        PyMem_Free(old_table);
+    }
+
+    memo->table[_memo_slot(memo, entry->key)] = entry;
+    memo->used++;
+
+    return 0;
+}
+
+/* Free `entry`, shifting back any that probed past its slot */
+static void
+_memo_remove(Memo *memo, MemoEntry *entry)
+{
+    Py_ssize_t i = _memo_slot(memo, entry->key);
+    Py_ssize_t j = i;
+
+    memo->table[i] = NULL;
+
+    for (;;) {
+        j = (j + 1) & memo->mask;
+        if (memo->table[j] == NULL) {
+            break;
+        }
+
+        size_t h = (size_t)memo->table[j]->key >> 4;
+        Py_ssize_t home = (Py_ssize_t)((h ^ (h >> 16)) & memo->mask);
+
+        /* Move back unless its home lies cyclically in (i, j] */
+        if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j)) {
+            continue;
+        }
+
+        memo->table[i] = memo->table[j];
+        memo->table[j] = NULL;
+        i = j;
+    }
+
+    memo->used--;
+
+    if (entry->data != NULL) {
+        _lru_unlink(entry);
+        memo->bytes -= entry->length;
+        PyMem_Free(entry->data);
+    }
+
+    Py_DECREF(entry->ref);
+    Py_XDECREF(entry->token);
+    PyMem_Free(entry);
+}
+
+static void
+_memo_sweep(Memo *memo)
+{
+    Py_ssize_t i = 0;
+
+    while (i <= memo->mask) {
+        MemoEntry *entry = memo->table[i];
+
+        if (entry != NULL && !entry->encoding && _memo_referent(entry) != entry->key) {
+            _memo_remove(memo, entry);
+            continue;
+        }
+        i++;
+    }
+}
+
+/* Keep a copy of `entry`'s output, evicting others to stay within budget */
+static int
+_memo_store(Memo *memo, MemoEntry *entry, const char *data, Py_ssize_t length)
+{
+    if (length > memo->budget || length > INT_MAX) {
+        /* Never fits: encode each time */
+        return 0;
+    }
+
+    while (memo->bytes + length > memo->budget) {
+        MemoEntry *victim = memo->lru.prev;
+
+        _lru_unlink(victim);
+        memo->bytes -= victim->length;
+        PyMem_Free(victim->data);
+        victim->data = NULL;
+        victim->length = 0;
+    }
+
+    entry->data = PyMem_Malloc(length ? length : 1);
+    if (entry->data == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    memcpy(entry->data, data, length);
+    entry->length = length;
+    memo->bytes += length;
+
+    _lru_push(memo, entry);
+
+    return 0;
+}
+
+/* The memoized object, or something else (None) if it has died */
+static PyObject *
+_memo_referent(MemoEntry *entry)
+{
+    if (entry->weak) {
+        return PyWeakref_GET_OBJECT(entry->ref);
+    }
+    return entry->ref;
+}
+
+Py_LOCAL_INLINE(void)
+_lru_unlink(MemoEntry *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+Py_LOCAL_INLINE(void)
+_lru_push(Memo *memo, MemoEntry *entry)
+{
+    entry->next = memo->lru.next;
+    entry->prev = &memo->lru;
+    memo->lru.next->prev = entry;
+    memo->lru.next = entry;
+}
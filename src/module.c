@@ -1,34 +1,201 @@
 #include <Python.h>
 
-extern PyTypeObject Encoder_Type;
-extern PyTypeObject Tag_Type;
+#include "module.h"
+
+extern PyObject *Encoder_CAPI_New(void);
 
 PyDoc_STRVAR(__doc__,
 "TODO module __doc__");
 
-static struct PyModuleDef Module = {
+PyDoc_STRVAR(EncodeLimitError__doc__,
+"An encode() passed its max_bytes, max_depth or max_items.");
+
+/* Types from spec, in the module's state and its namespace (unless `name` is NULL) */
+static PyTypeObject *
+_add_type(PyObject *module, PyType_Spec *spec, PyTypeObject *base, const char *name)
+{
+    PyTypeObject *type = (PyTypeObject *)PyType_FromModuleAndSpec(module, spec, (PyObject *)base);
+    if (type == NULL) {
+        return NULL;
+    }
+
+    if (name != NULL && PyModule_AddObjectRef(module, name, (PyObject *)type) == -1) {
+        Py_DECREF(type);
+        return NULL;
+    }
+
+    return type;
+}
+
+static int
+_exec(PyObject *module)
+{
+    ModuleState *state = PyModule_GetState(module);
+
+    state->items_name = PyUnicode_InternFromString("items");
+    if (state->items_name == NULL) {
+        return -1;
+    }
+
+    state->Encoder_Type = _add_type(module, &Encoder_spec, NULL, "Encoder");
+    if (state->Encoder_Type == NULL)
+        return -1;
+
+    state->MsgpackEncoder_Type = _add_type(module, &MsgpackEncoder_spec, state->Encoder_Type, "MsgpackEncoder");
+    if (state->MsgpackEncoder_Type == NULL)
+        return -1;
+
+    state->CborEncoder_Type = _add_type(module, &CborEncoder_spec, state->Encoder_Type, "CborEncoder");
+    if (state->CborEncoder_Type == NULL)
+        return -1;
+
+    state->CsvEncoder_Type = _add_type(module, &CsvEncoder_spec, state->Encoder_Type, "CsvEncoder");
+    if (state->CsvEncoder_Type == NULL)
+        return -1;
+
+    state->Raw_Type = _add_type(module, &Raw_spec, NULL, "Raw");
+    if (state->Raw_Type == NULL)
+        return -1;
+
+    state->Tag_Type = _add_type(module, &Tag_spec, NULL, "Tag");
+    if (state->Tag_Type == NULL)
+        return -1;
+
+    state->Element_Type = _add_type(module, &Element_spec, NULL, NULL);
+    if (state->Element_Type == NULL)
+        return -1;
+
+    state->XmlWriter_Type = _add_type(module, &XmlWriter_spec, NULL, "XmlWriter");
+    if (state->XmlWriter_Type == NULL)
+        return -1;
+
+    state->Template_Type = _add_type(module, &Template_spec, NULL, "Template");
+    if (state->Template_Type == NULL)
+        return -1;
+
+    state->Segment_Type = _add_type(module, &Segment_spec, NULL, NULL);
+    if (state->Segment_Type == NULL)
+        return -1;
+
+    state->EncodeLimitError = PyErr_NewExceptionWithDoc("_encoder.EncodeLimitError", EncodeLimitError__doc__,
+                                                        PyExc_ValueError, NULL);
+    if (state->EncodeLimitError == NULL ||
+        PyModule_AddObjectRef(module, "EncodeLimitError", state->EncodeLimitError) == -1)
+        return -1;
+
+    PyObject *capi = Encoder_CAPI_New();
+    if (capi == NULL || PyModule_AddObject(module, "_C_API", capi) == -1) {
+        Py_XDECREF(capi);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+_traverse(PyObject *module, visitproc visit, void *arg)
+{
+    ModuleState *state = PyModule_GetState(module);
+    int i;
+
+    Py_VISIT(state->Encoder_Type);
+    Py_VISIT(state->MsgpackEncoder_Type);
+    Py_VISIT(state->CborEncoder_Type);
+    Py_VISIT(state->CsvEncoder_Type);
+    Py_VISIT(state->Raw_Type);
+    Py_VISIT(state->Tag_Type);
+    Py_VISIT(state->Element_Type);
+    Py_VISIT(state->XmlWriter_Type);
+    Py_VISIT(state->Template_Type);
+    Py_VISIT(state->Segment_Type);
+    Py_VISIT(state->EncodeLimitError);
+
+    for (i = 0; i < state->registry_length; i++) {
+        Py_VISIT(state->registry[i].type);
+    }
+
+    Py_VISIT(state->datetime_type);
+    Py_VISIT(state->date_type);
+    Py_VISIT(state->time_type);
+    Py_VISIT(state->timedelta_type);
+    Py_VISIT(state->uuid_type);
+    Py_VISIT(state->decimal_type);
+    Py_VISIT(state->enum_type);
+
+    return 0;
+}
+
+static int
+_clear(PyObject *module)
+{
+    ModuleState *state = PyModule_GetState(module);
+
+    Py_CLEAR(state->Encoder_Type);
+    Py_CLEAR(state->MsgpackEncoder_Type);
+    Py_CLEAR(state->CborEncoder_Type);
+    Py_CLEAR(state->CsvEncoder_Type);
+    Py_CLEAR(state->Raw_Type);
+    Py_CLEAR(state->Tag_Type);
+    Py_CLEAR(state->Element_Type);
+    Py_CLEAR(state->XmlWriter_Type);
+    Py_CLEAR(state->Template_Type);
+    Py_CLEAR(state->Segment_Type);
+    Py_CLEAR(state->EncodeLimitError);
+
+    while (state->registry_length > 0) {
+        Py_CLEAR(state->registry[--state->registry_length].type);
+    }
+
+    Py_CLEAR(state->datetime_type);
+    Py_CLEAR(state->date_type);
+    Py_CLEAR(state->time_type);
+    Py_CLEAR(state->timedelta_type);
+    Py_CLEAR(state->uuid_type);
+    Py_CLEAR(state->decimal_type);
+    Py_CLEAR(state->enum_type);
+
+    Py_CLEAR(state->items_name);
+
+    return 0;
+}
+
+static void
+_free(void *module)
+{
+    ModuleState *state = PyModule_GetState((PyObject *)module);
+
+    _clear((PyObject *)module);
+
+    /* Dead already, so just memory */
+    while (state->element_free_list_length > 0) {
+        PyObject_Free(state->element_free_list[--state->element_free_list_length]);
+    }
+
+    SegmentPool_clear(&state->segment_pool);
+}
+
+static PyModuleDef_Slot slots[] = {
+    {Py_mod_exec, _exec},
+#ifdef Py_mod_multiple_interpreters
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+    {0, NULL},
+};
+
+PyModuleDef EncoderModuleDef = {
     PyModuleDef_HEAD_INIT,
     "_encoder",
     __doc__,
-    -1,
+    sizeof(ModuleState),
+    NULL,       /* m_methods */
+    slots,
+    _traverse,
+    _clear,
+    _free,
 };
 
 PyMODINIT_FUNC
 PyInit__encoder(void)
 {
-    PyObject *module = PyModule_Create(&Module);
-    if (module != NULL) {
-        if (PyType_Ready(&Encoder_Type) < 0)
-            return NULL;
-
-        if (PyType_Ready(&Tag_Type) < 0)
-            return NULL;
-
-        Py_INCREF(&Encoder_Type);
-        Py_INCREF(&Tag_Type);
-
-        PyModule_AddObject(module, "Encoder", (PyObject *)&Encoder_Type);
-        PyModule_AddObject(module, "Tag",     (PyObject *)&Tag_Type);
-    }
-    return module;
-};
+    return PyModuleDef_Init(&EncoderModuleDef);
+}
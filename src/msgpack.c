@@ -0,0 +1,478 @@
+#include <Python.h>
+#include <float.h>
+
+#include "buffer.h"
+#include "encoder.h"
+#include "module.h"
+
+/*
+ * MessagePack output on the same Buffer, dispatch order and
+ * make_iterencode protocol as encoder.c. Each item a make_iterencode
+ * iterable yields becomes one MessagePack object, so such hooks will
+ * usually yield exactly one (e.g. a str, or a list).
+ */
+
+/* Forward declarations */
+static PyObject* msgpack_encode_bytes       (Encoder *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames);
+static PyObject* msgpack_encode_segments    (Encoder *self, PyObject *o);
+static PyObject* msgpack_encode_writev      (Encoder *self, PyObject *args);
+static PyObject* msgpack_encode_compressed  (Encoder *self, PyObject *args, PyObject *kwargs);
+
+static int           _msgpack_append        (Encoder *self, PyObject *o);
+Py_LOCAL_INLINE(int) _msgpack_append_int    (Encoder *self, PyObject *py_int);
+Py_LOCAL_INLINE(int) _msgpack_append_float  (Encoder *self, PyObject *py_float);
+Py_LOCAL_INLINE(int) _msgpack_append_str    (Encoder *self, PyObject *str);
+Py_LOCAL_INLINE(int) _msgpack_append_bin    (Encoder *self, const char *data, Py_ssize_t length);
+Py_LOCAL_INLINE(int) _msgpack_append_array  (Encoder *self, PyObject *list_or_tuple);
+Py_LOCAL_INLINE(int) _msgpack_append_dict   (Encoder *self, PyObject *dict);
+Py_LOCAL_INLINE(int) _msgpack_append_header (Encoder *self, Py_ssize_t length,
+                                             unsigned char fix, int fix_max,
+                                             unsigned char code8, unsigned char code16, unsigned char code32);
+
+PyDoc_STRVAR(MsgpackEncoder__doc__,
+"Encoder producing MessagePack rather than text.");
+
+PyDoc_STRVAR(msgpack_encode_bytes__doc__,
+"encode_bytes(o, max_bytes=None, max_depth=None, max_items=None) -> bytes\n"
+"\n"
+"`o` as MessagePack, within the limits given as for Encoder.encode_bytes().\n"
+"encode() is the same, as there is no text form.");
+
+PyDoc_STRVAR(msgpack_encode_compressed__doc__,
+"encode_compressed(o, level=-1, wbits=31, sink=None) -> bytes\n"
+"\n"
+"As encode_bytes(), deflated as it is encoded. `level` and `wbits` as for\n"
+"zlib.compressobj(); the default wbits gives gzip. With a `sink`, the\n"
+"compressed output is passed to sink.write() in chunks and None returned.");
+
+/*
+ * Big-endian fixed width writes. Callers ensure_room first.
+ */
+
+Py_LOCAL_INLINE(void)
+_append_be16_unsafe(Buffer *b, unsigned int v)
+{
+    append_char_unsafe(b, (char)(v >> 8));
+    append_char_unsafe(b, (char)v);
+}
+
+Py_LOCAL_INLINE(void)
+_append_be32_unsafe(Buffer *b, unsigned long v)
+{
+    append_char_unsafe(b, (char)(v >> 24));
+    append_char_unsafe(b, (char)(v >> 16));
+    append_char_unsafe(b, (char)(v >> 8));
+    append_char_unsafe(b, (char)v);
+}
+
+Py_LOCAL_INLINE(void)
+_append_be64_unsafe(Buffer *b, unsigned long long v)
+{
+    _append_be32_unsafe(b, (unsigned long)(v >> 32));
+    _append_be32_unsafe(b, (unsigned long)(v & 0xffffffffUL));
+}
+
+static PyObject*
+msgpack_encode_bytes(Encoder *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return Encoder_encode_bytes(self, args, nargs, kwnames, _msgpack_append);
+}
+
+static PyObject*
+msgpack_encode_segments(Encoder *self, PyObject *o)
+{
+    return Encoder_encode_segments(self, o, _msgpack_append);
+}
+
+static PyObject*
+msgpack_encode_writev(Encoder *self, PyObject *args)
+{
+    return Encoder_encode_writev(self, args, _msgpack_append);
+}
+
+static PyObject*
+msgpack_encode_compressed(Encoder *self, PyObject *args, PyObject *kwargs)
+{
+    return Encoder_encode_compressed(self, args, kwargs, _msgpack_append);
+}
+
+static int
+_msgpack_append(Encoder *self, PyObject *o)
+{
+    if (o == Py_None) {
+        STATS_INC(self, none);
+        return append_char(self->buffer, (char)0xc0);
+    }
+    if (o == Py_True) {
+        STATS_INC(self, bool_true);
+        return append_char(self->buffer, (char)0xc3);
+    }
+    if (o == Py_False) {
+        STATS_INC(self, bool_false);
+        return append_char(self->buffer, (char)0xc2);
+    }
+    if (PyLong_Check(o)) {
+        STATS_INC(self, int_);
+        return _msgpack_append_int(self, o);
+    }
+    if (PyFloat_Check(o)) {
+        STATS_INC(self, float_);
+        return _msgpack_append_float(self, o);
+    }
+    if (PyUnicode_Check(o)) {
+        STATS_INC(self, str);
+        return _msgpack_append_str(self, o);
+    }
+    if (PyBytes_Check(o)) {
+        STATS_INC(self, bytes);
+        return _msgpack_append_bin(self, PyBytes_AS_STRING(o), PyBytes_GET_SIZE(o));
+    }
+    if (PyByteArray_Check(o)) {
+        STATS_INC(self, bytes);
+        return _msgpack_append_bin(self, PyByteArray_AS_STRING(o), PyByteArray_GET_SIZE(o));
+    }
+    if (Raw_CheckExact(self->state, o)) {
+        return Encoder_append_raw(self, o);
+    }
+    if (self->memo != NULL) {
+        int memoized = Encoder_append_memo(self, o, _msgpack_append);
+        if (memoized != 0) {
+            return memoized == -1 ? -1 : 0;
+        }
+    }
+    if (PyList_Check(o) || PyTuple_Check(o)) {
+        STATS_INC(self, sequence);
+        return _msgpack_append_array(self, o);
+    }
+    if (PyDict_Check(o)) {
+        if (Encoder_enter(self, PyDict_GET_SIZE(o)) == -1) {
+            return -1;
+        }
+        int retval = _msgpack_append_dict(self, o);
+        Encoder_leave(self);
+        return retval;
+    }
+    if (PySequence_Check(o)) {
+        PyObject *checked = PySequence_Fast(o, "Expected list/tuple");
+        if (checked == NULL) {
+            return -1;
+        }
+        STATS_INC(self, sequence);
+        int retval = _msgpack_append_array(self, checked);
+        Py_DECREF(checked);
+        return retval;
+    }
+
+    return Encoder_append_iterencode(self, o, _msgpack_append);
+}
+
+Py_LOCAL_INLINE(int)
+_msgpack_append_int(Encoder *self, PyObject *integer)
+{
+    Buffer *b = self->buffer;
+    int overflow;
+    long long l = PyLong_AsLongLongAndOverflow(integer, &overflow);
+
+    if (overflow == 1) {
+        unsigned long long u = PyLong_AsUnsignedLongLong(integer);
+        if (u == (unsigned long long)-1 && PyErr_Occurred()) {
+            return -1;
+        }
+        if (ensure_room(b, 9) == -1) {
+            return -1;
+        }
+        append_char_unsafe(b, (char)0xcf);
+        _append_be64_unsafe(b, u);
+        return 0;
+    }
+    if (overflow == -1) {
+        PyErr_SetString(PyExc_OverflowError, "int too small for MessagePack");
+        return -1;
+    }
+    if (l == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+
+    if (ensure_room(b, 9) == -1) {
+        return -1;
+    }
+
+    if (l >= 0) {
+        if (l <= 0x7f) {
+            append_char_unsafe(b, (char)l);                 /* positive fixint */
+        }
+        else if (l <= 0xff) {
+            append_char_unsafe(b, (char)0xcc);
+            append_char_unsafe(b, (char)l);
+        }
+        else if (l <= 0xffff) {
+            append_char_unsafe(b, (char)0xcd);
+            _append_be16_unsafe(b, (unsigned int)l);
+        }
+        else if (l <= 0xffffffffLL) {
+            append_char_unsafe(b, (char)0xce);
+            _append_be32_unsafe(b, (unsigned long)l);
+        }
+        else {
+            append_char_unsafe(b, (char)0xcf);
+            _append_be64_unsafe(b, (unsigned long long)l);
+        }
+    }
+    else {
+        if (l >= -32) {
+            append_char_unsafe(b, (char)l);                 /* negative fixint */
+        }
+        else if (l >= -128) {
+            append_char_unsafe(b, (char)0xd0);
+            append_char_unsafe(b, (char)l);
+        }
+        else if (l >= -32768) {
+            append_char_unsafe(b, (char)0xd1);
+            _append_be16_unsafe(b, (unsigned int)l);
+        }
+        else if (l >= -2147483648LL) {
+            append_char_unsafe(b, (char)0xd2);
+            _append_be32_unsafe(b, (unsigned long)l);
+        }
+        else {
+            append_char_unsafe(b, (char)0xd3);
+            _append_be64_unsafe(b, (unsigned long long)l);
+        }
+    }
+
+    return 0;
+}
+
+Py_LOCAL_INLINE(int)
+_msgpack_append_float(Encoder *self, PyObject *f)
+{
+    Buffer *b = self->buffer;
+    double d = PyFloat_AS_DOUBLE(f);
+
+    if (ensure_room(b, 9) == -1) {
+        return -1;
+    }
+
+    /*
+     * float 32 when it round trips exactly (NaN never compares equal, but fits).
+     * Finite values past FLT_MAX can't be converted at all, so aren't tried.
+     */
+    if (!Py_IS_FINITE(d) || (fabs(d) <= FLT_MAX && (double)(float)d == d)) {
+        union { float f; uint32_t u; } as_single;
+        as_single.f = (float)d;
+
+        append_char_unsafe(b, (char)0xca);
+        _append_be32_unsafe(b, as_single.u);
+    }
+    else {
+        union { double d; uint64_t u; } as_double;
+        as_double.d = d;
+
+        append_char_unsafe(b, (char)0xcb);
+        _append_be64_unsafe(b, as_double.u);
+    }
+
+    return 0;
+}
+
+Py_LOCAL_INLINE(int)
+_msgpack_append_str(Encoder *self, PyObject *s)
+{
+    Py_ssize_t length;
+    const char *data = PyUnicode_AsUTF8AndSize(s, &length);
+    if (data == NULL) {
+        return -1;
+    }
+
+    if (_msgpack_append_header(self, length, 0xa0, 31, 0xd9, 0xda, 0xdb) == -1) {
+        return -1;
+    }
+
+    return append_string(self->buffer, (char *)data, length);
+}
+
+Py_LOCAL_INLINE(int)
+_msgpack_append_bin(Encoder *self, const char *data, Py_ssize_t length)
+{
+    /* No fix form for bin */
+    if (_msgpack_append_header(self, length, 0, -1, 0xc4, 0xc5, 0xc6) == -1) {
+        return -1;
+    }
+
+    return append_string(self->buffer, (char *)data, length);
+}
+
+Py_LOCAL_INLINE(int)
+_msgpack_append_array(Encoder *self, PyObject *sequence)
+{
+    Py_ssize_t length = PySequence_Fast_GET_SIZE(sequence);
+    PyObject **items = PySequence_Fast_ITEMS(sequence);
+    Py_ssize_t i;
+    int retval = -1;
+
+    if (Encoder_enter(self, length) == -1) {
+        return -1;
+    }
+
+    if (_msgpack_append_header(self, length, 0x90, 15, 0, 0xdc, 0xdd) == -1) {
+        goto bail;
+    }
+
+    for (i = 0; i < length; i++) {
+        if (_msgpack_append(self, items[i]) == -1) {
+            goto bail;
+        }
+    }
+
+    retval = 0;
+  bail:
+    Encoder_leave(self);
+    return retval;
+}
+
+Py_LOCAL_INLINE(int)
+_msgpack_append_dict(Encoder *self, PyObject *dict)
+{
+    if (!PyDict_CheckExact(dict)) {
+        int dict_preserve_order = Encoder_get_dict_preserve_order(self);
+        if (dict_preserve_order == -1) {
+            return -1;
+        }
+
+        if (dict_preserve_order == 1) {
+            STATS_INC(self, mapping);
+
+            Py_ssize_t length = PyObject_Length(dict);
+            if (length == -1) {
+                return -1;
+            }
+
+            /* Borrowed references */
+            PyObject *key;
+            PyObject *value;
+
+            MappingIter iter;
+            int retval = -1;
+            int status;
+            Py_ssize_t count = 0;
+
+            if (Encoder_mapping_begin(self, &iter, dict) == -1) {
+                goto bail;
+            }
+
+            if (_msgpack_append_header(self, length, 0x80, 15, 0, 0xde, 0xdf) == -1) {
+                goto bail;
+            }
+
+            while ((status = Encoder_mapping_next(&iter, &key, &value)) == 1) {
+                if (_msgpack_append(self, key) == -1) {
+                    goto bail;
+                }
+                if (_msgpack_append(self, value) == -1) {
+                    goto bail;
+                }
+                count++;
+            }
+
+            if (status == -1) {
+                goto bail;
+            }
+
+            if (count != length) {
+                /* The header is already out */
+                PyErr_SetString(PyExc_RuntimeError, "mapping changed size during iteration");
+                goto bail;
+            }
+
+            retval = 0;
+          bail:
+            Encoder_mapping_end(&iter);
+            return retval;
+        }
+    }
+
+    STATS_INC(self, dict);
+
+    /* Borrowed references */
+    PyObject *key;
+    PyObject *value;
+
+    Py_ssize_t pos = 0;
+
+    if (_msgpack_append_header(self, PyDict_GET_SIZE(dict), 0x80, 15, 0, 0xde, 0xdf) == -1) {
+        return -1;
+    }
+
+    while (PyDict_Next(dict, &pos, &key, &value)) {
+        if (_msgpack_append(self, key) == -1) {
+            return -1;
+        }
+        if (_msgpack_append(self, value) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Type byte plus length, in the smallest of the fix/8/16/32 forms allowed.
+ * fix_max -1 means no fix form, code8 0 means no 8 bit form.
+ */
+Py_LOCAL_INLINE(int)
+_msgpack_append_header(Encoder *self, Py_ssize_t length,
+                       unsigned char fix, int fix_max,
+                       unsigned char code8, unsigned char code16, unsigned char code32)
+{
+    Buffer *b = self->buffer;
+
+    if (ensure_room(b, 5) == -1) {
+        return -1;
+    }
+
+    if (length <= fix_max) {
+        append_char_unsafe(b, (char)(fix | length));
+    }
+    else if (code8 != 0 && length <= 0xff) {
+        append_char_unsafe(b, (char)code8);
+        append_char_unsafe(b, (char)length);
+    }
+    else if (length <= 0xffff) {
+        append_char_unsafe(b, (char)code16);
+        _append_be16_unsafe(b, (unsigned int)length);
+    }
+    else if ((unsigned long long)length <= 0xffffffffULL) {
+        append_char_unsafe(b, (char)code32);
+        _append_be32_unsafe(b, (unsigned long)length);
+    }
+    else {
+        PyErr_SetString(PyExc_OverflowError, "too long for MessagePack");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyMethodDef methods[] = {
+    {"encode",       (PyCFunction)msgpack_encode_bytes, METH_FASTCALL | METH_KEYWORDS, msgpack_encode_bytes__doc__},
+    {"encode_bytes", (PyCFunction)msgpack_encode_bytes, METH_FASTCALL | METH_KEYWORDS, msgpack_encode_bytes__doc__},
+    {"encode_segments", (PyCFunction)msgpack_encode_segments, METH_O, Encoder_encode_segments__doc__},
+    {"encode_writev", (PyCFunction)msgpack_encode_writev, METH_VARARGS, Encoder_encode_writev__doc__},
+    {"encode_compressed", (PyCFunction)msgpack_encode_compressed, METH_VARARGS | METH_KEYWORDS, msgpack_encode_compressed__doc__},
+    {NULL} /* Sentinel */
+};
+
+static PyType_Slot slots[] = {
+    {Py_tp_doc,     (void *)MsgpackEncoder__doc__},
+    {Py_tp_methods, methods},
+    {0, NULL},
+};
+
+/* Based on Encoder, by module.c */
+PyType_Spec MsgpackEncoder_spec = {
+    "_encoder.MsgpackEncoder",
+    sizeof(Encoder),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_IMMUTABLETYPE,
+    slots,
+};
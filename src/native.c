@@ -0,0 +1,572 @@
+#include <Python.h>
+/* Only the structs and field macros, not the process-wide C API; see below */
+#define _PY_DATETIME_IMPL
+#include <datetime.h>
+
+#include "buffer.h"
+#include "encoder.h"
+#include "module.h"
+
+/*
+ * Opt-in native encoding of common value types, instead of a round trip
+ * through make_iterencode and Python (isoformat(), str(), ...).
+ *
+ * Enabled per class with NATIVE_TYPES, e.g.
+ *
+ *   NATIVE_TYPES = (datetime.datetime, datetime.date, uuid.UUID)
+ *
+ * datetime/date/time and UUID are written as strings (with STRING_QUOTE),
+ * Decimal as a number literal, and Enum members as their value.
+ *
+ * The types are imported into the module state, not through the datetime
+ * C API: its PyDateTimeAPI is one per process, and this module loads in
+ * interpreters with their own GIL.
+ */
+
+#define NATIVE_DATETIME (1 << 0)
+#define NATIVE_DATE     (1 << 1)
+#define NATIVE_TIME     (1 << 2)
+#define NATIVE_UUID     (1 << 3)
+#define NATIVE_DECIMAL  (1 << 4)
+#define NATIVE_ENUM     (1 << 5)
+
+/* Longest of the above as text: datetime with microseconds and offset */
+#define NATIVE_MAX_LENGTH 48
+
+/* Beyond this many, "0.000...1" becomes "1E-..." (as str(Decimal) does past 6) */
+#define DECIMAL_MAX_LEADING_ZEROS 5
+
+/* Forward declarations */
+static int _get_native_types       (Encoder *self);
+static int _import_type            (PyTypeObject **type, const char *module, const char *name);
+static int _import_datetime        (ModuleState *state);
+
+static int _append_datetime        (Encoder *self, PyObject *o);
+static int _append_date            (Encoder *self, PyObject *o);
+static int _append_time            (Encoder *self, PyObject *o);
+static int _append_uuid            (Encoder *self, PyObject *o);
+static int _append_decimal         (Encoder *self, PyObject *o);
+static int _append_isoformat       (Encoder *self, PyObject *o);
+
+Py_LOCAL_INLINE(char *) _format_digits (char *p, int value, int width);
+static char *           _format_offset (ModuleState *state, char *p, PyObject *offset);
+static int              _append_quoted (Encoder *self, char *data, int length);
+
+/*
+ * 1 if `o` was appended, 0 if it isn't a native type for this encoder,
+ * -1 on error.
+ */
+int
+Encoder_append_native(Encoder *self, PyObject *o)
+{
+    int native_types = self->native_types;
+
+    if (native_types == -1) {
+        native_types = _get_native_types(self);
+        if (native_types == -1) {
+            return -1;
+        }
+    }
+
+    if (native_types == 0) {
+        return 0;
+    }
+
+    ModuleState *state = self->state;
+
+    /* datetime before date, being a subclass */
+    if ((native_types & NATIVE_DATETIME) && PyObject_TypeCheck(o, state->datetime_type)) {
+        return _append_datetime(self, o) == -1 ? -1 : 1;
+    }
+    if ((native_types & NATIVE_DATE) && PyObject_TypeCheck(o, state->date_type) &&
+        !PyObject_TypeCheck(o, state->datetime_type)) {
+        return _append_date(self, o) == -1 ? -1 : 1;
+    }
+    if ((native_types & NATIVE_TIME) && PyObject_TypeCheck(o, state->time_type)) {
+        return _append_time(self, o) == -1 ? -1 : 1;
+    }
+    if ((native_types & NATIVE_UUID) && PyObject_TypeCheck(o, state->uuid_type)) {
+        return _append_uuid(self, o) == -1 ? -1 : 1;
+    }
+    if ((native_types & NATIVE_DECIMAL) && PyObject_TypeCheck(o, state->decimal_type)) {
+        return _append_decimal(self, o);
+    }
+    if ((native_types & NATIVE_ENUM) && PyObject_TypeCheck(o, state->enum_type)) {
+        PyObject *value = PyObject_GetAttrString(o, "value");
+        if (value == NULL) {
+            return -1;
+        }
+
+        int retval = Encoder_append(self, value);
+        Py_DECREF(value);
+
+        return retval == -1 ? -1 : 1;
+    }
+
+    return 0;
+}
+
+static int
+_append_datetime(Encoder *self, PyObject *o)
+{
+    char text[NATIVE_MAX_LENGTH];
+    char *p = text;
+
+    if (!self->state->datetime_c) {
+        return _append_isoformat(self, o);
+    }
+
+    p = _format_digits(p, PyDateTime_GET_YEAR(o), 4);
+    *p++ = '-';
+    p = _format_digits(p, PyDateTime_GET_MONTH(o), 2);
+    *p++ = '-';
+    p = _format_digits(p, PyDateTime_GET_DAY(o), 2);
+    *p++ = 'T';
+    p = _format_digits(p, PyDateTime_DATE_GET_HOUR(o), 2);
+    *p++ = ':';
+    p = _format_digits(p, PyDateTime_DATE_GET_MINUTE(o), 2);
+    *p++ = ':';
+    p = _format_digits(p, PyDateTime_DATE_GET_SECOND(o), 2);
+
+    if (PyDateTime_DATE_GET_MICROSECOND(o) != 0) {
+        *p++ = '.';
+        p = _format_digits(p, PyDateTime_DATE_GET_MICROSECOND(o), 6);
+    }
+
+    if (PyDateTime_DATE_GET_TZINFO(o) != Py_None) {
+        PyObject *offset = PyObject_CallMethod(o, "utcoffset", NULL);
+        if (offset == NULL) {
+            return -1;
+        }
+        p = _format_offset(self->state, p, offset);
+        Py_DECREF(offset);
+        if (p == NULL) {
+            return -1;
+        }
+    }
+
+    return _append_quoted(self, text, p - text);
+}
+
+static int
+_append_date(Encoder *self, PyObject *o)
+{
+    char text[NATIVE_MAX_LENGTH];
+    char *p = text;
+
+    if (!self->state->datetime_c) {
+        return _append_isoformat(self, o);
+    }
+
+    p = _format_digits(p, PyDateTime_GET_YEAR(o), 4);
+    *p++ = '-';
+    p = _format_digits(p, PyDateTime_GET_MONTH(o), 2);
+    *p++ = '-';
+    p = _format_digits(p, PyDateTime_GET_DAY(o), 2);
+
+    return _append_quoted(self, text, p - text);
+}
+
+static int
+_append_time(Encoder *self, PyObject *o)
+{
+    char text[NATIVE_MAX_LENGTH];
+    char *p = text;
+
+    if (!self->state->datetime_c) {
+        return _append_isoformat(self, o);
+    }
+
+    p = _format_digits(p, PyDateTime_TIME_GET_HOUR(o), 2);
+    *p++ = ':';
+    p = _format_digits(p, PyDateTime_TIME_GET_MINUTE(o), 2);
+    *p++ = ':';
+    p = _format_digits(p, PyDateTime_TIME_GET_SECOND(o), 2);
+
+    if (PyDateTime_TIME_GET_MICROSECOND(o) != 0) {
+        *p++ = '.';
+        p = _format_digits(p, PyDateTime_TIME_GET_MICROSECOND(o), 6);
+    }
+
+    if (PyDateTime_TIME_GET_TZINFO(o) != Py_None) {
+        PyObject *offset = PyObject_CallMethod(o, "utcoffset", NULL);
+        if (offset == NULL) {
+            return -1;
+        }
+        p = _format_offset(self->state, p, offset);
+        Py_DECREF(offset);
+        if (p == NULL) {
+            return -1;
+        }
+    }
+
+    return _append_quoted(self, text, p - text);
+}
+
+/* 8-4-4-4-12 lowercase hex, as str(uuid) */
+static int
+_append_uuid(Encoder *self, PyObject *o)
+{
+    static const char HEX[] = "0123456789abcdef";
+
+    unsigned char bytes[16];
+    char text[36];
+    char *p = text;
+    int i;
+
+    PyObject *integer = PyObject_GetAttrString(o, "int");
+    if (integer == NULL) {
+        return -1;
+    }
+
+    if (!PyLong_Check(integer)) {
+        PyErr_Format(PyExc_TypeError, "UUID.int: expected int, got: %R", integer);
+        Py_DECREF(integer);
+        return -1;
+    }
+
+    /* As two halves: int >> 64 (raising if past 128 bits or negative), and its low 64 bits */
+    unsigned long long low = PyLong_AsUnsignedLongLongMask(integer);
+    PyObject *shift = PyLong_FromLong(64);
+    PyObject *shifted = shift == NULL ? NULL : PyNumber_Rshift(integer, shift);
+    Py_XDECREF(shift);
+    Py_DECREF(integer);
+    if (shifted == NULL) {
+        return -1;
+    }
+
+    unsigned long long high = PyLong_AsUnsignedLongLong(shifted);
+    Py_DECREF(shifted);
+    if ((high == (unsigned long long)-1 || low == (unsigned long long)-1) && PyErr_Occurred()) {
+        return -1;
+    }
+
+    for (i = 0; i < 8; i++) {
+        bytes[i] = (unsigned char)(high >> (56 - 8 * i));
+        bytes[8 + i] = (unsigned char)(low >> (56 - 8 * i));
+    }
+
+    for (i = 0; i < 16; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) {
+            *p++ = '-';
+        }
+        *p++ = HEX[bytes[i] >> 4];
+        *p++ = HEX[bytes[i] & 0xf];
+    }
+
+    return _append_quoted(self, text, p - text);
+}
+
+/*
+ * From as_tuple(): sign, digits, exponent. A plain literal when the point
+ * falls within the digits, otherwise digits with an exponent.
+ * NaN/Infinity are left to make_iterencode (returns 0).
+ */
+static int
+_append_decimal(Encoder *self, PyObject *o)
+{
+    Buffer *b = self->buffer;
+    int retval = -1;
+
+    PyObject *as_tuple = PyObject_CallMethod(o, "as_tuple", NULL);
+    if (as_tuple == NULL) {
+        return -1;
+    }
+
+    if (!PyTuple_Check(as_tuple) || PyTuple_GET_SIZE(as_tuple) != 3) {
+        PyErr_Format(PyExc_TypeError, "Decimal.as_tuple(): unexpected %R", as_tuple);
+        goto bail;
+    }
+
+    PyObject *exponent_object = PyTuple_GET_ITEM(as_tuple, 2);
+    if (!PyLong_Check(exponent_object)) {
+        /* 'n', 'N', 'F': not a number we can write */
+        retval = 0;
+        goto bail;
+    }
+
+    long sign = PyLong_AsLong(PyTuple_GET_ITEM(as_tuple, 0));
+    long exponent = PyLong_AsLong(exponent_object);
+    if (PyErr_Occurred()) {
+        goto bail;
+    }
+
+    PyObject *digits = PyTuple_GET_ITEM(as_tuple, 1);
+    Py_ssize_t n = PyTuple_GET_SIZE(digits);
+    Py_ssize_t i;
+
+    /* Sign, "0.", leading zeros, digits, "E-" and up to 20 exponent digits */
+    if (ensure_room(b, n + DECIMAL_MAX_LEADING_ZEROS + 26) == -1) {
+        goto bail;
+    }
+
+    if (sign) {
+        append_char_unsafe(b, '-');
+    }
+
+    /* Digits before the point, if it falls among (or just before) them */
+    Py_ssize_t point = n;
+
+    if (exponent < 0 && -exponent < n) {
+        point = n + exponent;
+    }
+    else if (exponent < 0 && -exponent - n <= DECIMAL_MAX_LEADING_ZEROS) {
+        append_char_unsafe(b, '0');
+        append_char_unsafe(b, '.');
+        for (i = n; i < -exponent; i++) {
+            append_char_unsafe(b, '0');
+        }
+        point = -1;
+        exponent = 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (i == point) {
+            append_char_unsafe(b, '.');
+        }
+        append_char_unsafe(b, '0' + (char)PyLong_AsLong(PyTuple_GET_ITEM(digits, i)));
+    }
+
+    if (point == n && exponent != 0) {
+        int written = sprintf(&b->_data[b->_index], "E%ld", exponent);
+        b->_index += written;
+    }
+
+    retval = 1;
+  bail:
+    Py_DECREF(as_tuple);
+    return retval;
+}
+
+Py_LOCAL_INLINE(char *)
+_format_digits(char *p, int value, int width)
+{
+    int i;
+
+    for (i = width - 1; i >= 0; i--) {
+        p[i] = '0' + value % 10;
+        value /= 10;
+    }
+
+    return p + width;
+}
+
+/* "+HH:MM[:SS[.ffffff]]" from a timedelta, as isoformat() does */
+static char *
+_format_offset(ModuleState *state, char *p, PyObject *offset)
+{
+    if (offset == Py_None) {
+        return p;
+    }
+
+    if (!PyObject_TypeCheck(offset, state->timedelta_type)) {
+        PyErr_Format(PyExc_TypeError, "utcoffset(): expected timedelta, got: %R", offset);
+        return NULL;
+    }
+
+    long long total = (long long)PyDateTime_DELTA_GET_DAYS(offset) * 86400 + PyDateTime_DELTA_GET_SECONDS(offset);
+    int microseconds = PyDateTime_DELTA_GET_MICROSECONDS(offset);
+
+    if (total < 0) {
+        *p++ = '-';
+        /* Negate the whole (seconds, microseconds) value */
+        if (microseconds != 0) {
+            total += 1;
+            microseconds = 1000000 - microseconds;
+        }
+        total = -total;
+    }
+    else {
+        *p++ = '+';
+    }
+
+    p = _format_digits(p, (int)(total / 3600), 2);
+    *p++ = ':';
+    p = _format_digits(p, (int)(total / 60 % 60), 2);
+
+    if (total % 60 != 0 || microseconds != 0) {
+        *p++ = ':';
+        p = _format_digits(p, (int)(total % 60), 2);
+        if (microseconds != 0) {
+            *p++ = '.';
+            p = _format_digits(p, microseconds, 6);
+        }
+    }
+
+    return p;
+}
+
+static int
+_append_quoted(Encoder *self, char *data, int length)
+{
+    Buffer *b = self->buffer;
+
+    int quote = Encoder_get_str_quote(self);
+    if (quote == -1) {
+        return -1;
+    }
+
+    if (ensure_room(b, length + 2) == -1) {
+        return -1;
+    }
+
+    if (quote != 0) {
+        append_char_unsafe(b, quote);
+    }
+    append_string_unsafe(b, data, length);
+    if (quote != 0) {
+        append_char_unsafe(b, quote);
+    }
+
+    return 0;
+}
+
+/* isoformat(), for datetime's pure Python types; see _import_datetime */
+static int
+_append_isoformat(Encoder *self, PyObject *o)
+{
+    PyObject *text = PyObject_CallMethod(o, "isoformat", NULL);
+    if (text == NULL) {
+        return -1;
+    }
+
+    Py_ssize_t length;
+    const char *data = PyUnicode_Check(text) ? PyUnicode_AsUTF8AndSize(text, &length) : NULL;
+    int retval = -1;
+
+    if (data != NULL) {
+        retval = _append_quoted(self, (char *)data, length);
+    }
+    else if (!PyErr_Occurred()) {
+        PyErr_Format(PyExc_TypeError, "isoformat(): expected str, got: %R", text);
+    }
+
+    Py_DECREF(text);
+    return retval;
+}
+
+static int
+_import_type(PyTypeObject **type, const char *module_name, const char *name)
+{
+    if (*type != NULL) {
+        return 0;
+    }
+
+    PyObject *module = PyImport_ImportModule(module_name);
+    if (module == NULL) {
+        return -1;
+    }
+
+    PyObject *o = PyObject_GetAttrString(module, name);
+    Py_DECREF(module);
+    if (o == NULL) {
+        return -1;
+    }
+
+    if (!PyType_Check(o)) {
+        PyErr_Format(PyExc_TypeError, "%s.%s: expected a type", module_name, name);
+        Py_DECREF(o);
+        return -1;
+    }
+
+    *type = (PyTypeObject *)o;
+
+    return 0;
+}
+
+/*
+ * datetime's types, as _import_type. The PyDateTime_GET_* field macros
+ * read _datetime's objects only: where datetime falls back on its pure
+ * Python implementation (_datetime won't load in an interpreter with its
+ * own GIL before 3.13), datetime_c is 0 and they go through isoformat().
+ */
+static int
+_import_datetime(ModuleState *state)
+{
+    if (state->timedelta_type != NULL) {
+        return 0;
+    }
+
+    if (_import_type(&state->datetime_type, "datetime", "datetime") == -1 ||
+        _import_type(&state->date_type, "datetime", "date") == -1 ||
+        _import_type(&state->time_type, "datetime", "time") == -1) {
+        return -1;
+    }
+
+    PyObject *module = PyImport_ImportModule("datetime");
+    if (module == NULL) {
+        return -1;
+    }
+
+    /* Only _datetime has the capsule; not imported from it, just a tell */
+    state->datetime_c = PyObject_HasAttrString(module, "datetime_CAPI");
+    Py_DECREF(module);
+
+    return _import_type(&state->timedelta_type, "datetime", "timedelta");
+}
+
+static int
+_get_native_types(Encoder *self)
+{
+    ModuleState *state = self->state;
+    PyObject *user_native_types = PyObject_GetAttrString((PyObject *)self, "NATIVE_TYPES");
+    if (user_native_types == NULL) {
+        return -1;
+    }
+
+    PyObject *sequence = PySequence_Fast(user_native_types, "NATIVE_TYPES: expected a sequence of types");
+    Py_DECREF(user_native_types);
+    if (sequence == NULL) {
+        return -1;
+    }
+
+    int native_types = 0;
+    Py_ssize_t i;
+
+    if (PySequence_Fast_GET_SIZE(sequence) != 0) {
+        /* Imported on first use, into the module state (module.h) */
+        if (_import_datetime(state) == -1 ||
+            _import_type(&state->uuid_type, "uuid", "UUID") == -1 ||
+            _import_type(&state->decimal_type, "decimal", "Decimal") == -1 ||
+            _import_type(&state->enum_type, "enum", "Enum") == -1) {
+            goto error;
+        }
+    }
+
+    for (i = 0; i < PySequence_Fast_GET_SIZE(sequence); i++) {
+        PyObject *type = PySequence_Fast_GET_ITEM(sequence, i);
+
+        if (type == (PyObject *)state->datetime_type) {
+            native_types |= NATIVE_DATETIME;
+        }
+        else if (type == (PyObject *)state->date_type) {
+            native_types |= NATIVE_DATE;
+        }
+        else if (type == (PyObject *)state->time_type) {
+            native_types |= NATIVE_TIME;
+        }
+        else if (type == (PyObject *)state->uuid_type) {
+            native_types |= NATIVE_UUID;
+        }
+        else if (type == (PyObject *)state->decimal_type) {
+            native_types |= NATIVE_DECIMAL;
+        }
+        else if (type == (PyObject *)state->enum_type) {
+            native_types |= NATIVE_ENUM;
+        }
+        else {
+            PyErr_Format(PyExc_TypeError,
+                         "NATIVE_TYPES: expected datetime, date, time, UUID, Decimal or Enum, got: %R", type);
+            goto error;
+        }
+    }
+
+    Py_DECREF(sequence);
+
+    self->native_types = native_types;
+    return native_types;
+
+  error:
+    Py_DECREF(sequence);
+    return -1;
+}
@@ -0,0 +1,127 @@
+#include <Python.h>
+#include <structmember.h>
+
+#include "buffer.h"
+#include "encoder.h"
+#include "module.h"
+
+/*
+ * Already-encoded output, to be copied into the Buffer as is.
+ */
+typedef struct {
+    PyObject_HEAD
+    PyObject *data; /* bytes */
+} Raw;
+
+PyDoc_STRVAR(Raw__doc__,
+"Raw(data)\n"
+"\n"
+"Output already in the encoder's format (e.g. a cached JSON fragment),\n"
+"written as is wherever encoded. `data` is bytes-like, or str (as UTF-8).\n"
+"If the encoder defines validate_raw(data), it is called first.");
+
+static PyObject *
+Raw__new__(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    PyObject *o;
+    PyObject *data;
+
+    if (!_PyArg_NoKeywords("Raw", kwargs) || !PyArg_ParseTuple(args, "O:Raw", &o)) {
+        return NULL;
+    }
+
+    if (PyBytes_CheckExact(o)) {
+        data = o;
+        Py_INCREF(data);
+    }
+    else if (PyUnicode_Check(o)) {
+        data = PyUnicode_AsUTF8String(o);
+    }
+    else {
+        data = PyBytes_FromObject(o);
+    }
+
+    if (data == NULL) {
+        return NULL;
+    }
+
+    if (PyBytes_GET_SIZE(data) > INT_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "Raw: data too long");
+        Py_DECREF(data);
+        return NULL;
+    }
+
+    Raw *self = (Raw *)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        Py_DECREF(data);
+        return NULL;
+    }
+
+    self->data = data;
+
+    return (PyObject *)self;
+}
+
+static void
+Raw__del__(Raw *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    Py_XDECREF(self->data);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+}
+
+static PyObject *
+Raw__repr__(Raw *self)
+{
+    return PyUnicode_FromFormat("Raw(%R)", self->data);
+}
+
+/* Raw instances only; see Raw_CheckExact in _append */
+int
+Encoder_append_raw(Encoder *self, PyObject *o)
+{
+    PyObject *data = ((Raw *)o)->data;
+
+    if (self->validate_raw == -1) {
+        PyObject *validate = PyObject_GetAttrString((PyObject *)self, "validate_raw");
+        if (validate == NULL) {
+            return -1;
+        }
+        self->validate_raw = validate != Py_None;
+        Py_DECREF(validate);
+    }
+
+    if (self->validate_raw) {
+        PyObject *result = PyObject_CallMethod((PyObject *)self, "validate_raw", "O", data);
+        if (result == NULL) {
+            return -1;
+        }
+        Py_DECREF(result);
+    }
+
+    return append_bytes(self->buffer, data);
+}
+
+static PyMemberDef Raw_members[] = {
+    {"data", T_OBJECT, offsetof(Raw, data), READONLY, NULL},
+    {NULL} /* Sentinel */
+};
+
+static PyType_Slot Raw_slots[] = {
+    {Py_tp_dealloc, Raw__del__},
+    {Py_tp_repr,    Raw__repr__},
+    {Py_tp_doc,     (void *)Raw__doc__},
+    {Py_tp_members, Raw_members},
+    {Py_tp_new,     Raw__new__},
+    {0, NULL},
+};
+
+PyType_Spec Raw_spec = {
+    "_encoder.Raw",
+    sizeof(Raw),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    Raw_slots,
+};
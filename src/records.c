@@ -0,0 +1,288 @@
+#include <Python.h>
+
+#include "buffer.h"
+#include "encoder.h"
+
+/*
+ * encode_records(columns): {"a": [1, 2], "b": [3, 4]} as
+ * [{"a":1,"b":3},{"a":2,"b":4}], without a dict per row. Each key is
+ * encoded once, with its delimiters, and values interleaved row by row.
+ * Columns exporting a 1-d buffer of ints, floats or bools (array.array,
+ * numpy, ...) are read directly, rather than as objects.
+ */
+
+#define COLUMN_OBJECTS  0
+#define COLUMN_SIGNED   1
+#define COLUMN_UNSIGNED 2
+#define COLUMN_FLOAT    3
+#define COLUMN_DOUBLE   4
+#define COLUMN_BOOL     5
+
+typedef struct {
+    char *prefix;       /* '{' or ',', the key, ':' */
+    int prefix_length;
+    int kind;
+    PyObject *fast;     /* COLUMN_OBJECTS: a tuple */
+    Py_buffer view;     /* Otherwise */
+} Column;
+
+/* Forward declarations */
+static int _column_init   (Encoder *self, Column *column, PyObject *key, PyObject *values, int first);
+static int _column_append (Encoder *self, Column *column, Py_ssize_t row);
+static int _buffer_kind   (Py_buffer *view);
+
+PyObject *
+Encoder_encode_records(Encoder *self, PyObject *columns)
+{
+    Buffer *b = self->buffer;
+    BufferFrame frame;
+    MappingIter iter;
+    PyObject *retval = NULL;
+
+    /* Borrowed references */
+    PyObject *key;
+    PyObject *values;
+
+    Py_ssize_t n = PyObject_Length(columns);
+    if (n == -1) {
+        return NULL;
+    }
+
+    Column *cols = PyMem_Calloc(n ? n : 1, sizeof(Column));
+    if (cols == NULL) {
+        return PyErr_NoMemory();
+    }
+
+    Py_ssize_t initialized = 0;
+    Py_ssize_t rows = 0;
+    Py_ssize_t row;
+    Py_ssize_t i;
+    int status;
+
+    if (Buffer_push_frame(b, &frame) == -1) {
+        PyMem_Free(cols);
+        return NULL;
+    }
+
+    if (Encoder_mapping_begin(self, &iter, columns) == -1) {
+        goto bail;
+    }
+
+    while ((status = Encoder_mapping_next(&iter, &key, &values)) == 1) {
+        if (initialized == n) {
+            PyErr_SetString(PyExc_RuntimeError, "encode_records: columns changed size during iteration");
+            goto bail;
+        }
+
+        if (_column_init(self, &cols[initialized], key, values, initialized == 0) == -1) {
+            goto bail;
+        }
+        initialized++;
+
+        Column *column = &cols[initialized - 1];
+        Py_ssize_t length = column->kind == COLUMN_OBJECTS
+            ? PySequence_Fast_GET_SIZE(column->fast)
+            : column->view.shape[0];
+
+        if (initialized == 1) {
+            rows = length;
+        }
+        else if (length != rows) {
+            PyErr_Format(PyExc_ValueError, "encode_records: column %R has %zd values, expected %zd",
+                         key, length, rows);
+            goto bail;
+        }
+    }
+
+    if (status == -1) {
+        goto bail;
+    }
+
+    if (initialized == 0) {
+        rows = 0;
+    }
+
+    if (append_char(b, '[') == -1) {
+        goto bail;
+    }
+
+    for (row = 0; row < rows; row++) {
+        if (row != 0 && append_char(b, ',') == -1) {
+            goto bail;
+        }
+
+        for (i = 0; i < initialized; i++) {
+            if (append_string(b, cols[i].prefix, cols[i].prefix_length) == -1) {
+                goto bail;
+            }
+            if (_column_append(self, &cols[i], row) == -1) {
+                goto bail;
+            }
+        }
+
+        if (append_char(b, '}') == -1) {
+            goto bail;
+        }
+    }
+
+    if (append_char(b, ']') == -1) {
+        goto bail;
+    }
+
+    retval = Buffer_frame_as_bytes(b, &frame);
+    STATS_ADD(self, bytes_out, b->_index - frame.start);
+
+  bail:
+    Encoder_mapping_end(&iter);
+    Buffer_pop_frame(b, &frame);
+
+    for (i = 0; i < initialized; i++) {
+        PyMem_Free(cols[i].prefix);
+        if (cols[i].kind == COLUMN_OBJECTS) {
+            Py_DECREF(cols[i].fast);
+        }
+        else {
+            PyBuffer_Release(&cols[i].view);
+        }
+    }
+    PyMem_Free(cols);
+
+    return retval;
+}
+
+static int
+_column_init(Encoder *self, Column *column, PyObject *key, PyObject *values, int first)
+{
+    Buffer *b = self->buffer;
+    int start = b->_index;
+
+    /* Encode the prefix in place, then move it out */
+    if (append_char(b, first ? '{' : ',') == -1 ||
+        Encoder_append(self, key) == -1 ||
+        append_char(b, ':') == -1) {
+        b->_index = start;
+        return -1;
+    }
+
+    column->prefix_length = b->_index - start;
+    column->prefix = PyMem_Malloc(column->prefix_length);
+    if (column->prefix == NULL) {
+        b->_index = start;
+        PyErr_NoMemory();
+        return -1;
+    }
+    memcpy(column->prefix, &b->_data[start], column->prefix_length);
+    b->_index = start;
+
+    column->kind = COLUMN_OBJECTS;
+
+    if (!PyList_Check(values) && !PyTuple_Check(values) && PyObject_CheckBuffer(values)) {
+        if (PyObject_GetBuffer(values, &column->view, PyBUF_FORMAT | PyBUF_STRIDES) == -1) {
+            PyMem_Free(column->prefix);
+            return -1;
+        }
+
+        column->kind = _buffer_kind(&column->view);
+        if (column->kind != COLUMN_OBJECTS) {
+            return 0;
+        }
+
+        /* Not a format we read directly: treat as a sequence */
+        PyBuffer_Release(&column->view);
+    }
+
+    column->fast = PySequence_Fast(values, "encode_records: expected columns of sequences");
+    if (column->fast == NULL) {
+        PyMem_Free(column->prefix);
+        return -1;
+    }
+
+    /* A copy of a list: a make_iterencode hook might change it mid-encode */
+    if (PyList_Check(column->fast)) {
+        Py_SETREF(column->fast, PyList_AsTuple(column->fast));
+        if (column->fast == NULL) {
+            PyMem_Free(column->prefix);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* The column kind for a 1-d buffer in native format, else COLUMN_OBJECTS */
+static int
+_buffer_kind(Py_buffer *view)
+{
+    const char *format = view->format ? view->format : "B";
+
+    if (view->ndim != 1) {
+        return COLUMN_OBJECTS;
+    }
+
+    if (format[0] == '@') {
+        format++;
+    }
+
+    if (format[0] == '\0' || format[1] != '\0') {
+        return COLUMN_OBJECTS;
+    }
+
+    switch (format[0]) {
+    case 'b': case 'h': case 'i': case 'l': case 'q': case 'n':
+        return COLUMN_SIGNED;
+    case 'B': case 'H': case 'I': case 'L': case 'Q': case 'N':
+        return COLUMN_UNSIGNED;
+    case 'f':
+        return COLUMN_FLOAT;
+    case 'd':
+        return COLUMN_DOUBLE;
+    case '?':
+        return COLUMN_BOOL;
+    default:
+        return COLUMN_OBJECTS;
+    }
+}
+
+static int
+_column_append(Encoder *self, Column *column, Py_ssize_t row)
+{
+    if (column->kind == COLUMN_OBJECTS) {
+        return Encoder_append(self, PySequence_Fast_GET_ITEM(column->fast, row));
+    }
+
+    const char *p = (const char *)column->view.buf + row * column->view.strides[0];
+    Py_ssize_t size = column->view.itemsize;
+
+    switch (column->kind) {
+    case COLUMN_SIGNED: {
+        long long value;
+        switch (size) {
+        case 1: value = *(const signed char *)p; break;
+        case 2: value = *(const short *)p; break;
+        case 4: value = *(const int *)p; break;
+        default: value = *(const long long *)p; break;
+        }
+        return append_longlong(self->buffer, value);
+    }
+    case COLUMN_UNSIGNED: {
+        unsigned long long value;
+        switch (size) {
+        case 1: value = *(const unsigned char *)p; break;
+        case 2: value = *(const unsigned short *)p; break;
+        case 4: value = *(const unsigned int *)p; break;
+        default: value = *(const unsigned long long *)p; break;
+        }
+        if (value > LLONG_MAX) {
+            PyErr_SetString(PyExc_OverflowError, "encode_records: value too large");
+            return -1;
+        }
+        return append_longlong(self->buffer, (long long)value);
+    }
+    case COLUMN_FLOAT:
+        return Encoder_append_double(self, *(const float *)p);
+    case COLUMN_DOUBLE:
+        return Encoder_append_double(self, *(const double *)p);
+    default:
+        return Encoder_append(self, *(const unsigned char *)p ? Py_True : Py_False);
+    }
+}
@@ -0,0 +1,75 @@
+#include <Python.h>
+
+#include "buffer.h"
+#include "encoder.h"
+#include "module.h"
+
+/*
+ * One sealed segment of encode_segments() output, exported read-only to
+ * the memoryview returned for it, so the output is never copied. Its block
+ * goes back to the module's SegmentPool once the last view of it is gone.
+ */
+typedef struct {
+    PyObject_HEAD
+    char *data;
+    int length;
+    int size;
+    SegmentPool *pool;
+} SegmentObject;
+
+/*
+ * A memoryview over `segment`, which it takes: on success segment->data is
+ * NULL, left for Buffer_end_segments to skip.
+ */
+PyObject *
+Encoder_segment_view(Encoder *self, Segment *segment)
+{
+    PyTypeObject *type = self->state->Segment_Type;
+
+    SegmentObject *owner = (SegmentObject *)type->tp_alloc(type, 0);
+    if (owner == NULL) {
+        return NULL;
+    }
+
+    owner->data = segment->data;
+    owner->length = segment->length;
+    owner->size = segment->size;
+    owner->pool = &self->state->segment_pool;
+
+    segment->data = NULL;
+
+    PyObject *view = PyMemoryView_FromObject((PyObject *)owner);
+    Py_DECREF(owner);
+    return view;
+}
+
+static int
+Segment__getbuffer__(SegmentObject *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *)self, self->data, self->length, 1, flags);
+}
+
+static void
+Segment__del__(SegmentObject *self)
+{
+    /* The type holds the module, so its pool is still there */
+    PyTypeObject *type = Py_TYPE(self);
+
+    SegmentPool_release(self->pool, self->data, self->size);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+}
+
+static PyType_Slot Segment_slots[] = {
+    {Py_tp_dealloc,    Segment__del__},
+    {Py_bf_getbuffer,  Segment__getbuffer__},
+    {0, NULL},
+};
+
+PyType_Spec Segment_spec = {
+    "_encoder.Segment",
+    sizeof(SegmentObject),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    Segment_slots,
+};
@@ -0,0 +1,443 @@
+#include <Python.h>
+#include "buffer.h"
+#include "encoder.h"
+#include "module.h"
+#include "xml.h"
+
+/*
+ * A Template is a nested tag spec compiled down to a flat program of
+ * literal byte runs and value slots, e.g.
+ *
+ *   ('row', [('id', 'id'), ('name', {'lang': 'lang'}, 'name')])
+ *
+ * becomes
+ *
+ *   "<row><id>" id "</id><name lang=\"" lang "\">" name "</name></row>"
+ *
+ * Applying it to a record only appends literals and encodes slot values.
+ */
+
+#define TEMPLATE_OPS_INITIAL 16
+
+/* Forward declarations */
+static int _compile           (Template *self, Buffer *literals, PyObject *spec);
+static int _compile_children  (Template *self, Buffer *literals, PyObject *children);
+static int _emit_literal      (Template *self, Buffer *literals, const char *string, Py_ssize_t length);
+static int _emit_slot         (Template *self, Buffer *literals, PyObject *key);
+static int _flush_literal     (Template *self, Buffer *literals);
+
+Py_LOCAL_INLINE(int) _apply   (Template *self, PyObject *record);
+
+PyDoc_STRVAR(Template__doc__,
+"Template(encoder, spec)\n"
+"\n"
+"A tag skeleton compiled once, then filled from many records.\n"
+"\n"
+"spec is (name, children) or (name, attributes, children), where name is a\n"
+"str or Tag, children is a list of specs or a slot key, and attributes maps\n"
+"attribute names to slot keys.\n"
+"\n"
+"Records are mappings (looked up by slot key) or tuples/lists (slots taken\n"
+"in the order they appear in the spec).");
+
+PyDoc_STRVAR(Template_apply__doc__,
+"apply(record)\n"
+"\n"
+"Append `record` rendered through the template to the encoder's buffer,\n"
+"as from within __xml__ or alongside an XmlWriter.");
+
+PyDoc_STRVAR(Template_encode_bytes__doc__,
+"encode_bytes(records) -> bytes\n"
+"\n"
+"Every record in `records` rendered through the template, concatenated.");
+
+static PyObject *
+Template__new__(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    Encoder *encoder;
+    PyObject *spec;
+
+    ModuleState *state = Module_get_state(type);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTuple(args, "O!O", state->Encoder_Type, &encoder, &spec)) {
+        return NULL;
+    }
+
+    Template *self = (Template *)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+
+    Py_INCREF(encoder);
+    self->encoder = encoder;
+
+    self->ops = PyMem_Malloc(sizeof(TemplateOp) * TEMPLATE_OPS_INITIAL);
+    if (self->ops == NULL) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    self->ops_size = TEMPLATE_OPS_INITIAL;
+
+    Buffer *literals = new_buffer();
+    if (literals == NULL) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    if (_compile(self, literals, spec) == -1 || _flush_literal(self, literals) == -1) {
+        delete_buffer(literals);
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    /* Literal ops hold offsets until the literal bytes have their final home. */
+    self->literals = PyMem_Malloc(literals->_index + 1);
+    if (self->literals == NULL) {
+        delete_buffer(literals);
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    memcpy(self->literals, literals->_data, literals->_index);
+    delete_buffer(literals);
+
+    int i;
+    for (i = 0; i < self->ops_length; i++) {
+        if (self->ops[i].key == NULL) {
+            self->ops[i].literal = self->literals + self->ops[i].offset;
+        }
+    }
+
+    return (PyObject *)self;
+}
+
+static void
+Template__del__(Template *self)
+{
+    int i;
+
+    Py_XDECREF(self->encoder);
+
+    if (self->ops != NULL) {
+        for (i = 0; i < self->ops_length; i++) {
+            Py_XDECREF(self->ops[i].key);
+        }
+        PyMem_Free(self->ops);
+    }
+
+    PyMem_Free(self->literals);
+
+    PyTypeObject *type = Py_TYPE(self);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+}
+
+static PyObject *
+Template_apply(Template *self, PyObject *record)
+{
+    if (_apply(self, record) == -1)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Template_encode_bytes(Template *self, PyObject *records)
+{
+    Buffer *b = self->encoder->buffer;
+    BufferFrame frame;
+
+    PyObject *retval = NULL;
+    PyObject *iterator = PyObject_GetIter(records);
+    PyObject *record;
+
+    if (iterator == NULL)
+        return NULL;
+
+    if (Buffer_push_frame(b, &frame) == -1) {
+        Py_DECREF(iterator);
+        return NULL;
+    }
+
+    while ((record = PyIter_Next(iterator))) {
+        int status = _apply(self, record);
+        Py_DECREF(record);
+        if (status == -1)
+            goto bail;
+    }
+
+    if (PyErr_Occurred())
+        goto bail;
+
+    retval = Buffer_frame_as_bytes(b, &frame);
+  bail:
+    Buffer_pop_frame(b, &frame);
+    Py_DECREF(iterator);
+    return retval;
+}
+
+Py_LOCAL_INLINE(int)
+_apply(Template *self, PyObject *record)
+{
+    Encoder *encoder = self->encoder;
+    Buffer *b = encoder->buffer;
+
+    TemplateOp *op = self->ops;
+    TemplateOp *end = self->ops + self->ops_length;
+
+    /* Borrowed for tuples/lists, new reference otherwise */
+    PyObject *value;
+
+    int by_index = PyTuple_CheckExact(record) || PyList_CheckExact(record);
+    int by_dict = PyDict_CheckExact(record);
+
+    if (by_index && PySequence_Fast_GET_SIZE(record) < self->slots) {
+        PyErr_Format(PyExc_ValueError, "Template: expected %d values, got %zd",
+                     self->slots, PySequence_Fast_GET_SIZE(record));
+        return -1;
+    }
+
+    for (; op != end; op++) {
+        if (op->key == NULL) {
+            if (append_string(b, op->literal, op->length) == -1)
+                return -1;
+            continue;
+        }
+
+        if (by_index) {
+            value = PySequence_Fast_ITEMS(record)[op->index];
+        }
+        else if (by_dict) {
+            value = PyDict_GetItemWithError(record, op->key);
+            if (value == NULL) {
+                if (!PyErr_Occurred())
+                    PyErr_SetObject(PyExc_KeyError, op->key);
+                return -1;
+            }
+        }
+        else {
+            value = PyObject_GetItem(record, op->key);
+            if (value == NULL)
+                return -1;
+
+            int status = Encoder_append(encoder, value);
+            Py_DECREF(value);
+            if (status == -1)
+                return -1;
+            continue;
+        }
+
+        if (Encoder_append(encoder, value) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*************
+ * Compiling *
+ *************/
+
+static int
+_compile(Template *self, Buffer *literals, PyObject *spec)
+{
+    PyObject *name;
+    PyObject *attributes = NULL;
+    PyObject *children;
+
+    if (!PyTuple_Check(spec) || PyTuple_GET_SIZE(spec) < 2 || PyTuple_GET_SIZE(spec) > 3) {
+        PyErr_Format(PyExc_TypeError, "Template: expected (name, children) or (name, attributes, children), got: %R", spec);
+        return -1;
+    }
+
+    name = PyTuple_GET_ITEM(spec, 0);
+
+    if (PyTuple_GET_SIZE(spec) == 3) {
+        attributes = PyTuple_GET_ITEM(spec, 1);
+        children = PyTuple_GET_ITEM(spec, 2);
+    }
+    else {
+        children = PyTuple_GET_ITEM(spec, 1);
+    }
+
+    const char *name_utf8;
+    Py_ssize_t name_length;
+
+    if (PyObject_TypeCheck(name, self->encoder->state->Tag_Type)) {
+        name_utf8 = ((Tag *)name)->name;
+        name_length = ((Tag *)name)->name_length;
+    }
+    else if (PyUnicode_Check(name)) {
+        name_utf8 = PyUnicode_AsUTF8AndSize(name, &name_length);
+        if (name_utf8 == NULL)
+            return -1;
+    }
+    else {
+        PyErr_Format(PyExc_TypeError, "Template: expected Tag or str name, got: %R", name);
+        return -1;
+    }
+
+    if (_emit_literal(self, literals, "<", 1) == -1 ||
+        _emit_literal(self, literals, name_utf8, name_length) == -1)
+        return -1;
+
+    if (attributes != NULL && attributes != Py_None) {
+        /* Borrowed references */
+        PyObject *attribute;
+        PyObject *key;
+        Py_ssize_t pos = 0;
+
+        if (!PyDict_Check(attributes)) {
+            PyErr_Format(PyExc_TypeError, "Template: expected dict attributes, got: %R", attributes);
+            return -1;
+        }
+
+        while (PyDict_Next(attributes, &pos, &attribute, &key)) {
+            Py_ssize_t attribute_length;
+            const char *attribute_utf8 = PyUnicode_Check(attribute) ? PyUnicode_AsUTF8AndSize(attribute, &attribute_length) : NULL;
+            if (attribute_utf8 == NULL) {
+                if (!PyErr_Occurred())
+                    PyErr_Format(PyExc_TypeError, "Template: expected str attribute name, got: %R", attribute);
+                return -1;
+            }
+
+            if (_emit_literal(self, literals, " ", 1) == -1 ||
+                _emit_literal(self, literals, attribute_utf8, attribute_length) == -1 ||
+                _emit_literal(self, literals, "=\"", 2) == -1 ||
+                _emit_slot(self, literals, key) == -1 ||
+                _emit_literal(self, literals, "\"", 1) == -1)
+                return -1;
+        }
+    }
+
+    if (_emit_literal(self, literals, ">", 1) == -1)
+        return -1;
+
+    if (PyList_Check(children)) {
+        if (_compile_children(self, literals, children) == -1)
+            return -1;
+    }
+    else if (_emit_slot(self, literals, children) == -1) {
+        return -1;
+    }
+
+    if (_emit_literal(self, literals, "</", 2) == -1 ||
+        _emit_literal(self, literals, name_utf8, name_length) == -1 ||
+        _emit_literal(self, literals, ">", 1) == -1)
+        return -1;
+
+    return 0;
+}
+
+static int
+_compile_children(Template *self, Buffer *literals, PyObject *children)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < PyList_GET_SIZE(children); i++) {
+        if (Py_EnterRecursiveCall(" while compiling a Template"))
+            return -1;
+
+        int status = _compile(self, literals, PyList_GET_ITEM(children, i));
+
+        Py_LeaveRecursiveCall();
+
+        if (status == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+_emit_literal(Template *self, Buffer *literals, const char *string, Py_ssize_t length)
+{
+    return append_string(literals, (char *)string, length);
+}
+
+Py_LOCAL_INLINE(TemplateOp *)
+_push_op(Template *self)
+{
+    if (self->ops_length == self->ops_size) {
+        TemplateOp *ops = PyMem_Realloc(self->ops, sizeof(TemplateOp) * self->ops_size * 2);
+        if (ops == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        self->ops = ops;
+        self->ops_size *= 2;
+    }
+
+    TemplateOp *op = &self->ops[self->ops_length++];
+
+    op->key = NULL;
+    op->literal = NULL;
+    op->offset = 0;
+    op->length = 0;
+    op->index = 0;
+
+    return op;
+}
+
+/* Close off the literal bytes accumulated since the last slot, if any. */
+static int
+_flush_literal(Template *self, Buffer *literals)
+{
+    if (literals->_index == self->_literal_start)
+        return 0;
+
+    TemplateOp *op = _push_op(self);
+    if (op == NULL)
+        return -1;
+
+    op->offset = self->_literal_start;
+    op->length = literals->_index - self->_literal_start;
+
+    self->_literal_start = literals->_index;
+
+    return 0;
+}
+
+static int
+_emit_slot(Template *self, Buffer *literals, PyObject *key)
+{
+    if (PyObject_Hash(key) == -1)
+        return -1;
+
+    if (_flush_literal(self, literals) == -1)
+        return -1;
+
+    TemplateOp *op = _push_op(self);
+    if (op == NULL)
+        return -1;
+
+    Py_INCREF(key);
+    op->key = key;
+    op->index = self->slots++;
+
+    return 0;
+}
+
+static PyMethodDef Template_methods[] = {
+    {"apply",        (PyCFunction)Template_apply,        METH_O, Template_apply__doc__},
+    {"encode_bytes", (PyCFunction)Template_encode_bytes, METH_O, Template_encode_bytes__doc__},
+    {NULL} /* Sentinel */
+};
+
+static PyType_Slot Template_slots[] = {
+    {Py_tp_dealloc, Template__del__},
+    {Py_tp_doc,     (void *)Template__doc__},
+    {Py_tp_methods, Template_methods},
+    {Py_tp_new,     Template__new__},
+    {0, NULL},
+};
+
+PyType_Spec Template_spec = {
+    "_encoder.Template",
+    sizeof(Template),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    Template_slots,
+};
@@ -1,10 +1,15 @@
 #include <Python.h>
 #include "buffer.h"
 #include "encoder.h"
+#include "module.h"
 #include "xml.h"
 
+#define XML_WRITER_STACK_INITIAL 16
+
 /* Forward declarations */
-static PyTypeObject Element_Type;
+Py_LOCAL_INLINE(int) _append_open       (Encoder *encoder, PyObject *tag, PyObject *attributes);
+Py_LOCAL_INLINE(int) _append_close      (Encoder *encoder, PyObject *tag);
+static int           _append_attributes (Encoder *encoder, PyObject *attributes);
 
 PyDoc_STRVAR(Tag__doc__,
 "TODO Tag __doc__");
@@ -12,16 +17,58 @@ PyDoc_STRVAR(Tag__doc__,
 static PyObject *
 Tag__new__(PyTypeObject *type, PyObject *args, PyObject **kwargs)
 {
+    Encoder *encoder;
+    PyObject *name;
+    Py_ssize_t name_length;
+
+    ModuleState *state = Module_get_state(type);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTuple(args, "O!U", state->Encoder_Type, &encoder, &name)) {
+        return NULL;
+    }
+
+    const char *name_utf8 = PyUnicode_AsUTF8AndSize(name, &name_length);
+    if (name_utf8 == NULL) {
+        return NULL;
+    }
+
+    if (name_length > (INT_MAX - 5) / 2) {
+        PyErr_SetString(PyExc_OverflowError, "Tag: name too long");
+        return NULL;
+    }
+
     Tag *self = (Tag *)type->tp_alloc(type, 0);
     if (self == NULL) {
         return NULL;
     }
 
-    if (!PyArg_ParseTuple(args, "O!s", &Encoder_Type, &self->encoder, &self->name)) {
-        return NULL;
+    self->encoder = encoder;
+
+    self->_tags = PyMem_Malloc(2 * name_length + 5);
+    if (self->_tags == NULL) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
     }
 
-    self->name_length = strlen(self->name);
+    self->open = self->_tags;
+    self->open_length = name_length + 2;
+    self->close = self->_tags + self->open_length;
+    self->close_length = name_length + 3;
+
+    self->open[0] = '<';
+    memcpy(&self->open[1], name_utf8, name_length);
+    self->open[name_length + 1] = '>';
+
+    self->close[0] = '<';
+    self->close[1] = '/';
+    memcpy(&self->close[2], name_utf8, name_length);
+    self->close[name_length + 2] = '>';
+
+    self->name = &self->open[1];
+    self->name_length = name_length;
 
     return (PyObject *)self;
 }
@@ -29,9 +76,12 @@ Tag__new__(PyTypeObject *type, PyObject *args, PyObject **kwargs)
 static void
 Tag__del__(Tag* self)
 {
+    PyTypeObject *type = Py_TYPE(self);
+
     //Py_XDECREF(self->encoder);
-    /* Free self->name ? */
-    Py_TYPE(self)->tp_free((PyObject*)self);
+    PyMem_Free(self->_tags);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
 }
 
 static PyObject *
@@ -42,62 +92,49 @@ Tag__call__(PyObject *self, PyObject *args, PyObject *kwargs)
         return NULL;
     }
 
-    /* Maybe not do this lazily? */
-    if (PyType_Ready(&Element_Type) == -1) {
-        return NULL;
-    }
-
-    /* TODO: not sure if this is idiomatic. */
-    Element *element = PyType_GenericNew(&Element_Type, NULL, NULL);
-    if (element == NULL) {
-        return NULL;
-    }
-
-    element->tag = self;
-    element->attributes = kwargs;
-
-    return element;
-}
-
-PyTypeObject Tag_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "_encoder.Tag",            /* tp_name */
-    sizeof(Tag),               /* tp_basicsize */
-    0,                         /* tp_itemsize */
-    (destructor)Tag__del__,    /* tp_dealloc */
-    0,                         /* tp_print */
-    0,                         /* tp_getattr */
-    0,                         /* tp_setattr */
-    0,                         /* tp_reserved */
-    0,                         /* tp_repr */
-    0,                         /* tp_as_number */
-    0,                         /* tp_as_sequence */
-    0,                         /* tp_as_mapping */
-    0,                         /* tp_hash  */
-    Tag__call__,               /* tp_call */
-    0,                         /* tp_str */
-    0,                         /* tp_getattro */
-    0,                         /* tp_setattro */
-    0,                         /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,        /* tp_flags */
-    Tag__doc__,                /* tp_doc */
-    0,                         /* tp_traverse */
-    0,                         /* tp_clear */
-    0,                         /* tp_richcompare */
-    0,                         /* tp_weaklistoffset */
-    0,                         /* tp_iter */
-    0,                         /* tp_iternext */
-    0,                         /* tp_methods */
-    0,                         /* tp_members */
-    0,                         /* tp_getset */
-    0,                         /* tp_base */
-    0,                         /* tp_dict */
-    0,                         /* tp_descr_get */
-    0,                         /* tp_descr_set */
-    0,                         /* tp_dictoffset */
-    0,                         /* tp_init */
-    0,                         /* tp_alloc */
-    Tag__new__,                /* tp_new */
+    ModuleState *state = PyType_GetModuleState(Py_TYPE(self));
+    Element *element;
+
+    if (state->element_free_list_length != 0) {
+        element = (Element *)state->element_free_list[--state->element_free_list_length];
+        PyObject_Init((PyObject *)element, state->Element_Type);
+    }
+    else {
+        element = PyObject_New(Element, state->Element_Type);
+        if (element == NULL) {
+            return NULL;
+        }
+    }
+
+    Py_INCREF(self);
+    element->tag = (Tag *)self;
+
+    /* Empty kwargs is as good as none, and saves the check on __enter__. */
+    if (kwargs != NULL && PyDict_GET_SIZE(kwargs) != 0) {
+        Py_INCREF(kwargs);
+        element->attributes = kwargs;
+    }
+    else {
+        element->attributes = NULL;
+    }
+
+    return (PyObject *)element;
+}
+
+static PyType_Slot Tag_slots[] = {
+    {Py_tp_dealloc, Tag__del__},
+    {Py_tp_call,    Tag__call__},
+    {Py_tp_doc,     (void *)Tag__doc__},
+    {Py_tp_new,     Tag__new__},
+    {0, NULL},
+};
+
+PyType_Spec Tag_spec = {
+    "_encoder.Tag",
+    sizeof(Tag),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    Tag_slots,
 };
 
 PyDoc_STRVAR(Element__doc__,
@@ -106,77 +143,454 @@ PyDoc_STRVAR(Element__doc__,
 static void
 Element__del__(Element* self)
 {
-    //Py_XDECREF(self->tag);
-    //Py_XDECREF(self->attributes);
-    Py_TYPE(self)->tp_free((PyObject*)self);
+    PyTypeObject *type = Py_TYPE(self);
+    ModuleState *state = PyType_GetModuleState(type);
+
+    Py_DECREF(self->tag);
+    Py_XDECREF(self->attributes);
+
+    if (state->element_free_list_length < ELEMENT_FREE_LIST_MAX) {
+        state->element_free_list[state->element_free_list_length++] = (PyObject *)self;
+    }
+    else {
+        PyObject_Del(self);
+    }
+    Py_DECREF(type);
 }
 
 static PyObject *
 Element__enter__(Element *self, PyObject *args)
 {
-    if (self->attributes == NULL) {
-        if (ensure_room(self->tag->encoder->buffer, self->tag->name_length + 2) == -1)
-            return NULL;
+    if (_append_open(self->tag->encoder, (PyObject *)self->tag, self->attributes) == -1)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Element__exit__(Element *self, PyObject *args)
+{
+    if (append_string(self->tag->encoder->buffer, self->tag->close, self->tag->close_length) == -1)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
 
-        append_char_unsafe(self->tag->encoder->buffer, '<');
-        append_string_unsafe(self->tag->encoder->buffer, self->tag->name, self->tag->name_length);
-        append_char_unsafe(self->tag->encoder->buffer, '>');
+static PyMethodDef Element_methods[] = {
+    {"__enter__", (PyCFunction)Element__enter__, METH_NOARGS, NULL},
+    {"__exit__",  (PyCFunction)Element__exit__,  METH_VARARGS, NULL},
+    {NULL} /* Sentinel */
+};
+
+static PyType_Slot Element_slots[] = {
+    {Py_tp_dealloc, Element__del__},
+    {Py_tp_doc,     (void *)Element__doc__},
+    {Py_tp_methods, Element_methods},
+    {0, NULL},
+};
+
+PyType_Spec Element_spec = {
+    "_encoder.Element",
+    sizeof(Element),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    Element_slots,
+};
+
+/*
+ * Shared by Element and XmlWriter.
+ * `tag` may be a Tag (precomputed bytes) or a str.
+ */
+
+Py_LOCAL_INLINE(int)
+_append_open(Encoder *encoder, PyObject *tag, PyObject *attributes)
+{
+    Buffer *b = encoder->buffer;
+
+    if (Py_TYPE(tag) == encoder->state->Tag_Type) {
+        Tag *t = (Tag *)tag;
+
+        if (attributes == NULL)
+            return append_string(b, t->open, t->open_length);
+
+        /* Everything but the '>' */
+        if (append_string(b, t->open, t->open_length - 1) == -1)
+            return -1;
+    }
+    else if (PyUnicode_Check(tag)) {
+        Py_ssize_t length;
+        const char *name = PyUnicode_AsUTF8AndSize(tag, &length);
+        if (name == NULL)
+            return -1;
+
+        if (ensure_room(b, length + 2) == -1)
+            return -1;
+
+        append_char_unsafe(b, '<');
+        append_string_unsafe(b, (char *)name, length);
+
+        if (attributes == NULL) {
+            append_char_unsafe(b, '>');
+            return 0;
+        }
     }
     else {
-        PyErr_Format(PyExc_NotImplementedError, "Element.__enter__ with attributes %R", self->attributes);
+        PyErr_Format(PyExc_TypeError, "expected Tag or str, got: %s", Py_TYPE(tag)->tp_name);
+        return -1;
+    }
+
+    if (_append_attributes(encoder, attributes) == -1)
+        return -1;
+
+    return append_char(b, '>');
+}
+
+Py_LOCAL_INLINE(int)
+_append_close(Encoder *encoder, PyObject *tag)
+{
+    Buffer *b = encoder->buffer;
+
+    if (Py_TYPE(tag) == encoder->state->Tag_Type) {
+        Tag *t = (Tag *)tag;
+        return append_string(b, t->close, t->close_length);
+    }
+
+    Py_ssize_t length;
+    const char *name = PyUnicode_AsUTF8AndSize(tag, &length);
+    if (name == NULL)
+        return -1;
+
+    if (ensure_room(b, length + 3) == -1)
+        return -1;
+
+    append_char_unsafe(b, '<');
+    append_char_unsafe(b, '/');
+    append_string_unsafe(b, (char *)name, length);
+    append_char_unsafe(b, '>');
+
+    return 0;
+}
+
+static int
+_append_attributes(Encoder *encoder, PyObject *attributes)
+{
+    Buffer *b = encoder->buffer;
+
+    /* Borrowed references */
+    PyObject *key;
+    PyObject *value;
+
+    Py_ssize_t pos = 0;
+
+    if (!PyDict_Check(attributes)) {
+        PyErr_Format(PyExc_TypeError, "attributes: expected dict, got: %s", Py_TYPE(attributes)->tp_name);
+        return -1;
+    }
+
+    while (PyDict_Next(attributes, &pos, &key, &value)) {
+        if (!PyUnicode_Check(key)) {
+            PyErr_Format(PyExc_TypeError, "attributes: expected str keys, got: %R", key);
+            return -1;
+        }
+
+        Py_ssize_t length;
+        const char *name = PyUnicode_AsUTF8AndSize(key, &length);
+        if (name == NULL)
+            return -1;
+
+        if (ensure_room(b, length + 3) == -1)
+            return -1;
+
+        append_char_unsafe(b, ' ');
+        append_string_unsafe(b, (char *)name, length);
+        append_char_unsafe(b, '=');
+        append_char_unsafe(b, '"');
+
+        if (Encoder_append(encoder, value) == -1)
+            return -1;
+
+        if (append_char(b, '"') == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*************
+ * XmlWriter *
+ *************/
+
+PyDoc_STRVAR(XmlWriter__doc__,
+"XmlWriter(encoder)\n"
+"\n"
+"Event-style writer into the encoder's buffer, for flat/hot loops where\n"
+"the __xml__ generator protocol costs too much per element.\n"
+"Tags may be Tag instances (preferred, precomputed) or str.");
+
+PyDoc_STRVAR(XmlWriter_start__doc__,
+"start(tag, attributes=None)\n"
+"\n"
+"Open `tag`, pushing it on the open tag stack.");
+
+PyDoc_STRVAR(XmlWriter_text__doc__,
+"text(o)\n"
+"\n"
+"Append `o` as text, escaped per the encoder.");
+
+PyDoc_STRVAR(XmlWriter_end__doc__,
+"end()\n"
+"\n"
+"Close the most recently opened tag.");
+
+PyDoc_STRVAR(XmlWriter_element__doc__,
+"element(tag, text, attributes=None)\n"
+"\n"
+"Equivalent to start(tag, attributes); text(text); end().");
+
+PyDoc_STRVAR(XmlWriter_elements__doc__,
+"elements(tag, iterable)\n"
+"\n"
+"element(tag, text) for each text in `iterable`.");
+
+PyDoc_STRVAR(XmlWriter_getvalue__doc__,
+"getvalue() -> bytes\n"
+"\n"
+"Everything written so far, which is then cleared.\n"
+"All started tags must have been ended.");
+
+static PyObject *
+XmlWriter__new__(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    Encoder *encoder;
+
+    ModuleState *state = Module_get_state(type);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTuple(args, "O!", state->Encoder_Type, &encoder)) {
+        return NULL;
+    }
+
+    XmlWriter *self = (XmlWriter *)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+
+    self->stack = PyMem_Malloc(sizeof(PyObject *) * XML_WRITER_STACK_INITIAL);
+    if (self->stack == NULL) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+
+    Py_INCREF(encoder);
+    self->encoder = encoder;
+    self->depth = 0;
+    self->stack_size = XML_WRITER_STACK_INITIAL;
+    self->start = encoder->buffer->_index;
+
+    return (PyObject *)self;
+}
+
+static void
+XmlWriter__del__(XmlWriter *self)
+{
+    int i;
+
+    if (self->encoder != NULL) {
+        /* Don't leave half a document behind for the next encode. */
+        if (self->encoder->buffer->_index > self->start) {
+            self->encoder->buffer->_index = self->start;
+        }
+        Py_DECREF(self->encoder);
+    }
+
+    for (i = 0; i < self->depth; i++) {
+        Py_DECREF(self->stack[i]);
+    }
+    PyMem_Free(self->stack);
+
+    PyTypeObject *type = Py_TYPE(self);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+}
+
+Py_LOCAL_INLINE(int)
+_XmlWriter_push(XmlWriter *self, PyObject *tag)
+{
+    if (self->depth == self->stack_size) {
+        PyObject **stack = PyMem_Realloc(self->stack, sizeof(PyObject *) * self->stack_size * 2);
+        if (stack == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->stack = stack;
+        self->stack_size *= 2;
+    }
+
+    Py_INCREF(tag);
+    self->stack[self->depth++] = tag;
+
+    return 0;
+}
+
+Py_LOCAL_INLINE(PyObject *)
+_attributes_or_null(PyObject *attributes)
+{
+    if (attributes == Py_None || (PyDict_Check(attributes) && PyDict_GET_SIZE(attributes) == 0))
+        return NULL;
+    return attributes;
+}
+
+static PyObject *
+XmlWriter_start(XmlWriter *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (nargs < 1 || nargs > 2) {
+        PyErr_Format(PyExc_TypeError, "start: expected 1 or 2 arguments, got %zd", nargs);
         return NULL;
     }
 
+    PyObject *tag = args[0];
+    PyObject *attributes = nargs == 2 ? _attributes_or_null(args[1]) : NULL;
+
+    if (_append_open(self->encoder, tag, attributes) == -1)
+        return NULL;
+
+    if (_XmlWriter_push(self, tag) == -1)
+        return NULL;
+
     Py_RETURN_NONE;
 }
 
 static PyObject *
-Element__exit__(Element *self, PyObject *args)
+XmlWriter_text(XmlWriter *self, PyObject *o)
+{
+    if (Encoder_append(self->encoder, o) == -1)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+XmlWriter_end(XmlWriter *self, PyObject *unused)
 {
-    if (ensure_room(self->tag->encoder->buffer, self->tag->name_length + 3) == -1)
+    if (self->depth == 0) {
+        PyErr_SetString(PyExc_RuntimeError, "end: no open tag");
         return NULL;
+    }
 
-    append_char_unsafe(self->tag->encoder->buffer, '<');
-    append_char_unsafe(self->tag->encoder->buffer, '/');
-    append_string_unsafe(self->tag->encoder->buffer, self->tag->name, self->tag->name_length);
-    append_char_unsafe(self->tag->encoder->buffer, '>');
+    PyObject *tag = self->stack[--self->depth];
+
+    int retval = _append_close(self->encoder, tag);
+
+    Py_DECREF(tag);
+
+    if (retval == -1)
+        return NULL;
 
     Py_RETURN_NONE;
 }
 
-static PyMethodDef Element_methods[] = {
-    {"__enter__", Element__enter__, METH_NOARGS, NULL},
-    {"__exit__",  Element__exit__,  METH_VARARGS, NULL},
+static PyObject *
+XmlWriter_element(XmlWriter *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (nargs < 2 || nargs > 3) {
+        PyErr_Format(PyExc_TypeError, "element: expected 2 or 3 arguments, got %zd", nargs);
+        return NULL;
+    }
+
+    PyObject *tag = args[0];
+    PyObject *attributes = nargs == 3 ? _attributes_or_null(args[2]) : NULL;
+
+    if (_append_open(self->encoder, tag, attributes) == -1)
+        return NULL;
+
+    if (Encoder_append(self->encoder, args[1]) == -1)
+        return NULL;
+
+    if (_append_close(self->encoder, tag) == -1)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+XmlWriter_elements(XmlWriter *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (nargs != 2) {
+        PyErr_Format(PyExc_TypeError, "elements: expected 2 arguments, got %zd", nargs);
+        return NULL;
+    }
+
+    PyObject *tag = args[0];
+
+    PyObject *sequence = PySequence_Fast(args[1], "elements: expected an iterable");
+    if (sequence == NULL)
+        return NULL;
+
+    PyObject *retval = NULL;
+
+    Py_ssize_t length = PySequence_Fast_GET_SIZE(sequence);
+    PyObject **items = PySequence_Fast_ITEMS(sequence);
+    Py_ssize_t i;
+
+    for (i = 0; i < length; i++) {
+        if (_append_open(self->encoder, tag, NULL) == -1)
+            goto bail;
+
+        if (Encoder_append(self->encoder, items[i]) == -1)
+            goto bail;
+
+        if (_append_close(self->encoder, tag) == -1)
+            goto bail;
+    }
+
+    Py_INCREF(Py_None);
+    retval = Py_None;
+  bail:
+    Py_DECREF(sequence);
+    return retval;
+}
+
+static PyObject *
+XmlWriter_getvalue(XmlWriter *self, PyObject *unused)
+{
+    if (self->depth != 0) {
+        PyErr_Format(PyExc_RuntimeError, "getvalue: %d tag(s) still open", self->depth);
+        return NULL;
+    }
+
+    Buffer *b = self->encoder->buffer;
+
+    PyObject *bytes = PyBytes_FromStringAndSize(&b->_data[self->start], b->_index - self->start);
+
+    b->_index = self->start;
+
+    return bytes;
+}
+
+static PyMethodDef XmlWriter_methods[] = {
+    {"start",    (PyCFunction)XmlWriter_start,    METH_FASTCALL, XmlWriter_start__doc__},
+    {"text",     (PyCFunction)XmlWriter_text,     METH_O,        XmlWriter_text__doc__},
+    {"end",      (PyCFunction)XmlWriter_end,      METH_NOARGS,   XmlWriter_end__doc__},
+    {"element",  (PyCFunction)XmlWriter_element,  METH_FASTCALL, XmlWriter_element__doc__},
+    {"elements", (PyCFunction)XmlWriter_elements, METH_FASTCALL, XmlWriter_elements__doc__},
+    {"getvalue", (PyCFunction)XmlWriter_getvalue, METH_NOARGS,   XmlWriter_getvalue__doc__},
     {NULL} /* Sentinel */
 };
 
-static PyTypeObject Element_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "_encoder.Element",        /* tp_name */
-    sizeof(Element),           /* tp_basicsize */
-    0,                         /* tp_itemsize */
-    (destructor)Element__del__,/* tp_dealloc */
-    0,                         /* tp_print */
-    0,                         /* tp_getattr */
-    0,                         /* tp_setattr */
-    0,                         /* tp_reserved */
-    0,                         /* tp_repr */
-    0,                         /* tp_as_number */
-    0,                         /* tp_as_sequence */
-    0,                         /* tp_as_mapping */
-    0,                         /* tp_hash  */
-    0,                         /* tp_call */
-    0,                         /* tp_str */
-    0,                         /* tp_getattro */
-    0,                         /* tp_setattro */
-    0,                         /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,        /* tp_flags */
-    Element__doc__,            /* tp_doc */
-    0,                         /* tp_traverse */
-    0,                         /* tp_clear */
-    0,                         /* tp_richcompare */
-    0,                         /* tp_weaklistoffset */
-    0,                         /* tp_iter */
-    0,                         /* tp_iternext */
-    Element_methods,           /* tp_methods */
+static PyType_Slot XmlWriter_slots[] = {
+    {Py_tp_dealloc, XmlWriter__del__},
+    {Py_tp_doc,     (void *)XmlWriter__doc__},
+    {Py_tp_methods, XmlWriter_methods},
+    {Py_tp_new,     XmlWriter__new__},
+    {0, NULL},
+};
+
+PyType_Spec XmlWriter_spec = {
+    "_encoder.XmlWriter",
+    sizeof(XmlWriter),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    XmlWriter_slots,
 };
@@ -0,0 +1,74 @@
+import unittest
+
+import encoder.cbor
+
+class CborTests(unittest.TestCase):
+    # Expected encodings from RFC 8949, Appendix A.
+
+    @classmethod
+    def setUpClass(cls):
+        cls.encode = encoder.cbor.Encoder().encode_bytes
+
+    def check(self, o:object, hex:str):
+        self.assertEqual(self.encode(o).hex(), hex)
+
+    def test_constants(self):
+        self.check(False, 'f4')
+        self.check(True, 'f5')
+        self.check(None, 'f6')
+
+    def test_int(self):
+        self.check(0, '00')
+        self.check(23, '17')
+        self.check(24, '1818')
+        self.check(1000, '1903e8')
+        self.check(1000000000000, '1b000000e8d4a51000')
+        self.check(18446744073709551615, '1bffffffffffffffff')
+        self.check(18446744073709551616, 'c249010000000000000000')
+        self.check(-1, '20')
+        self.check(-1000, '3903e7')
+        self.check(-18446744073709551616, '3bffffffffffffffff')
+        self.check(-18446744073709551617, 'c349010000000000000000')
+
+    def test_float(self):
+        self.check(0.0, 'f90000')
+        self.check(-0.0, 'f98000')
+        self.check(1.5, 'f93e00')
+        self.check(65504.0, 'f97bff')
+        self.check(100000.0, 'fa47c35000')
+        self.check(1.1, 'fb3ff199999999999a')
+        self.check(5.960464477539063e-8, 'f90001')
+        self.check(float('inf'), 'f97c00')
+        self.check(float('nan'), 'f97e00')
+        self.check(1.0e+300, 'fb7e37e43c8800759c')
+        self.check(3.4028234663852886e+38, 'fa7f7fffff')
+        self.check(-1e39, 'fbc8078287f49c4a1d')
+
+    def test_str(self):
+        self.check('', '60')
+        self.check('IETF', '6449455446')
+        self.check('ü', '62c3bc')
+
+    def test_bytes(self):
+        self.check(b'\x01\x02\x03\x04', '4401020304')
+
+    def test_definite(self):
+        self.check([], '80')
+        self.check([1, [2, 3], (4, 5)], '8301820203820405')
+        self.check({'a': 1}, 'a1616101')
+
+    def test_indefinite(self):
+        self.check(iter([1, [2, 3]]), '9f01820203ff')
+        self.check((i for i in ()), '9fff')
+
+    def test_make_iterencode(self):
+        class Pair:
+            pass
+
+        class Encoder(encoder.cbor.Encoder):
+            def make_iterencode(self, type):
+                if type is Pair:
+                    return lambda p: iter(['a', 'b'])
+                return super().make_iterencode(type)
+
+        self.assertEqual(Encoder().encode_bytes(Pair()).hex(), '9f61616162ff')
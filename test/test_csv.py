@@ -0,0 +1,63 @@
+import csv
+import io
+import unittest
+
+import encoder.csv
+
+class CsvTests(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.encode = encoder.csv.Encoder().encode_rows
+
+    def check(self, rows, s:str):
+        self.assertEqual(self.encode(rows), s.encode('utf-8'))
+
+    def test_plain(self):
+        self.check([('a', 1, 2.5), ('b', -3, None)], 'a,1,2.5\r\nb,-3,\r\n')
+
+    def test_quoting(self):
+        self.check([('a,b', 'say "hi"', 'two\nlines', 'long enough to scan a word at a time, then more')],
+                   '"a,b","say ""hi""","two\nlines","long enough to scan a word at a time, then more"\r\n')
+
+    def test_matches_csv_module(self):
+        rows = [
+            ('plain', 'with, comma', 'quote " here', 'é unicode', '', True, False),
+            ('x' * 17 + '"', '\r', 'eight ch', 'nine chars,'),
+            (3.0, 1e-7, 123456789.123456789, 1e300, -0.0, float('inf'), float('nan')),
+            (2 ** 70, -2 ** 63, -2 ** 63 - 1, 2 ** 63 - 1),
+            ('',),
+            (None,),
+            ('', ''),
+            ]
+
+        out = io.StringIO()
+        csv.writer(out).writerows(rows)
+
+        self.check(rows, out.getvalue())
+
+    def test_tsv(self):
+        self.assertEqual(encoder.csv.TsvEncoder().encode_rows([('a', 'b\tc'), (1, 2)]), b'a\t"b\tc"\n1\t2\n')
+
+    def test_write_rows(self):
+        rows = [(i, 'row {}'.format(i)) for i in range(20000)]
+        sink = io.BytesIO()
+
+        encoder.csv.Encoder().write_rows(rows, sink)
+
+        self.assertEqual(sink.getvalue(), self.encode(rows))
+
+    def test_write_rows_nested(self):
+        e = encoder.csv.Encoder()
+        inner = io.BytesIO()
+
+        class Field:
+            def __str__(self):
+                # Mid-row on the same encoder
+                e.write_rows([('inner', i) for i in range(10000)], inner)
+                return 'field'
+
+        outer = io.BytesIO()
+        e.write_rows([('a', Field(), 'b')], outer)
+
+        self.assertEqual(outer.getvalue(), b'a,field,b\r\n')
+        self.assertEqual(inner.getvalue(), self.encode([('inner', i) for i in range(10000)]))
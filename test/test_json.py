@@ -30,6 +30,29 @@ class JsonTests(unittest.TestCase):
 
     def test_float(self):
         self.check(2.5, '2.5')
+        self.check(3.0, '3.0')
+        self.check(1e-7, '1e-07')
+        self.check(1e300, '1e+300')
+        self.check(123456789.123456789, '123456789.12345679')
+
+    def test_float_repr(self):
+        import math
+        import random
+        import struct
+
+        values = [0.1, -0.0, 1e16, 1e15, 1e-4, 1e-5, 5e-324, 2.2250738585072014e-308, 1.7976931348623157e308, 2.0 ** 53 + 2]
+        values += [2.0 ** i for i in range(-1074, 1024, 7)] + [10.0 ** i for i in range(-323, 309, 5)]
+
+        r = random.Random(0)
+        values += [struct.unpack('<d', struct.pack('<Q', r.getrandbits(63)))[0] for _ in range(10000)]
+        values += [r.getrandbits(20) / 10 ** r.randrange(8) for _ in range(10000)]
+
+        for value in values:
+            if math.isfinite(value):
+                self.check(value, repr(value))
+
+    def test_float_nonfinite(self):
+        self.check([float('inf'), float('-inf'), float('nan')], '[Infinity, -Infinity, NaN]')
 
     def test_str_empty(self):
         self.check("", '""')
@@ -37,6 +60,11 @@ class JsonTests(unittest.TestCase):
     def test_str_literal(self):
         self.check('abc', '"abc"')
 
+    def test_str_latin1(self):
+        self.check('é', '"é"')
+        self.check('a\xff"\x80b', '"a\xff\\"\x80b"')
+        self.assertEqual(encoder.json.Encoder().encode_bytes('café'), '"café"'.encode())
+
     def test_str_escape(self):
         self.check("a\"bc", '"a\\"bc"')
 
@@ -84,3 +112,791 @@ class JsonTests(unittest.TestCase):
         s_expected += '}'
 
         self.check(d, s_expected)
+
+    @unittest.skipUnless(hasattr(encoder.json.Encoder, 'stats'), 'built without ENCODER_STATS')
+    def test_stats(self):
+        e = encoder.json.Encoder()
+        e.encode(['a', 'b"', 1, 2.5, None, {'k': True}])
+
+        stats = e.stats()
+        self.assertEqual(stats['types']['str'], 3)
+        self.assertEqual(stats['types']['int'], 1)
+        self.assertEqual(stats['escapes'], 1)
+        self.assertEqual(stats['bytes'], len(e.encode_bytes(['a', 'b"', 1, 2.5, None, {'k': True}])))
+
+        e.reset_stats()
+        self.assertEqual(e.stats()['types']['str'], 0)
+
+    def test_str_escapes_repeated(self):
+        self.check('a"b"c\\', '"a\\"b\\"c\\\\"')
+        self.check('\n\n', '"\\n\\n"')
+        self.check('\x01x', '"\\u0001x"')
+
+    def test_escape_table_shared(self):
+        class Encoder(encoder.json.Encoder):
+            pass
+
+        Encoder().encode('a')
+        table = Encoder.__dict__['_string_escape_table']
+        Encoder().encode('b')
+        self.assertIs(Encoder.__dict__['_string_escape_table'], table)
+
+class NativeTypesTests(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        import datetime, decimal, enum, uuid
+
+        class Encoder(encoder.json.Encoder):
+            NATIVE_TYPES = (datetime.datetime, datetime.date, datetime.time, uuid.UUID, decimal.Decimal, enum.Enum)
+
+        cls.encode = Encoder().encode
+
+    def test_datetime(self):
+        from datetime import datetime, timedelta, timezone
+
+        for dt in [
+            datetime(2013, 1, 2, 3, 4, 5),
+            datetime(2013, 1, 2, 3, 4, 5, 6000),
+            datetime(1, 1, 1, tzinfo=timezone.utc),
+            datetime(2013, 1, 2, tzinfo=timezone(timedelta(hours=-5, minutes=-30))),
+            datetime(2013, 1, 2, tzinfo=timezone(timedelta(seconds=1, microseconds=5))),
+            ]:
+            self.assertEqual(self.encode(dt), '"{}"'.format(dt.isoformat()))
+
+    def test_date_time(self):
+        from datetime import date, time, timezone
+
+        self.assertEqual(self.encode(date(2013, 1, 2)), '"2013-01-02"')
+        self.assertEqual(self.encode(time(3, 4, 5, 123456)), '"03:04:05.123456"')
+        self.assertEqual(self.encode(time(3, 4, tzinfo=timezone.utc)), '"03:04:00+00:00"')
+
+    def test_uuid(self):
+        import uuid
+
+        for u in [uuid.UUID('12345678-9abc-def0-1234-56789abcdef0'), uuid.UUID(int=0), uuid.UUID(int=2 ** 128 - 1),
+                  uuid.UUID(int=2 ** 64), uuid.UUID(int=2 ** 64 - 1)]:
+            self.assertEqual(self.encode([u]), '["{}"]'.format(u))
+
+    def test_decimal(self):
+        from decimal import Decimal
+
+        for d, s in [('1.50', '1.50'), ('-0.001', '-0.001'), ('12', '12'), ('1E+3', '1E3'), ('0', '0'), ('0.0001', '0.0001'), ('-1E-7', '-1E-7')]:
+            self.assertEqual(self.encode(Decimal(d)), s)
+
+        self.assertEqual(float(self.encode(Decimal('1.23E-10'))), 1.23e-10)
+
+    def test_enum(self):
+        import enum
+
+        class Color(enum.Enum):
+            RED = 'red'
+            ONE = 1
+
+        self.assertEqual(self.encode([Color.RED, Color.ONE]), '["red",1]')
+
+    def test_not_opted_in(self):
+        import datetime
+
+        self.assertRaises(encoder.abc.CannotEncode, encoder.json.Encoder().encode, datetime.date.today())
+
+class SegmentTests(unittest.TestCase):
+    def setUp(self):
+        self.encoder = encoder.json.Encoder()
+        self.o = [{'key': 'value' * 100, 'n': i} for i in range(2000)]
+        self.expected = self.encoder.encode_bytes(self.o)
+
+    def test_encode_segments(self):
+        segments = self.encoder.encode_segments(self.o)
+
+        self.assertGreater(len(segments), 1)
+        self.assertEqual(b''.join(segments), self.expected)
+
+        # Buffer restored afterwards
+        self.assertEqual(self.encoder.encode_bytes(self.o), self.expected)
+
+    def test_encode_segments_views(self):
+        segments = self.encoder.encode_segments(self.o)
+        joined = b''.join(segments)
+
+        self.assertTrue(all(isinstance(segment, memoryview) and segment.readonly for segment in segments))
+
+        # Still theirs after more encodes, which reuse pooled segments
+        self.encoder.encode_segments([{'other': 'x' * 500}] * 1000)
+        del self.encoder
+        self.assertEqual(b''.join(segments), joined)
+
+    def test_encode_segments_small(self):
+        self.assertEqual(self.encoder.encode_segments([]), [b'[]'])
+
+    def test_encode_segments_oversized_str(self):
+        s = 'x' * 200000
+        self.assertEqual(b''.join(self.encoder.encode_segments([s])), self.encoder.encode_bytes([s]))
+
+    def test_encode_writev(self):
+        import os, tempfile
+
+        with tempfile.TemporaryFile() as f:
+            written = self.encoder.encode_writev(self.o, f.fileno())
+            self.assertEqual(written, len(self.expected))
+
+            f.seek(0)
+            self.assertEqual(f.read(), self.expected)
+
+    def test_error_restores(self):
+        self.assertRaises(encoder.abc.CannotEncode, self.encoder.encode_segments, [self.o, object()])
+        self.assertEqual(self.encoder.encode_bytes(self.o), self.expected)
+
+class CompressTests(unittest.TestCase):
+    def setUp(self):
+        self.encoder = encoder.json.Encoder()
+        self.o = [{'key': 'value' * 100, 'n': i} for i in range(2000)]
+        self.expected = self.encoder.encode_bytes(self.o)
+
+    def test_gzip(self):
+        import gzip
+        self.assertEqual(gzip.decompress(self.encoder.encode_compressed(self.o)), self.expected)
+
+    def test_zlib(self):
+        import zlib
+        compressed = self.encoder.encode_compressed(self.o, level=1, wbits=15)
+        self.assertEqual(zlib.decompress(compressed), self.expected)
+
+    def test_oversized_str(self):
+        import gzip
+        o = ['x' * 200000, 1]
+        self.assertEqual(gzip.decompress(self.encoder.encode_compressed(o)), self.encoder.encode_bytes(o))
+
+    def test_sink(self):
+        import gzip
+
+        class Sink:
+            def __init__(self):
+                self.chunks = []
+            def write(self, b):
+                self.chunks.append(b)
+
+        sink = Sink()
+        o = [str(i) * 50 for i in range(100000)]
+        self.assertIsNone(self.encoder.encode_compressed(o, sink=sink))
+        self.assertGreater(len(sink.chunks), 1)
+        self.assertEqual(gzip.decompress(b''.join(sink.chunks)), self.encoder.encode_bytes(o))
+
+    def test_sink_nested_encode(self):
+        import gzip
+        import random
+
+        e = encoder.json.Encoder()
+
+        class Sink:
+            def __init__(self):
+                self.chunks = []
+            def write(self, b):
+                self.chunks.append(b)
+                # Grows the same Buffer the compressor reads from
+                e.encode_bytes(['y' * 100000] * len(self.chunks))
+
+        r = random.Random(1)
+        o = [''.join(r.choice('abcdefghijklmnop') for _ in range(200)) for i in range(20000)]
+        sink = Sink()
+        self.assertIsNone(e.encode_compressed(o, sink=sink, level=1))
+        self.assertGreater(len(sink.chunks), 1)
+        self.assertEqual(gzip.decompress(b''.join(sink.chunks)), e.encode_bytes(o))
+
+    def test_sink_error(self):
+        class Sink:
+            def write(self, b):
+                raise OSError('full')
+
+        o = [str(i) * 50 for i in range(100000)]
+        self.assertRaises(OSError, self.encoder.encode_compressed, o, sink=Sink())
+        self.assertEqual(self.encoder.encode_bytes(self.o), self.expected)
+
+    def test_bad_level(self):
+        self.assertRaises(ValueError, self.encoder.encode_compressed, [], level=42)
+
+class EncodeToStreamTests(unittest.TestCase):
+    class Writer:
+        def __init__(self):
+            self.chunks = []
+
+        def write(self, b):
+            self.chunks.append(b)
+
+        async def drain(self):
+            pass
+
+    def stream(self, o, **kwargs):
+        import asyncio
+
+        writer = self.Writer()
+        asyncio.run(encoder.json.Encoder().encode_to_stream(o, writer, **kwargs))
+        return writer.chunks
+
+    def test_matches_encode_bytes(self):
+        from collections import OrderedDict
+
+        for o in [
+            [],
+            {},
+            1,
+            list(range(1000)),
+            {str(i): [i] * 100 for i in range(200)},
+            [list(range(200)), 'x', {'a': list(range(300))}, [], list(range(65))],
+            OrderedDict((str(i), i) for i in range(100)),
+            ]:
+            expected = encoder.json.Encoder().encode_bytes(o)
+            self.assertEqual(b''.join(self.stream(o, slice_bytes=100)), expected)
+
+    def test_slices(self):
+        o = [{'n': i, 's': 'x' * 100} for i in range(10000)]
+        chunks = self.stream(o, slice_bytes=64 * 1024)
+
+        self.assertGreater(len(chunks), 10)
+        self.assertLess(max(len(chunk) for chunk in chunks), 128 * 1024)
+
+    def test_nested_small_containers(self):
+        # No container over a few dozen items, but megabytes in all
+        o = [[['abcdefghij' * 5] * 60] * 60] * 60
+        chunks = list(encoder.json.Encoder()._iterencode_chunks(o))
+
+        self.assertEqual(b''.join(chunks), encoder.json.Encoder().encode_bytes(o))
+        self.assertGreater(len(chunks), 100)
+        self.assertLess(max(len(chunk) for chunk in chunks), 2 * encoder.json.Encoder.STREAM_CHUNK_SIZE)
+
+    def test_deep(self):
+        o = []
+        for _ in range(5000):
+            o = [o, 'x' * 10]
+
+        self.assertEqual(b''.join(self.stream(o, slice_bytes=1024)), encoder.json.Encoder().encode_bytes(o))
+
+    def test_interleaves(self):
+        import asyncio
+
+        ticks = []
+
+        async def ticker():
+            while True:
+                ticks.append(None)
+                await asyncio.sleep(0)
+
+        async def main():
+            task = asyncio.ensure_future(ticker())
+            o = [list(range(100))] * 1000
+            await encoder.json.Encoder().encode_to_stream(o, self.Writer(), slice_bytes=4096)
+            task.cancel()
+
+        asyncio.run(main())
+        self.assertGreater(len(ticks), 10)
+
+class NestedEncodeTests(unittest.TestCase):
+    class Point:
+        def __init__(self, x, y):
+            self.x, self.y = x, y
+
+    def encoder(self):
+        Point = self.Point
+
+        class Encoder(encoder.json.Encoder):
+            def make_iterencode(self, type):
+                if type is Point:
+                    def iterencode(p):
+                        # Pre-rendered as a string, with this same encoder
+                        yield self.encode([p.x, p.y])
+                    return iterencode
+                return super().make_iterencode(type)
+
+        return Encoder()
+
+    def test_encode_bytes(self):
+        e = self.encoder()
+        self.assertEqual(e.encode(['a', self.Point(1, self.Point(2, 3))]), '["a","[1,\\"[2,3]\\"]"]')
+        self.assertEqual(e.encode(self.Point(1, 2)), '"[1,2]"')
+
+    def test_segments_and_compressed(self):
+        import gzip
+
+        e = self.encoder()
+        o = [{'p': self.Point(i, 'x' * 100)} for i in range(2000)]
+        expected = e.encode_bytes(o)
+
+        self.assertEqual(b''.join(e.encode_segments(o)), expected)
+        self.assertEqual(gzip.decompress(e.encode_compressed(o)), expected)
+
+    def test_error_in_nested(self):
+        e = self.encoder()
+        self.assertRaises(encoder.abc.CannotEncode, e.encode, ['a', self.Point(object(), 1)])
+        self.assertEqual(e.encode([1]), '[1]')
+
+    def test_other_thread(self):
+        import threading
+
+        errors = []
+
+        def other():
+            try:
+                e.encode([1])
+            except RuntimeError as error:
+                errors.append(error)
+
+        class Encoder(encoder.json.Encoder):
+            def make_iterencode(self, type):
+                def iterencode(o):
+                    # Mid-encode on e: another thread may not join in
+                    thread = threading.Thread(target=other)
+                    thread.start()
+                    thread.join()
+                    yield 'x'
+                return iterencode
+
+        e = Encoder()
+        self.assertEqual(e.encode([self.Point(1, 2), 2]), '["x",2]')
+        self.assertEqual(len(errors), 1)
+        self.assertEqual(e.encode([1]), '[1]')
+
+class CapiTests(unittest.TestCase):
+    '''
+    The capsule driven through ctypes, standing in for another extension.
+    '''
+    def setUp(self):
+        import ctypes
+        import _encoder
+
+        APPEND = ctypes.PYFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.py_object)
+
+        class EncoderCAPI(ctypes.Structure):
+            _fields_ = [
+                ('version', ctypes.c_int),
+                ('Buffer_resize', ctypes.c_void_p),
+                ('append', APPEND),
+                ('get_str_quote', ctypes.PYFUNCTYPE(ctypes.c_int, ctypes.c_void_p)),
+                ('register_type', ctypes.PYFUNCTYPE(ctypes.c_int, ctypes.py_object, APPEND)),
+                ('register_type_in', ctypes.PYFUNCTYPE(ctypes.c_int, ctypes.py_object, ctypes.py_object, APPEND)),
+                ]
+
+        get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+        get_pointer.restype = ctypes.c_void_p
+        get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+
+        self.api = ctypes.cast(get_pointer(_encoder._C_API, b'_encoder._C_API'),
+                               ctypes.POINTER(EncoderCAPI)).contents
+        self.APPEND = APPEND
+
+    def test_register_type(self):
+        api = self.api
+
+        class Vector(list):
+            pass
+
+        # A vector is written as its parts joined by "x", as a str
+        def append_vector(encoder, o):
+            return api.append(encoder, 'x'.join(map(str, o)))
+
+        append = self.APPEND(append_vector)
+
+        self.assertEqual(api.version, 2)
+        self.assertEqual(api.register_type(Vector, append), 0)
+        try:
+            self.assertEqual(encoder.json.Encoder().encode([Vector([1, 2, 3]), [4]]), '["1x2x3",[4]]')
+        finally:
+            api.register_type(Vector, self.APPEND())
+
+        self.assertEqual(encoder.json.Encoder().encode([Vector([1, 2, 3])]), '[[1,2,3]]')
+
+    def test_register_type_in(self):
+        import importlib.util
+
+        api = self.api
+
+        spec = importlib.util.find_spec('_encoder')
+        other = importlib.util.module_from_spec(spec)
+        spec.loader.exec_module(other)
+
+        class Encoder(other.Encoder):
+            STRING_QUOTE = '"'
+            STRING_ESCAPES = {'"': '\\"'}
+
+        def append_vector(encoder, o):
+            return api.append(encoder, 'vector')
+
+        append = self.APPEND(append_vector)
+
+        class Vector(list):
+            pass
+
+        self.assertEqual(api.register_type_in(other, Vector, append), 0)
+        self.assertEqual(Encoder().encode([Vector([1])]), '["vector"]')
+        self.assertEqual(encoder.json.Encoder().encode([Vector([1])]), '[[1]]')
+
+        self.assertRaises(TypeError, api.register_type_in, encoder, Vector, append)
+
+class MemoTests(unittest.TestCase):
+    def setUp(self):
+        self.calls = []
+        calls = self.calls
+
+        class Config:
+            def __init__(self, items):
+                self.items = items
+
+        class Encoder(encoder.json.Encoder):
+            MEMO_BUDGET = 100
+
+            def make_iterencode(self, type):
+                if type is Config:
+                    def iterencode(config):
+                        calls.append(config)
+                        yield config.items
+                    return iterencode
+                return super().make_iterencode(type)
+
+        self.Config = Config
+        self.encoder = Encoder()
+
+    def test_memoize(self):
+        config = self.Config(['a', 1])
+        self.encoder.memoize(config)
+
+        for i in range(3):
+            self.assertEqual(self.encoder.encode([i, config, config]), '[{0},["a",1],["a",1]]'.format(i))
+        self.assertEqual(len(self.calls), 1)
+
+    def test_max_bytes_while_memoizing(self):
+        config = self.Config([self.Config('x' * 100) for _ in range(10000)])
+        self.encoder.memoize(config)
+
+        self.assertRaises(encoder.abc.EncodeLimitError, self.encoder.encode_bytes, [config], max_bytes=1000)
+        # Given up at the budget, not after encoding the lot
+        self.assertLess(len(self.calls), 100)
+
+        self.calls.clear()
+        self.assertEqual(self.encoder.encode_bytes([config]), b'[[' + b','.join([b'"' + b'x' * 100 + b'"'] * 10000) + b']]')
+        self.assertEqual(len(self.calls), 10001)
+
+    def test_tuple(self):
+        t = (1, 2, 3)
+        self.encoder.memoize(t)
+        self.assertEqual(self.encoder.encode([t, t]), '[[1,2,3],[1,2,3]]')
+        self.assertEqual(self.encoder.encode((1, 2, 3)[:2]), '[1,2]')
+
+    def test_forget_and_invalidate(self):
+        a = self.Config([1])
+        b = self.Config([2])
+        self.encoder.memoize(a, token='v1')
+        self.encoder.memoize(b, token='v1')
+
+        self.encoder.encode([a, b])
+        self.encoder.encode([a, b])
+        self.assertEqual(len(self.calls), 2)
+
+        self.encoder.forget(a)
+        self.encoder.encode([a, b])
+        self.assertEqual(len(self.calls), 3)
+
+        self.encoder.invalidate('v1')
+        self.encoder.encode([a, b])
+        self.assertEqual(len(self.calls), 5)
+
+    def test_budget(self):
+        configs = [self.Config(['x' * 40]) for i in range(3)]
+        for config in configs:
+            self.encoder.memoize(config)
+
+        self.encoder.encode(configs)        # Third evicts first
+        self.encoder.encode(configs[1:])
+        self.assertEqual(len(self.calls), 3)
+        self.encoder.encode(configs[0])
+        self.assertEqual(len(self.calls), 4)
+
+    def test_weak(self):
+        import gc
+
+        config = self.Config([1])
+        self.encoder.memoize(config)
+        self.encoder.encode(config)
+        del config
+        gc.collect()
+
+        # Whatever gets the address next isn't mistaken for it
+        for i in range(100):
+            self.assertEqual(self.encoder.encode(self.Config([i])), '[{}]'.format(i))
+
+    def test_msgpack(self):
+        import encoder.msgpack
+        e = encoder.msgpack.Encoder()
+        t = ('a', 1)
+        e.memoize(t)
+        self.assertEqual(e.encode_bytes([t, t]), b'\x92\x92\xa1a\x01\x92\xa1a\x01')
+
+class RawTests(unittest.TestCase):
+    def test_raw(self):
+        from encoder.abc import Raw
+
+        fragment = Raw(b'{"cached":[1,2]}')
+        self.assertEqual(encoder.json.Encoder().encode([fragment, Raw('"é"'), Raw(bytearray(b'3'))]),
+                         '[{"cached":[1,2]},"é",3]')
+        self.assertEqual(fragment.data, b'{"cached":[1,2]}')
+        self.assertRaises(TypeError, Raw, 1.5)
+        self.assertRaises(TypeError, Raw, b'1', data=b'2')
+
+    def test_validate_raw(self):
+        import json
+        from encoder.abc import Raw
+
+        class Encoder(encoder.json.Encoder):
+            def validate_raw(self, data):
+                json.loads(data)
+
+        self.assertEqual(Encoder().encode({'a': Raw(b'[1]')}), '{"a":[1]}')
+        self.assertRaises(ValueError, Encoder().encode, [Raw(b'[1')])
+
+    def test_msgpack(self):
+        import encoder.msgpack
+        from encoder.abc import Raw
+
+        self.assertEqual(encoder.msgpack.Encoder().encode_bytes([Raw(b'\xc0')]), b'\x91\xc0')
+
+class MappingTests(unittest.TestCase):
+    def setUp(self):
+        self.encode = encoder.json.Encoder().encode
+
+    def test_ordered_dict(self):
+        from collections import OrderedDict
+
+        od = OrderedDict([('a', 1), ('b', 2), ('c', 3)])
+        od.move_to_end('a')
+        self.assertEqual(self.encode(od), '{"b":2,"c":3,"a":1}')
+        self.assertEqual(self.encode(OrderedDict()), '{}')
+
+    def test_dict_subclass(self):
+        class Sub(dict):
+            pass
+
+        self.assertEqual(self.encode(Sub([('z', 1), ('a', [2])])), '{"z":1,"a":[2]}')
+
+    def test_items_overridden(self):
+        class Sorted(dict):
+            def items(self):
+                return iter(sorted(dict.items(self)))
+
+        self.assertEqual(self.encode(Sorted([('z', 1), ('a', 2)])), '{"a":2,"z":1}')
+
+    def test_bad_items(self):
+        class Bad(dict):
+            def items(self):
+                return [1]
+
+        self.assertRaises(TypeError, self.encode, Bad(a=1))
+
+    def test_msgpack(self):
+        from collections import OrderedDict
+        import encoder.msgpack
+
+        od = OrderedDict([('a', 1), ('b', 2)])
+        od.move_to_end('a')
+        self.assertEqual(encoder.msgpack.Encoder().encode_bytes(od), b'\x82\xa1b\x02\xa1a\x01')
+
+class RecordsTests(unittest.TestCase):
+    def setUp(self):
+        self.encoder = encoder.json.Encoder()
+
+    def check(self, columns):
+        n = len(next(iter(columns.values()))) if columns else 0
+        rows = [{key: values[i] for key, values in columns.items()} for i in range(n)]
+        self.assertEqual(self.encoder.encode_records(columns), self.encoder.encode_bytes(rows))
+
+    def test_sequences(self):
+        self.check({'a': [1, 2, 3], 'b"': ('x', None, [True]), 'c': [1.5, 2.0, -1.0]})
+        self.check({'a': []})
+        self.assertEqual(self.encoder.encode_records({}), b'[]')
+
+    def test_buffers(self):
+        import array
+
+        self.check({
+            'i': array.array('i', [1, -2, 3]),
+            'Q': array.array('Q', [0, 1, 2 ** 40]),
+            'd': array.array('d', [0.5, -1.25, 3.0]),
+            'f': array.array('f', [0.5, 1.0, 2.0]),
+            'b': array.array('b', [-128, 0, 127]),
+            'bytes': b'abc',
+            'm': memoryview(array.array('h', [1, 2, 3, 4, 5, 6]))[::2],
+            })
+
+    def test_buffer_floats(self):
+        import array
+        import json
+
+        values = [1e300, 1e-7, 3.0, float('inf'), float('-inf'), -0.0]
+        self.check({'d': array.array('d', values)})
+        self.assertEqual(json.loads(self.encoder.encode_records({'d': array.array('d', values[:3])})),
+                         [{'d': 1e300}, {'d': 1e-7}, {'d': 3.0}])
+
+        # Long output straddling a resize
+        for n in range(900, 1031):
+            self.check({'s': ['x' * n], 'a': array.array('d', [1e300]), 't': ['y' * 5000]})
+
+    def test_unequal(self):
+        self.assertRaises(ValueError, self.encoder.encode_records, {'a': [1], 'b': [1, 2]})
+        self.assertEqual(self.encoder.encode_bytes([1]), b'[1]')
+
+    def test_unencodable(self):
+        self.assertRaises(encoder.abc.CannotEncode, self.encoder.encode_records, {'a': [object()]})
+
+    def test_column_changed_by_hook(self):
+        column = ['a', object(), 'b']
+
+        class Encoder(encoder.json.Encoder):
+            def make_iterencode(self, type):
+                def iterencode(o):
+                    column.clear()
+                    yield 'x'
+                return iterencode
+
+        self.assertEqual(Encoder().encode_records({'c': column}), b'[{"c":"a"},{"c":"x"},{"c":"b"}]')
+
+    def test_json_only(self):
+        import encoder.cbor
+        import encoder.csv
+        import encoder.msgpack
+        import encoder.xml
+
+        for module in (encoder.cbor, encoder.csv, encoder.msgpack, encoder.xml):
+            self.assertRaises(TypeError, module.Encoder().encode_records, {'a': [1, 2]})
+
+class ModuleStateTests(unittest.TestCase):
+    def test_independent_instances(self):
+        import importlib.util
+        import _encoder
+
+        spec = importlib.util.find_spec('_encoder')
+        other = importlib.util.module_from_spec(spec)
+        spec.loader.exec_module(other)
+
+        self.assertIsNot(other.Encoder, _encoder.Encoder)
+        self.assertIsNot(other.Raw, _encoder.Raw)
+
+        # Each module's Raw is its own; the other's goes through make_iterencode
+        json = encoder.json.Encoder()
+        self.assertEqual(json.encode_bytes([_encoder.Raw(b'{}')]), b'[{}]')
+        self.assertRaises(encoder.abc.CannotEncode, json.encode_bytes, other.Raw(b'{}'))
+
+    def test_subinterpreter(self):
+        import sys
+
+        # Legacy ones share the main GIL; from 3.12, isolated ones have their own
+        try:
+            import _interpreters as interpreters
+            kinds = {'legacy': lambda: interpreters.create('legacy'),
+                     'own GIL': lambda: interpreters.create('isolated')}
+        except ImportError:
+            try:
+                import _xxsubinterpreters as interpreters
+            except ImportError:
+                self.skipTest('no subinterpreters')
+            kinds = {'legacy': lambda: interpreters.create(isolated=False)}
+            if sys.version_info >= (3, 12):
+                kinds['own GIL'] = lambda: interpreters.create(isolated=True)
+
+        code = 'import sys; sys.path[:] = {!r}\n'.format(sys.path) + (
+            'import datetime, encoder.json, _encoder\n'
+            'e = encoder.json.Encoder()\n'
+            'assert e.encode_bytes({"a": [1, _encoder.Raw(b"2")]}) == b\'{"a":[1,2]}\'\n'
+            'assert b"".join(e.encode_segments(["x" * 100000])) == e.encode_bytes(["x" * 100000])\n'
+            'class Native(encoder.json.Encoder):\n'
+            '    NATIVE_TYPES = (datetime.datetime, datetime.date, datetime.time)\n'
+            'd = datetime.datetime(2024, 2, 29, 12, 30, 5, 123, datetime.timezone(datetime.timedelta(hours=-5)))\n'
+            'assert Native().encode([d, d.date(), d.timetz()]) == \'["2024-02-29T12:30:05.000123-05:00","2024-02-29","12:30:05.000123-05:00"]\'\n'
+            )
+
+        for kind, create in kinds.items():
+            with self.subTest(kind):
+                interp = create()
+                try:
+                    # 3.13 returns the exception, earlier versions raise it
+                    self.assertIsNone(interpreters.run_string(interp, code))
+                finally:
+                    interpreters.destroy(interp)
+
+class LimitsTests(unittest.TestCase):
+    def setUp(self):
+        self.encoder = encoder.json.Encoder()
+
+    def assertLimit(self, o, **limits):
+        self.assertRaises(encoder.abc.EncodeLimitError, self.encoder.encode_bytes, o, **limits)
+
+    def test_max_bytes(self):
+        o = {'a': ['x' * 10, 1.5, None]}
+        expected = self.encoder.encode_bytes(o)
+
+        self.assertEqual(self.encoder.encode_bytes(o, max_bytes=len(expected)), expected)
+        self.assertLimit(o, max_bytes=len(expected) - 1)
+        self.assertLimit(['x' * 100000], max_bytes=1000)
+
+        # With the buffer already grown past the budget
+        self.encoder.encode_bytes(['x' * 100000])
+        self.assertLimit(['x' * 100000], max_bytes=1000)
+
+        self.assertEqual(self.encoder.encode_bytes(o), expected)
+        self.assertEqual(self.encoder.encode(o, max_bytes=None), expected.decode())
+
+    def test_max_depth(self):
+        self.assertEqual(self.encoder.encode_bytes([[1], {'a': [2]}], max_depth=3), b'[[1],{"a":[2]}]')
+        self.assertLimit([[1], {'a': [2]}], max_depth=2)
+        self.assertLimit([[[]]], max_depth=2)
+
+        deep = []
+        for i in range(100000):
+            deep = [deep]
+        self.assertLimit(deep, max_depth=100)
+
+    def test_max_items(self):
+        self.assertEqual(self.encoder.encode_bytes([[1, 2], {'a': 3}], max_items=5), b'[[1,2],{"a":3}]')
+        self.assertLimit([[1, 2], {'a': 3}], max_items=4)
+        self.assertLimit(range(10), max_items=5)
+
+    def test_nested_encode(self):
+        e = NestedEncodeTests().encoder()
+        o = [NestedEncodeTests.Point(1, 'x' * 100)]
+
+        self.assertEqual(e.encode_bytes(o, max_bytes=200), e.encode_bytes(o))
+        self.assertRaises(encoder.abc.EncodeLimitError, e.encode_bytes, o, max_bytes=50)
+
+    def test_nested_encode_unlimited(self):
+        class P:
+            pass
+
+        class Encoder(encoder.json.Encoder):
+            def make_iterencode(self, type):
+                return lambda o: iter([encoder.abc.Raw(self.encode([[[[1]]]]))])
+
+        e = Encoder()
+        self.assertEqual(e.encode_bytes([P()], max_depth=3, max_items=3), b'[[[[[1]]]]]')
+
+    def test_iterated_items(self):
+        import encoder.cbor
+
+        class Encoder(encoder.json.Encoder):
+            def make_iterencode(self, type):
+                return lambda o: iter(range(10 ** 5))
+
+        self.assertRaises(encoder.abc.EncodeLimitError, Encoder().encode_bytes, [object()], max_items=10)
+        self.assertRaises(encoder.abc.EncodeLimitError,
+                          encoder.cbor.Encoder().encode_bytes, (i for i in range(10 ** 5)), max_items=10)
+        self.assertEqual(encoder.cbor.Encoder().encode_bytes(iter([1, 2]), max_items=2), b'\x9f\x01\x02\xff')
+
+    def test_other_formats(self):
+        import encoder.cbor
+        import encoder.msgpack
+
+        for e in encoder.msgpack.Encoder(), encoder.cbor.Encoder():
+            self.assertEqual(e.encode_bytes({'a': [1, 2]}, max_items=3, max_depth=2), e.encode_bytes({'a': [1, 2]}))
+            self.assertRaises(encoder.abc.EncodeLimitError, e.encode_bytes, {'a': [1, 2]}, max_items=2)
+            self.assertRaises(encoder.abc.EncodeLimitError, e.encode_bytes, [b'x' * 1000], max_bytes=100)
+
+    def test_arguments(self):
+        self.assertRaises(ValueError, self.encoder.encode_bytes, 1, max_bytes=-1)
+        self.assertRaises(TypeError, self.encoder.encode_bytes, 1, max_depth='1')
+        self.assertRaises(TypeError, self.encoder.encode_bytes, 1, max_size=1)
+        self.assertRaises(TypeError, self.encoder.encode_bytes, 1, 2)
+        self.assertTrue(issubclass(encoder.abc.EncodeLimitError, ValueError))
@@ -0,0 +1,76 @@
+import struct
+import unittest
+
+import encoder.msgpack
+
+class MsgpackTests(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.encode = encoder.msgpack.Encoder().encode_bytes
+
+    def check(self, o:object, b:bytes):
+        self.assertEqual(self.encode(o), b)
+
+    def test_constants(self):
+        self.check(None, b'\xc0')
+        self.check(True, b'\xc3')
+        self.check(False, b'\xc2')
+
+    def test_int(self):
+        self.check(0, b'\x00')
+        self.check(127, b'\x7f')
+        self.check(128, b'\xcc\x80')
+        self.check(65535, b'\xcd\xff\xff')
+        self.check(2 ** 32, b'\xcf\x00\x00\x00\x01\x00\x00\x00\x00')
+        self.check(2 ** 64 - 1, b'\xcf' + b'\xff' * 8)
+        self.check(-1, b'\xff')
+        self.check(-32, b'\xe0')
+        self.check(-33, b'\xd0\xdf')
+        self.check(-2 ** 63, b'\xd3\x80' + b'\x00' * 7)
+        self.assertRaises(OverflowError, self.encode, 2 ** 64)
+
+    def test_float(self):
+        self.check(1.5, b'\xca\x3f\xc0\x00\x00')
+        self.check(0.1, b'\xcb\x3f\xb9\x99\x99\x99\x99\x99\x9a')
+        self.check(float('inf'), b'\xca\x7f\x80\x00\x00')
+        self.check(3.4028234663852886e+38, b'\xca\x7f\x7f\xff\xff')
+        self.check(1e300, b'\xcb' + struct.pack('>d', 1e300))
+        self.check(-1e39, b'\xcb' + struct.pack('>d', -1e39))
+
+    def test_str(self):
+        self.check('', b'\xa0')
+        self.check('abc', b'\xa3abc')
+        self.check('é', b'\xa2\xc3\xa9')
+        self.check('x' * 32, b'\xd9\x20' + b'x' * 32)
+
+    def test_bin(self):
+        self.check(b'ab', b'\xc4\x02ab')
+
+    def test_containers(self):
+        self.check([1, 2], b'\x92\x01\x02')
+        self.check((), b'\x90')
+        self.check(list(range(16)), b'\xdc\x00\x10' + bytes(range(16)))
+        self.check({'a': 1}, b'\x81\xa1a\x01')
+
+    def test_ordered_mapping(self):
+        from collections import OrderedDict
+        self.check(OrderedDict([('b', 1), ('a', 2)]), b'\x82\xa1b\x01\xa1a\x02')
+
+    def test_encode_segments(self):
+        o = [{'key': 'x' * 1000, 'n': 2 ** 40}] * 200
+        segments = encoder.msgpack.Encoder().encode_segments(o)
+        self.assertGreater(len(segments), 1)
+        self.assertEqual(b''.join(segments), self.encode(o))
+
+    def test_make_iterencode(self):
+        class Point:
+            def __init__(self, x, y):
+                self.x, self.y = x, y
+
+        class Encoder(encoder.msgpack.Encoder):
+            def make_iterencode(self, type):
+                if type is Point:
+                    return lambda p: iter([[p.x, p.y]])
+                return super().make_iterencode(type)
+
+        self.assertEqual(Encoder().encode_bytes([Point(1, 2)]), b'\x91\x92\x01\x02')
@@ -14,3 +14,99 @@ class XmlTests(unittest.TestCase):
                     yield 'Hello world!'
 
         self.assertEqual(self.encode(SampleDoc()), '<body>Hello world!</body>')
+
+    def test_nested_elements(self):
+        class Doc:
+            def __xml__(self, tag):
+                with tag.doc():
+                    for i in range(3):
+                        with tag.item():
+                            yield i
+
+        self.assertEqual(self.encode(Doc()), '<doc><item>0</item><item>1</item><item>2</item></doc>')
+
+    def test_many_elements(self):
+        # Well past the initial buffer size, and the element free list.
+        class Doc:
+            def __xml__(self, tag):
+                with tag.doc():
+                    for i in range(10000):
+                        with tag.item():
+                            yield 'x'
+
+        self.assertEqual(self.encode(Doc()), '<doc>' + '<item>x</item>' * 10000 + '</doc>')
+
+    def test_attributes(self):
+        class Doc:
+            def __xml__(self, tag):
+                with tag.a(href='x"y'):
+                    yield 'link'
+
+        self.assertEqual(self.encode(Doc()), '<a href="x&quot;y">link</a>')
+
+class XmlWriterTests(unittest.TestCase):
+    def setUp(self):
+        self.encoder = encoder.xml.Encoder()
+        self.writer = self.encoder.writer()
+
+    def test_events(self):
+        w = self.writer
+        w.start(self.encoder.tag.doc)
+        w.start('item', {'id': 1})
+        w.text('a < b')
+        w.end()
+        w.element(self.encoder.tag.leaf, 2)
+        w.elements('n', [1, 2])
+        w.end()
+
+        self.assertEqual(w.getvalue(), b'<doc><item id="1">a &lt; b</item><leaf>2</leaf><n>1</n><n>2</n></doc>')
+
+    def test_getvalue_clears(self):
+        self.writer.element('a', 'x')
+        self.assertEqual(self.writer.getvalue(), b'<a>x</a>')
+        self.assertEqual(self.writer.getvalue(), b'')
+        self.assertEqual(self.encoder.encode('y'), 'y')
+
+    def test_unbalanced(self):
+        self.assertRaises(RuntimeError, self.writer.end)
+
+        self.writer.start('a')
+        self.assertRaises(RuntimeError, self.writer.getvalue)
+
+class TemplateTests(unittest.TestCase):
+    SPEC = ('row', [('id', 'id'), ('name', {'lang': 'lang'}, 'name')])
+
+    def setUp(self):
+        self.encoder = encoder.xml.Encoder()
+        self.template = self.encoder.template(self.SPEC)
+
+    def test_dicts(self):
+        self.assertEqual(
+            self.template.encode_bytes([
+                {'id': 1, 'lang': 'en', 'name': 'a&b'},
+                {'id': 2, 'lang': 'fr', 'name': 'c'},
+                ]),
+            b'<row><id>1</id><name lang="en">a&amp;b</name></row>'
+            b'<row><id>2</id><name lang="fr">c</name></row>')
+
+    def test_tuples(self):
+        self.assertEqual(
+            self.template.encode_bytes([(1, 'en', 'a')]),
+            b'<row><id>1</id><name lang="en">a</name></row>')
+
+    def test_missing_slot(self):
+        self.assertRaises(KeyError, self.template.encode_bytes, [{'id': 1}])
+        self.assertRaises(ValueError, self.template.encode_bytes, [(1,)])
+
+    def test_apply_in_document(self):
+        template = self.template
+
+        class Doc:
+            def __xml__(self, tag):
+                with tag.rows():
+                    template.apply((1, 'en', 'a'))
+                    yield ''
+
+        self.assertEqual(
+            self.encoder.encode(Doc()),
+            '<rows><row><id>1</id><name lang="en">a</name></row></rows>')